@@ -0,0 +1,226 @@
+#include "CAdaptiveOctree.h"
+
+// Corners at the ends of the twelve cube edges: four along x, four along y, four along z
+static const int OctreeEdgeCorners[12][2] = { { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }, { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 }, { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 } };
+
+// Pairs of children that share a face inside a cell, and the axis of the face
+static const int CellProcFaceMask[12][3] = { { 0, 4, 0 }, { 1, 5, 0 }, { 2, 6, 0 }, { 3, 7, 0 }, { 0, 2, 1 }, { 4, 6, 1 }, { 1, 3, 1 }, { 5, 7, 1 }, { 0, 1, 2 }, { 2, 3, 2 }, { 4, 5, 2 }, { 6, 7, 2 } };
+
+// Quadruples of children that share an edge inside a cell, and the axis of the edge
+static const int CellProcEdgeMask[6][5] = { { 0, 1, 2, 3, 0 }, { 4, 5, 6, 7, 0 }, { 0, 4, 1, 5, 1 }, { 2, 6, 3, 7, 1 }, { 0, 2, 4, 6, 2 }, { 1, 3, 5, 7, 2 } };
+
+// Children of two face neighbors that share the four sub faces
+static const int FaceProcFaceMask[3][4][3] =
+{
+	{ { 4, 0, 0 }, { 5, 1, 0 }, { 6, 2, 0 }, { 7, 3, 0 } },
+	{ { 2, 0, 1 }, { 6, 4, 1 }, { 3, 1, 1 }, { 7, 5, 1 } },
+	{ { 1, 0, 2 }, { 3, 2, 2 }, { 5, 4, 2 }, { 7, 6, 2 } }
+};
+
+// Children of two face neighbors around the four edges inside the face: which neighbor each
+// of the four comes from (order 0 or 1), the children, and the axis of the edge
+static const int FaceProcEdgeMask[3][4][6] =
+{
+	{ { 1, 4, 0, 5, 1, 1 }, { 1, 6, 2, 7, 3, 1 }, { 0, 4, 6, 0, 2, 2 }, { 0, 5, 7, 1, 3, 2 } },
+	{ { 0, 2, 3, 0, 1, 0 }, { 0, 6, 7, 4, 5, 0 }, { 1, 2, 0, 6, 4, 2 }, { 1, 3, 1, 7, 5, 2 } },
+	{ { 1, 1, 0, 3, 2, 0 }, { 1, 5, 4, 7, 6, 0 }, { 0, 1, 5, 0, 4, 1 }, { 0, 3, 7, 2, 6, 1 } }
+};
+
+static const int FaceProcEdgeOrder[2][4] = { { 0, 0, 1, 1 }, { 0, 1, 0, 1 } };
+
+// Children of four edge neighbors around the two halves of the edge
+static const int EdgeProcEdgeMask[3][2][5] =
+{
+	{ { 3, 2, 1, 0, 0 }, { 7, 6, 5, 4, 0 } },
+	{ { 5, 1, 4, 0, 1 }, { 7, 3, 6, 2, 1 } },
+	{ { 6, 4, 2, 0, 2 }, { 7, 5, 3, 1, 2 } }
+};
+
+// The edge of each of four edge neighbors that is the shared one
+static const int ProcessEdgeMask[3][4] = { { 3, 2, 1, 0 }, { 7, 5, 6, 4 }, { 11, 10, 9, 8 } };
+
+
+CAdaptiveOctree::CAdaptiveOctree()
+{
+}
+
+CAdaptiveOctree::~CAdaptiveOctree()
+{
+}
+
+//=============================================================================
+void CAdaptiveOctree::Reset(const int nRootSize)
+{
+	m_Nodes.clear();
+	m_Nodes.emplace_back();
+
+	SOctreeNode& Root = m_Nodes.back();
+
+	Root.X = 0;
+	Root.Y = 0;
+	Root.Z = 0;
+	Root.Size = nRootSize;
+	Root.Children = NO_INDEX;
+	Root.Vertex = NO_INDEX;
+	Root.Corners = 0;
+}
+
+//=============================================================================
+int32_t CAdaptiveOctree::Subdivide(const int32_t nNode)
+{
+	const int32_t First = static_cast<int32_t>(m_Nodes.size());
+
+	m_Nodes.resize(First + 8);
+
+	const SOctreeNode& Parent = m_Nodes[nNode];
+	const int32_t Half = Parent.Size / 2;
+
+	for (int i = 0; i < 8; i++)
+	{
+		SOctreeNode& Child = m_Nodes[First + i];
+
+		Child.X = Parent.X + ((i >> 2) & 1) * Half;
+		Child.Y = Parent.Y + ((i >> 1) & 1) * Half;
+		Child.Z = Parent.Z + (i & 1) * Half;
+		Child.Size = Half;
+		Child.Children = NO_INDEX;
+		Child.Vertex = NO_INDEX;
+		Child.Corners = 0;
+	}
+
+	m_Nodes[nNode].Children = First;
+
+	return First;
+}
+
+//=============================================================================
+void CAdaptiveOctree::Contour(std::vector<int32_t>& Quads) const
+{
+	if (!m_Nodes.empty())
+		CellProc(0, Quads);
+}
+
+//=============================================================================
+void CAdaptiveOctree::CellProc(const int32_t nNode, std::vector<int32_t>& Quads) const
+{
+	if (IsLeaf(nNode))
+		return;
+
+	const int32_t First = m_Nodes[nNode].Children;
+
+	for (int i = 0; i < 8; i++)
+		CellProc(First + i, Quads);
+
+	for (int i = 0; i < 12; i++)
+	{
+		const int32_t FaceNodes[2] = { First + CellProcFaceMask[i][0], First + CellProcFaceMask[i][1] };
+
+		FaceProc(FaceNodes, CellProcFaceMask[i][2], Quads);
+	}
+
+	for (int i = 0; i < 6; i++)
+	{
+		const int32_t EdgeNodes[4] =
+		{
+			First + CellProcEdgeMask[i][0],
+			First + CellProcEdgeMask[i][1],
+			First + CellProcEdgeMask[i][2],
+			First + CellProcEdgeMask[i][3]
+		};
+
+		EdgeProc(EdgeNodes, CellProcEdgeMask[i][4], Quads);
+	}
+}
+
+//=============================================================================
+void CAdaptiveOctree::FaceProc(const int32_t Nodes[2], const int nDir, std::vector<int32_t>& Quads) const
+{
+	if (IsLeaf(Nodes[0]) && IsLeaf(Nodes[1]))
+		return;
+
+	// A leaf stands in for all of its missing children
+	for (int i = 0; i < 4; i++)
+	{
+		int32_t FaceNodes[2];
+
+		for (int j = 0; j < 2; j++)
+			FaceNodes[j] = IsLeaf(Nodes[j]) ? Nodes[j] : m_Nodes[Nodes[j]].Children + FaceProcFaceMask[nDir][i][j];
+
+		FaceProc(FaceNodes, FaceProcFaceMask[nDir][i][2], Quads);
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		const int* Order = FaceProcEdgeOrder[FaceProcEdgeMask[nDir][i][0]];
+		int32_t EdgeNodes[4];
+
+		for (int j = 0; j < 4; j++)
+		{
+			const int32_t Node = Nodes[Order[j]];
+
+			EdgeNodes[j] = IsLeaf(Node) ? Node : m_Nodes[Node].Children + FaceProcEdgeMask[nDir][i][j + 1];
+		}
+
+		EdgeProc(EdgeNodes, FaceProcEdgeMask[nDir][i][5], Quads);
+	}
+}
+
+//=============================================================================
+void CAdaptiveOctree::EdgeProc(const int32_t Nodes[4], const int nDir, std::vector<int32_t>& Quads) const
+{
+	if (IsLeaf(Nodes[0]) && IsLeaf(Nodes[1]) && IsLeaf(Nodes[2]) && IsLeaf(Nodes[3]))
+	{
+		ProcessEdge(Nodes, nDir, Quads);
+		return;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		int32_t EdgeNodes[4];
+
+		for (int j = 0; j < 4; j++)
+			EdgeNodes[j] = IsLeaf(Nodes[j]) ? Nodes[j] : m_Nodes[Nodes[j]].Children + EdgeProcEdgeMask[nDir][i][j];
+
+		EdgeProc(EdgeNodes, EdgeProcEdgeMask[nDir][i][4], Quads);
+	}
+}
+
+//=============================================================================
+void CAdaptiveOctree::ProcessEdge(const int32_t Nodes[4], const int nDir, std::vector<int32_t>& Quads) const
+{
+	// The smallest leaf holds the whole edge, its corners tell whether the surface crosses it
+	int MinSize = INT32_MAX;
+	int MinIndex = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (m_Nodes[Nodes[i]].Size < MinSize)
+		{
+			MinSize = m_Nodes[Nodes[i]].Size;
+			MinIndex = i;
+		}
+	}
+
+	const int Edge = ProcessEdgeMask[nDir][MinIndex];
+	const uint8_t Corners = m_Nodes[Nodes[MinIndex]].Corners;
+	const uint8_t Inside0 = Corners & (1 << OctreeEdgeCorners[Edge][0]);
+	const uint8_t Inside1 = Corners & (1 << OctreeEdgeCorners[Edge][1]);
+
+	if (!Inside0 == !Inside1)
+		return;
+
+	if (Inside0)
+	{
+		Quads.push_back(Nodes[0]);
+		Quads.push_back(Nodes[2]);
+		Quads.push_back(Nodes[3]);
+		Quads.push_back(Nodes[1]);
+	}
+	else
+	{
+		Quads.push_back(Nodes[0]);
+		Quads.push_back(Nodes[1]);
+		Quads.push_back(Nodes[3]);
+		Quads.push_back(Nodes[2]);
+	}
+}
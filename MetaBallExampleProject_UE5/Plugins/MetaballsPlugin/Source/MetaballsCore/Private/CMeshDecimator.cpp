@@ -0,0 +1,375 @@
+#include "CMeshDecimator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Weight that pulls a merged vertex towards the mean of its cube, per vertex. Along directions no
+// tangent plane fixes, like across a flat cube, the mean decides alone.
+static const double MeanWeight = 0.1;
+
+// Double precision accumulator, the float vertices of a cube are summed and solved for in doubles
+struct SVector3d
+{
+	double X;
+	double Y;
+	double Z;
+
+	SVector3d() : X(0), Y(0), Z(0) {}
+	SVector3d(const double InX, const double InY, const double InZ) : X(InX), Y(InY), Z(InZ) {}
+	SVector3d(const SVector3f& V) : X(V.X), Y(V.Y), Z(V.Z) {}
+
+	SVector3d operator+(const SVector3d& V) const { return SVector3d(X + V.X, Y + V.Y, Z + V.Z); }
+	SVector3d operator-(const SVector3d& V) const { return SVector3d(X - V.X, Y - V.Y, Z - V.Z); }
+	SVector3d operator*(const double Scale) const { return SVector3d(X * Scale, Y * Scale, Z * Scale); }
+	SVector3d operator/(const double Scale) const { return SVector3d(X / Scale, Y / Scale, Z / Scale); }
+	SVector3d& operator+=(const SVector3d& V) { X += V.X; Y += V.Y; Z += V.Z; return *this; }
+	SVector3d& operator/=(const double Scale) { X /= Scale; Y /= Scale; Z /= Scale; return *this; }
+
+	static double DotProduct(const SVector3d& A, const SVector3d& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z; }
+};
+
+template <typename T>
+static T Clamp(const T Value, const T Min, const T Max)
+{
+	return Value < Min ? Min : Value < Max ? Value : Max;
+}
+
+
+CMeshDecimator::CMeshDecimator() : m_fCellSize(1), m_nCubesPerAxis(1), m_nNumChunks(1), m_nNumWorkers(1), m_pVertices(nullptr), m_pTriangles(nullptr), m_pNormals(nullptr)
+{
+	m_ParallelFor = [](const int32_t Num, const std::function<void(int32_t)>& Body)
+	{
+		for (int32_t i = 0; i < Num; i++)
+			Body(i);
+	};
+}
+
+CMeshDecimator::~CMeshDecimator()
+{
+}
+
+//=============================================================================
+int32_t CMeshDecimator::Cluster(const std::vector<SVector3f>& Vertices, const std::vector<int32_t>& Triangles, const SVector3f& Origin, const float fExtent, const float fCellSize, const int nNumChunks, const int nNumWorkers)
+{
+	m_Origin = Origin;
+	m_fCellSize = fCellSize;
+	m_nCubesPerAxis = std::max(static_cast<int>(std::floor(fExtent / fCellSize)) + 1, 1);
+	m_nNumChunks = Clamp(nNumChunks, 1, m_nCubesPerAxis);
+	m_nNumWorkers = Clamp(nNumWorkers, 1, m_nNumChunks);
+
+	const int NumChunks = m_nNumChunks;
+	const int32_t NumVertices = static_cast<int32_t>(Vertices.size());
+	const int32_t NumTriangles = static_cast<int32_t>(Triangles.size()) / 3;
+
+	m_Keys.resize(NumVertices);
+	m_VertexCluster.resize(NumVertices);
+	m_ChunkStart.resize(NumChunks + 1);
+	m_ChunkClusters.resize(NumChunks + 1);
+	m_RangeChunkCounts.resize(NumChunks * NumChunks);
+	m_TriangleStart.resize(NumChunks + 1);
+
+	m_pVertices = &Vertices;
+	m_pTriangles = &Triangles;
+
+	// Cube of every vertex, and how many vertices of each range fall in each chunk. The cube is
+	// kept in the cluster array until the clusters are known.
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks, NumVertices](int32_t Worker)
+	{
+		const std::vector<SVector3f>& Vertices = *m_pVertices;
+
+		for (int Range = Worker; Range < NumChunks; Range += m_nNumWorkers)
+		{
+			int32_t* Counts = &m_RangeChunkCounts[Range * NumChunks];
+
+			memset(Counts, 0, NumChunks * sizeof(int32_t));
+
+			for (int32_t i = GetRangeStart(NumVertices, Range); i < GetRangeStart(NumVertices, Range + 1); i++)
+			{
+				m_VertexCluster[i] = GetCube(Vertices[i]);
+				Counts[GetChunkOfCube(m_VertexCluster[i])]++;
+			}
+		}
+	});
+
+	// Chunks take the keys in range order, so a chunk lists its vertices in mesh order before sorting
+	int32_t Offset = 0;
+
+	for (int Chunk = 0; Chunk < NumChunks; Chunk++)
+	{
+		m_ChunkStart[Chunk] = Offset;
+
+		for (int Range = 0; Range < NumChunks; Range++)
+		{
+			const int32_t Count = m_RangeChunkCounts[Range * NumChunks + Chunk];
+
+			m_RangeChunkCounts[Range * NumChunks + Chunk] = Offset;
+			Offset += Count;
+		}
+	}
+
+	m_ChunkStart[NumChunks] = Offset;
+
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks, NumVertices](int32_t Worker)
+	{
+		for (int Range = Worker; Range < NumChunks; Range += m_nNumWorkers)
+		{
+			int32_t* Offsets = &m_RangeChunkCounts[Range * NumChunks];
+
+			for (int32_t i = GetRangeStart(NumVertices, Range); i < GetRangeStart(NumVertices, Range + 1); i++)
+			{
+				const uint32_t Cube = static_cast<uint32_t>(m_VertexCluster[i]);
+
+				m_Keys[Offsets[GetChunkOfCube(Cube)]++] = (static_cast<uint64_t>(Cube) << 32) | static_cast<uint32_t>(i);
+			}
+		}
+	});
+
+	// The vertices of a cube are one run of keys once a chunk is sorted, every run is a cluster
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks](int32_t Worker)
+	{
+		for (int Chunk = Worker; Chunk < NumChunks; Chunk += m_nNumWorkers)
+		{
+			uint64_t* Keys = m_Keys.data() + m_ChunkStart[Chunk];
+			const int32_t NumKeys = m_ChunkStart[Chunk + 1] - m_ChunkStart[Chunk];
+			int32_t NumClusters = 0;
+
+			std::sort(Keys, Keys + NumKeys);
+
+			for (int32_t i = 0; i < NumKeys; i++)
+			{
+				if (i == 0 || (Keys[i] >> 32) != (Keys[i - 1] >> 32))
+					NumClusters++;
+			}
+
+			m_ChunkClusters[Chunk] = NumClusters;
+		}
+	});
+
+	Offset = 0;
+
+	for (int Chunk = 0; Chunk <= NumChunks; Chunk++)
+	{
+		const int32_t Count = Chunk < NumChunks ? m_ChunkClusters[Chunk] : 0;
+
+		m_ChunkClusters[Chunk] = Offset;
+		Offset += Count;
+	}
+
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks](int32_t Worker)
+	{
+		for (int Chunk = Worker; Chunk < NumChunks; Chunk += m_nNumWorkers)
+		{
+			int32_t nCluster = m_ChunkClusters[Chunk] - 1;
+
+			for (int32_t i = m_ChunkStart[Chunk]; i < m_ChunkStart[Chunk + 1]; i++)
+			{
+				if (i == m_ChunkStart[Chunk] || (m_Keys[i] >> 32) != (m_Keys[i - 1] >> 32))
+					nCluster++;
+
+				m_VertexCluster[static_cast<uint32_t>(m_Keys[i])] = nCluster;
+			}
+		}
+	});
+
+	// Triangles kept per range, so Apply can write the ranges in parallel
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks, NumTriangles](int32_t Worker)
+	{
+		const std::vector<int32_t>& Triangles = *m_pTriangles;
+
+		for (int Range = Worker; Range < NumChunks; Range += m_nNumWorkers)
+		{
+			int32_t NumKept = 0;
+
+			for (int32_t i = GetRangeStart(NumTriangles, Range); i < GetRangeStart(NumTriangles, Range + 1); i++)
+			{
+				const int32_t a = m_VertexCluster[Triangles[i * 3]];
+				const int32_t b = m_VertexCluster[Triangles[i * 3 + 1]];
+				const int32_t c = m_VertexCluster[Triangles[i * 3 + 2]];
+
+				NumKept += a != b && b != c && c != a;
+			}
+
+			m_TriangleStart[Range] = NumKept;
+		}
+	});
+
+	Offset = 0;
+
+	for (int Range = 0; Range <= NumChunks; Range++)
+	{
+		const int32_t Count = Range < NumChunks ? m_TriangleStart[Range] : 0;
+
+		m_TriangleStart[Range] = Offset;
+		Offset += Count;
+	}
+
+	m_pVertices = nullptr;
+	m_pTriangles = nullptr;
+
+	return Offset;
+}
+
+//=============================================================================
+void CMeshDecimator::Apply(std::vector<SVector3f>& Vertices, std::vector<int32_t>& Triangles, std::vector<SVector3f>& Normals)
+{
+	const int NumChunks = m_nNumChunks;
+	const int32_t NumTriangles = static_cast<int32_t>(Triangles.size()) / 3;
+
+	m_Vertices.resize(m_ChunkClusters[NumChunks]);
+	m_Normals.resize(m_ChunkClusters[NumChunks]);
+	m_Triangles.resize(m_TriangleStart[NumChunks] * 3);
+
+	m_pVertices = &Vertices;
+	m_pTriangles = &Triangles;
+	m_pNormals = &Normals;
+
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks](int32_t Worker)
+	{
+		const std::vector<SVector3f>& Vertices = *m_pVertices;
+		const std::vector<SVector3f>& Normals = *m_pNormals;
+
+		for (int Chunk = Worker; Chunk < NumChunks; Chunk += m_nNumWorkers)
+		{
+			int32_t nCluster = m_ChunkClusters[Chunk];
+
+			for (int32_t First = m_ChunkStart[Chunk], Last; First < m_ChunkStart[Chunk + 1]; First = Last, nCluster++)
+			{
+				const uint32_t Cube = static_cast<uint32_t>(m_Keys[First] >> 32);
+
+				SVector3d Mean;
+				SVector3f Normal;
+
+				for (Last = First; Last < m_ChunkStart[Chunk + 1] && (m_Keys[Last] >> 32) == Cube; Last++)
+				{
+					const uint32_t i = static_cast<uint32_t>(m_Keys[Last]);
+
+					Mean += Vertices[i];
+					Normal += Normals[i];
+				}
+
+				const double Count = Last - First;
+
+				Mean /= Count;
+
+				// Least squares distance to the tangent planes, plus the pull towards the mean:
+				// (sum n n^T + w I) d = sum n (n . (p - mean)), the vertex goes to mean + d
+				double A[6] = { 0, 0, 0, 0, 0, 0 };
+				SVector3d b;
+
+				for (int32_t k = First; k < Last; k++)
+				{
+					const uint32_t i = static_cast<uint32_t>(m_Keys[k]);
+					const SVector3d n(Normals[i]);
+
+					A[0] += n.X * n.X;
+					A[1] += n.X * n.Y;
+					A[2] += n.X * n.Z;
+					A[3] += n.Y * n.Y;
+					A[4] += n.Y * n.Z;
+					A[5] += n.Z * n.Z;
+
+					b += n * SVector3d::DotProduct(n, SVector3d(Vertices[i]) - Mean);
+				}
+
+				A[0] += MeanWeight * Count;
+				A[3] += MeanWeight * Count;
+				A[5] += MeanWeight * Count;
+
+				// The weight keeps the matrix positive definite, Cramer's rule is enough
+				const double C0 = A[3] * A[5] - A[4] * A[4];
+				const double C1 = A[2] * A[4] - A[1] * A[5];
+				const double C2 = A[1] * A[4] - A[2] * A[3];
+				const double C3 = A[0] * A[5] - A[2] * A[2];
+				const double C4 = A[1] * A[2] - A[0] * A[4];
+				const double C5 = A[0] * A[3] - A[1] * A[1];
+				const double Det = A[0] * C0 + A[1] * C1 + A[2] * C2;
+
+				SVector3d Vertex = Mean + SVector3d(
+					C0 * b.X + C1 * b.Y + C2 * b.Z,
+					C1 * b.X + C3 * b.Y + C4 * b.Z,
+					C2 * b.X + C4 * b.Y + C5 * b.Z) / Det;
+
+				// Outside its cube the vertex could fold the triangles it shares with the next cube
+				const int ix = Cube % m_nCubesPerAxis;
+				const int iy = Cube / m_nCubesPerAxis % m_nCubesPerAxis;
+				const int iz = Cube / m_nCubesPerAxis / m_nCubesPerAxis;
+				const SVector3d Min(SVector3d(m_Origin) + SVector3d(ix, iy, iz) * m_fCellSize);
+
+				Vertex = SVector3d(
+					Clamp<double>(Vertex.X, Min.X, Min.X + m_fCellSize),
+					Clamp<double>(Vertex.Y, Min.Y, Min.Y + m_fCellSize),
+					Clamp<double>(Vertex.Z, Min.Z, Min.Z + m_fCellSize));
+
+				if (!Normal.Normalize())
+					Normal = Normals[static_cast<uint32_t>(m_Keys[First])];
+
+				m_Vertices[nCluster] = SVector3f(static_cast<float>(Vertex.X), static_cast<float>(Vertex.Y), static_cast<float>(Vertex.Z));
+				m_Normals[nCluster] = Normal;
+			}
+		}
+	});
+
+	m_ParallelFor(m_nNumWorkers, [this, NumChunks, NumTriangles](int32_t Worker)
+	{
+		const std::vector<int32_t>& Triangles = *m_pTriangles;
+
+		for (int Range = Worker; Range < NumChunks; Range += m_nNumWorkers)
+		{
+			int32_t Index = m_TriangleStart[Range] * 3;
+
+			for (int32_t i = GetRangeStart(NumTriangles, Range); i < GetRangeStart(NumTriangles, Range + 1); i++)
+			{
+				const int32_t a = m_VertexCluster[Triangles[i * 3]];
+				const int32_t b = m_VertexCluster[Triangles[i * 3 + 1]];
+				const int32_t c = m_VertexCluster[Triangles[i * 3 + 2]];
+
+				if (a == b || b == c || c == a)
+					continue;
+
+				m_Triangles[Index++] = a;
+				m_Triangles[Index++] = b;
+				m_Triangles[Index++] = c;
+			}
+		}
+	});
+
+	m_pVertices = nullptr;
+	m_pTriangles = nullptr;
+	m_pNormals = nullptr;
+
+	// Copied back, so the mesh arrays keep the memory the next build fills again
+	Vertices.assign(m_Vertices.begin(), m_Vertices.end());
+	Normals.assign(m_Normals.begin(), m_Normals.end());
+	Triangles.assign(m_Triangles.begin(), m_Triangles.end());
+}
+
+//=============================================================================
+size_t CMeshDecimator::GetAllocatedSize() const
+{
+	return GetVectorAllocatedSize(m_Keys) + GetVectorAllocatedSize(m_ChunkStart) + GetVectorAllocatedSize(m_ChunkClusters) + GetVectorAllocatedSize(m_RangeChunkCounts) +
+		GetVectorAllocatedSize(m_VertexCluster) + GetVectorAllocatedSize(m_TriangleStart) +
+		GetVectorAllocatedSize(m_Vertices) + GetVectorAllocatedSize(m_Triangles) + GetVectorAllocatedSize(m_Normals);
+}
+
+//=============================================================================
+int32_t CMeshDecimator::GetCube(const SVector3f& Vertex) const
+{
+	const int ix = Clamp(static_cast<int>(std::floor((Vertex.X - m_Origin.X) / m_fCellSize)), 0, m_nCubesPerAxis - 1);
+	const int iy = Clamp(static_cast<int>(std::floor((Vertex.Y - m_Origin.Y) / m_fCellSize)), 0, m_nCubesPerAxis - 1);
+	const int iz = Clamp(static_cast<int>(std::floor((Vertex.Z - m_Origin.Z) / m_fCellSize)), 0, m_nCubesPerAxis - 1);
+
+	return (iz * m_nCubesPerAxis + iy) * m_nCubesPerAxis + ix;
+}
+
+//=============================================================================
+int CMeshDecimator::GetChunkOfCube(const int32_t nCube) const
+{
+	// Chunks are slices of whole cube layers along z
+	return static_cast<int>(static_cast<int64_t>(nCube / (m_nCubesPerAxis * m_nCubesPerAxis)) * m_nNumChunks / m_nCubesPerAxis);
+}
+
+//=============================================================================
+int32_t CMeshDecimator::GetRangeStart(const int32_t nNum, const int nRange) const
+{
+	return static_cast<int32_t>(static_cast<int64_t>(nNum) * nRange / m_nNumChunks);
+}
@@ -0,0 +1,141 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+#include <algorithm>
+#include <cmath>
+
+// Engine builds time the build steps in Unreal Insights, standalone builds have no profiler to report to
+#if defined(METABALLS_CORE_ENGINE_TRACE) && METABALLS_CORE_ENGINE_TRACE
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#define METABALLS_CORE_SCOPE(Name) TRACE_CPUPROFILER_EVENT_SCOPE(Name)
+#else
+#define METABALLS_CORE_SCOPE(Name)
+#endif
+
+// Four float lanes on SSE2 and NEON. Multiply-add is a multiply and an add on both, like the engine
+// vector math, so the kernels round the same on every target. Other targets use the scalar loops.
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define METABALLS_VECTOR_INTRINSICS 1
+typedef __m128 SimdFloat4;
+
+inline SimdFloat4 SimdSet1(const float f) { return _mm_set1_ps(f); }
+inline SimdFloat4 SimdSet4(const float a, const float b, const float c, const float d) { return _mm_setr_ps(a, b, c, d); }
+inline SimdFloat4 SimdZero() { return _mm_setzero_ps(); }
+inline SimdFloat4 SimdLoad(const float* p) { return _mm_loadu_ps(p); }
+inline void SimdStore(const SimdFloat4& v, float* p) { _mm_storeu_ps(p, v); }
+inline SimdFloat4 SimdAdd(const SimdFloat4& a, const SimdFloat4& b) { return _mm_add_ps(a, b); }
+inline SimdFloat4 SimdSubtract(const SimdFloat4& a, const SimdFloat4& b) { return _mm_sub_ps(a, b); }
+inline SimdFloat4 SimdMultiply(const SimdFloat4& a, const SimdFloat4& b) { return _mm_mul_ps(a, b); }
+inline SimdFloat4 SimdDivide(const SimdFloat4& a, const SimdFloat4& b) { return _mm_div_ps(a, b); }
+inline SimdFloat4 SimdMax(const SimdFloat4& a, const SimdFloat4& b) { return _mm_max_ps(a, b); }
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define METABALLS_VECTOR_INTRINSICS 1
+typedef float32x4_t SimdFloat4;
+
+inline SimdFloat4 SimdSet1(const float f) { return vdupq_n_f32(f); }
+inline SimdFloat4 SimdSet4(const float a, const float b, const float c, const float d) { const float v[4] = { a, b, c, d }; return vld1q_f32(v); }
+inline SimdFloat4 SimdZero() { return vdupq_n_f32(0.0f); }
+inline SimdFloat4 SimdLoad(const float* p) { return vld1q_f32(p); }
+inline void SimdStore(const SimdFloat4& v, float* p) { vst1q_f32(p, v); }
+inline SimdFloat4 SimdAdd(const SimdFloat4& a, const SimdFloat4& b) { return vaddq_f32(a, b); }
+inline SimdFloat4 SimdSubtract(const SimdFloat4& a, const SimdFloat4& b) { return vsubq_f32(a, b); }
+inline SimdFloat4 SimdMultiply(const SimdFloat4& a, const SimdFloat4& b) { return vmulq_f32(a, b); }
+inline SimdFloat4 SimdDivide(const SimdFloat4& a, const SimdFloat4& b) { return vdivq_f32(a, b); }
+inline SimdFloat4 SimdMax(const SimdFloat4& a, const SimdFloat4& b) { return vmaxq_f32(a, b); }
+#else
+#define METABALLS_VECTOR_INTRINSICS 0
+#endif
+
+#if METABALLS_VECTOR_INTRINSICS
+inline SimdFloat4 SimdOne() { return SimdSet1(1.0f); }
+
+// a * b + c
+inline SimdFloat4 SimdMultiplyAdd(const SimdFloat4& a, const SimdFloat4& b, const SimdFloat4& c) { return SimdAdd(SimdMultiply(a, b), c); }
+
+// c - a * b
+inline SimdFloat4 SimdNegateMultiplyAdd(const SimdFloat4& a, const SimdFloat4& b, const SimdFloat4& c) { return SimdSubtract(c, SimdMultiply(a, b)); }
+#endif
+
+template <typename T>
+inline T Clamp(const T Value, const T Min, const T Max)
+{
+	return Value < Min ? Min : Value < Max ? Value : Max;
+}
+
+template <typename T>
+inline T Square(const T Value)
+{
+	return Value * Value;
+}
+
+inline int FloorToInt(const float f)
+{
+	return static_cast<int>(std::floor(f));
+}
+
+inline int CeilToInt(const float f)
+{
+	return static_cast<int>(std::ceil(f));
+}
+
+// Energy of one ball: mass/distance^2 * (1 - distance^2/radius^2)^2.
+// With finite support it matches the classic mass/distance^2 energy close to the ball and
+// reaches zero with zero slope at the influence radius, so blends stay smooth.
+// An InvSqRadius of zero gives back the classic infinite support energy.
+inline float MetaBallEnergy(const float Mass, const float SqDist, const float InvSqRadius)
+{
+	const float Falloff = std::max(1.0f - SqDist * InvSqRadius, 0.0f);
+	return Mass * Falloff * Falloff / SqDist;
+}
+
+// Gradient scale of MetaBallEnergy, so that the normal is Scale * (Vertex - Ball)
+inline float MetaBallNormalScale(const float Mass, const float SqDist, const float InvSqRadius)
+{
+	const float Ratio = SqDist * InvSqRadius;
+	return 2 * Mass * std::max(1.0f - Ratio * Ratio, 0.0f) / Square(SqDist);
+}
+
+#if METABALLS_VECTOR_INTRINSICS
+
+// Squared distances from four consecutive balls to the point
+inline SimdFloat4 MetaBallSqDist4(const SMetaBallSoA& Balls, const int i,
+	const SimdFloat4& X, const SimdFloat4& Y, const SimdFloat4& Z,
+	SimdFloat4& DX, SimdFloat4& DY, SimdFloat4& DZ)
+{
+	DX = SimdSubtract(X, SimdLoad(Balls.X.data() + i));
+	DY = SimdSubtract(Y, SimdLoad(Balls.Y.data() + i));
+	DZ = SimdSubtract(Z, SimdLoad(Balls.Z.data() + i));
+
+	SimdFloat4 SqDist = SimdMultiply(DX, DX);
+	SqDist = SimdMultiplyAdd(DY, DY, SqDist);
+	SqDist = SimdMultiplyAdd(DZ, DZ, SqDist);
+
+	return SimdMax(SqDist, SimdSet1(0.0001f));
+}
+
+// MetaBallEnergy of four consecutive balls
+inline SimdFloat4 MetaBallEnergy4(const SMetaBallSoA& Balls, const int i,
+	const SimdFloat4& X, const SimdFloat4& Y, const SimdFloat4& Z, const SimdFloat4& InvSqRadius)
+{
+	SimdFloat4 DX, DY, DZ;
+	const SimdFloat4 SqDist = MetaBallSqDist4(Balls, i, X, Y, Z, DX, DY, DZ);
+
+	const SimdFloat4 Falloff = SimdMax(SimdNegateMultiplyAdd(SqDist, InvSqRadius, SimdOne()), SimdZero());
+
+	return SimdDivide(SimdMultiply(SimdLoad(Balls.M.data() + i), SimdMultiply(Falloff, Falloff)), SqDist);
+}
+
+inline float SumLanes(const SimdFloat4& Vector)
+{
+	float Lanes[4];
+	SimdStore(Vector, Lanes);
+
+	return (Lanes[0] + Lanes[1]) + (Lanes[2] + Lanes[3]);
+}
+
+#endif
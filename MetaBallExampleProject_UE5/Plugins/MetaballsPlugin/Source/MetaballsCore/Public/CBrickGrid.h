@@ -0,0 +1,155 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+ 
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+#include <atomic>
+#include <mutex>
+
+// Order of the cells in a brick. 0 stores them x fastest, then y, then z. 1 stores them along a Morton
+// (Z order) curve, the 8 corners of a voxel with even coordinates are then 8 consecutive cells, and any
+// voxel touches at most 8 of the 2^3 cell groups instead of 4 rows spread over the whole brick.
+#ifndef METABALLS_MORTON_BRICKS
+#define METABALLS_MORTON_BRICKS 0
+#endif
+
+/**
+ * 8^3 grid points of the polygonizer grid, with the voxels and edges whose lower corner they are.
+ * Cells are ordered as CBrickGrid::GetCell says, see METABALLS_MORTON_BRICKS.
+ */
+struct SGridBrick
+{
+	float	Energy[512];
+
+	// 2 status bits per cell, 32 cells to a word, see CBrickGrid::GetStatusWord
+	uint64_t	PointStatus[16];
+	uint64_t	VoxelStatus[16];
+
+	int32_t	EdgeVertices[512][3];
+
+	// Build that last touched the brick, and its slot in the page tables while it is mapped
+	std::atomic<uint16_t> Epoch;
+	int32_t	Page;
+	int32_t	Slot;
+};
+
+/**
+ * Sparse storage for the energy, status and edge fields of the polygonizer grid. Bricks are
+ * allocated on demand through a two level page table, so memory follows the part of the grid
+ * a build visits instead of its volume. Bricks that a build did not touch go back to a free
+ * list when the next one starts, and are reused before new memory is allocated. Bricks are the
+ * same for every grid size, so they are pooled across size changes as well.
+ *
+ * Each build has its own epoch. The first time a build touches a brick its statuses and edge
+ * vertices are cleared, and its energies too if asked to.
+ */
+class METABALLSCORE_API CBrickGrid
+{
+public:
+	enum MinMax
+	{
+		BRICK_SHIFT = 3,
+		BRICK_SIZE = 1 << BRICK_SHIFT,
+		BRICK_MASK = BRICK_SIZE - 1,
+		BRICK_CELLS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE,
+		PAGE_SHIFT = 3,
+		PAGE_SIZE = 1 << PAGE_SHIFT,
+		PAGE_BRICKS = PAGE_SIZE * PAGE_SIZE * PAGE_SIZE,
+		BRICKS_PER_CHUNK = 64,
+		MAX_EPOCH = 0xFFFF,
+		STATUS_BITS = 2,
+		STATUS_MASK = (1 << STATUS_BITS) - 1,
+		STATUS_CELLS_PER_WORD = 64 / STATUS_BITS,
+		STATUS_WORDS = BRICK_CELLS / STATUS_CELLS_PER_WORD,
+
+		// Status bits of a cell. A voxel is in the open list, or computed after it, a grid point
+		// is claimed by a slab worker, or computed.
+		STATUS_COMPUTED = 1,
+		STATUS_IN_LIST = 2,
+		STATUS_CLAIMED = 2,
+	};
+
+	CBrickGrid();
+	~CBrickGrid();
+
+	CBrickGrid(const CBrickGrid&) = delete;
+	CBrickGrid& operator=(const CBrickGrid&) = delete;
+
+	// Unmaps all bricks and sizes the page tables for grid points 0 .. nGridSize. Bricks, pages
+	// and the page table are kept for the next size, so switching between sizes does not allocate
+	// once each of them has been used.
+	void  SetSize(int nGridSize);
+
+	// Starts the next epoch and recycles the bricks the last build did not touch
+	void  BeginBuild(bool bZeroEnergy);
+
+	uint16_t GetEpoch() const { return m_nEpoch; }
+
+	// Brick holding grid point (x, y, z), touched for the current build. Thread safe.
+	SGridBrick* GetBrick(int x, int y, int z);
+
+	// Cell of grid point (x, y, z) in its brick
+	static int GetCell(const int x, const int y, const int z)
+	{
+#if METABALLS_MORTON_BRICKS
+		return SpreadCellBits(x) | (SpreadCellBits(y) << 1) | (SpreadCellBits(z) << 2);
+#else
+		return (x & BRICK_MASK) | ((y & BRICK_MASK) << BRICK_SHIFT) | ((z & BRICK_MASK) << (2 * BRICK_SHIFT));
+#endif
+	}
+
+	// Word of a status array that holds a cell, and the shift of the cell's bits in it
+	static int GetStatusWord(const int Cell) { return Cell / STATUS_CELLS_PER_WORD; }
+	static int GetStatusShift(const int Cell) { return (Cell % STATUS_CELLS_PER_WORD) * STATUS_BITS; }
+
+	// Coordinate of a cell along an axis, 0 .. BRICK_MASK
+	static int GetCellCoordinate(const int Cell, const int Axis)
+	{
+#if METABALLS_MORTON_BRICKS
+		const int Bits = Cell >> Axis;
+		return (Bits & 1) | ((Bits >> 2) & 2) | ((Bits >> 4) & 4);
+#else
+		return (Cell >> (Axis * BRICK_SHIFT)) & BRICK_MASK;
+#endif
+	}
+
+	int32_t GetNumBricks() const { return static_cast<int32_t>(m_MappedBricks.size()); }
+	size_t GetAllocatedSize() const;
+
+private:
+#if METABALLS_MORTON_BRICKS
+	// Bits 0, 1, 2 of the brick coordinate to bits 0, 3, 6
+	static int SpreadCellBits(const int v)
+	{
+		return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4);
+	}
+#endif
+
+	struct SPage
+	{
+		std::atomic<SGridBrick*> Bricks[PAGE_BRICKS];
+	};
+
+	SGridBrick* TouchBrick(int Page, int Slot);
+	void  ResetBrick(SGridBrick* Brick) const;
+	void  Empty();
+
+	int		m_nBricksPerAxis;
+	int		m_nPagesPerAxis;
+
+	// m_nPagesPerAxis^3 pages, each of them allocated once a brick in it is needed.
+	// The table has room for m_nMaxPageSlots, the most any size so far needed.
+	std::atomic<SPage*>* m_pPages;
+	int		m_nMaxPageSlots;
+
+	std::vector<SGridBrick*> m_MappedBricks;
+	std::vector<SGridBrick*> m_FreeBricks;
+	std::vector<SGridBrick*> m_Chunks;
+	int32_t	m_nNumPages;
+
+	uint16_t	m_nEpoch;
+	bool	m_bZeroEnergy;
+
+	std::mutex m_Lock;
+};
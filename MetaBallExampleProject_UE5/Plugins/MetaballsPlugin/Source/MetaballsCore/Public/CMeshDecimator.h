@@ -0,0 +1,71 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+ 
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+
+/**
+ * Vertex clustering decimation of the polygonizer output. The vertices in each cube of a uniform grid
+ * are merged into one, placed where it best fits the tangent planes of the vertices it replaces, like
+ * the quadrics of Lindstrom, "Out-of-Core Simplification of Large Polygonal Models" (2000). Triangles
+ * whose corners end up in fewer than three cubes are dropped.
+ *
+ * Cubes are sorted in chunks of cube layers that run in parallel. The chunks only depend on the cube
+ * grid, so the result is the same whatever the worker count. Buffers are kept from build to build.
+ */
+class METABALLSCORE_API CMeshDecimator
+{
+public:
+	CMeshDecimator();
+	~CMeshDecimator();
+
+	// Sorts the vertices into cubes of fCellSize that tile the box of fExtent from Origin, in nNumChunks
+	// chunks on up to nNumWorkers threads. Returns how many triangles keep corners in three cubes.
+	int32_t Cluster(const std::vector<SVector3f>& Vertices, const std::vector<int32_t>& Triangles, const SVector3f& Origin, float fExtent, float fCellSize, int nNumChunks, int nNumWorkers);
+
+	// Replaces the mesh that was clustered last by one vertex per cube and the triangles that were kept
+	void  Apply(std::vector<SVector3f>& Vertices, std::vector<int32_t>& Triangles, std::vector<SVector3f>& Normals);
+
+	// Runs the chunks of a pass, serially until one is set
+	void  SetParallelFor(const ParallelForFunction& InParallelFor) { m_ParallelFor = InParallelFor; }
+
+	size_t GetAllocatedSize() const;
+
+private:
+	int32_t GetCube(const SVector3f& Vertex) const;
+	int   GetChunkOfCube(int32_t nCube) const;
+	int32_t GetRangeStart(int32_t nNum, int nRange) const;
+
+	SVector3f m_Origin;
+	float	m_fCellSize;
+	int		m_nCubesPerAxis;
+	int		m_nNumChunks;
+	int		m_nNumWorkers;
+
+	// (cube << 32) | vertex of every vertex, sorted by cube within each chunk. Chunk c holds
+	// m_Keys[m_ChunkStart[c] .. m_ChunkStart[c + 1]) and the clusters from m_ChunkClusters[c] on.
+	std::vector<uint64_t> m_Keys;
+	std::vector<int32_t> m_ChunkStart;
+	std::vector<int32_t> m_ChunkClusters;
+
+	// Vertices of each vertex range per chunk, then where the range writes into the chunk
+	std::vector<int32_t> m_RangeChunkCounts;
+
+	// Cluster of every vertex, and the first kept triangle of every triangle range
+	std::vector<int32_t> m_VertexCluster;
+	std::vector<int32_t> m_TriangleStart;
+
+	// Decimated mesh, copied back over the input
+	std::vector<SVector3f> m_Vertices;
+	std::vector<int32_t> m_Triangles;
+	std::vector<SVector3f> m_Normals;
+
+	// Mesh of the running Cluster or Apply. The passes read it from here, a capture of more than
+	// two words would make std::function allocate the body on every pass.
+	const std::vector<SVector3f>* m_pVertices;
+	const std::vector<int32_t>* m_pTriangles;
+	const std::vector<SVector3f>* m_pNormals;
+
+	ParallelForFunction m_ParallelFor;
+};
@@ -0,0 +1,54 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+
+/**
+ * Energy field of the balls of one build. With finite support the balls are sorted into uniform
+ * bins over the [-1,1] ball domain, so a point only sums the balls whose influence reaches its bin.
+ * Samples count themselves into the output they are taken for. Thread safe once built.
+ */
+class METABALLSCORE_API CMetaballField
+{
+public:
+	enum MinMax
+	{
+		MAX_BALL_BINS = 32,
+	};
+
+	CMetaballField();
+	~CMetaballField();
+
+	// Takes the balls of the next build, they have to stay unchanged until it is done
+	void  Build(const SMetaBallSoA& Balls, bool bFiniteSupport, float InfluenceRadius);
+
+	// Energy at a point in ball space
+	float ComputeEnergy(float x, float y, float z, SPolygonizerOutput& Output) const;
+
+	// Negative gradient of the energy at a point in ball space, not normalized
+	SVector3f ComputeNormal(float x, float y, float z, SPolygonizerOutput& Output) const;
+
+	const SMetaBallSoA& GetBalls() const { return *m_pBalls; }
+
+	size_t GetAllocatedSize() const;
+
+private:
+	int   GetBallBin(float x, float y, float z) const;
+
+	const SMetaBallSoA* m_pBalls;
+
+	bool	m_bFiniteSupport;
+	float	m_fInfluenceRadius;
+	float	m_fInvSqRadius;
+
+	// Bin b holds copies of the balls whose influence box overlaps it in m_BallBinSoA[m_BallBinStart[b] .. m_BallBinStart[b+1])
+	int		m_nBallBinSize;
+	float	m_fBallBinCellSize;
+	std::vector<int32_t> m_BallBinStart;
+	SMetaBallSoA m_BallBinSoA;
+
+	// Balls of a field that was never built
+	SMetaBallSoA m_NoBalls;
+};
@@ -0,0 +1,289 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+#include "CBrickGrid.h"
+#include "CAdaptiveOctree.h"
+#include "CMeshDecimator.h"
+#include "CMetaballField.h"
+#include "CVoxelWorkList.h"
+
+// A slab of voxel layers [MinZ, MaxZ) that one worker of the parallel polygonizer flood fills.
+// Voxels are packed CVoxelWorkList ids. Neighbors that fall in the slab below or above are sent there for the next round.
+struct SPolygonizerSlab
+{
+	int MinZ;
+	int MaxZ;
+
+	std::vector<uint32_t> Seeds;
+	CVoxelWorkList OpenVoxels;
+	std::vector<uint32_t> SendDown;
+	std::vector<uint32_t> SendUp;
+
+	SPolygonizerOutput Output;
+
+	void ReserveLike(const SPolygonizerSlab& Other)
+	{
+		::ReserveLike(Seeds, Other.Seeds);
+		OpenVoxels.ReserveLike(Other.OpenVoxels);
+		::ReserveLike(SendDown, Other.SendDown);
+		::ReserveLike(SendUp, Other.SendUp);
+		Output.ReserveLike(Other.Output);
+	}
+
+	size_t GetAllocatedSize() const
+	{
+		return GetVectorAllocatedSize(Seeds) + OpenVoxels.GetAllocatedSize() + GetVectorAllocatedSize(SendDown) + GetVectorAllocatedSize(SendUp) + Output.GetAllocatedSize();
+	}
+};
+
+// Mesh of the voxels of one brick, kept by incremental builds until a ball moves close to the brick.
+// Vertices are not shared with other bricks, so a fragment can be rebuilt on its own.
+struct SBrickFragment
+{
+	int32_t Brick;
+
+	// Cells of the voxels the surface went through, the seeds of the next rebuild of the brick
+	std::vector<uint16_t> SurfaceVoxels;
+
+	SPolygonizerOutput Mesh;
+
+	SBrickFragment() : Brick(NO_INDEX) {}
+
+	void ReserveLike(const SBrickFragment& Other)
+	{
+		::ReserveLike(SurfaceVoxels, Other.SurfaceVoxels);
+		Mesh.ReserveLike(Other.Mesh);
+	}
+
+	size_t GetAllocatedSize() const
+	{
+		return GetVectorAllocatedSize(SurfaceVoxels) + Mesh.GetAllocatedSize();
+	}
+};
+
+/**
+ * Polygonizer of the metaballs surface. It samples the energy of the balls on a uniform grid over
+ * the [-1,1] ball domain and extracts the surface with marching cubes, surface nets or an adaptive
+ * octree, serially, on slabs in parallel, incrementally per brick or spread over several calls.
+ * Vertices and normals are in mesh space, the ball domain swizzled to (z, y, x) and scaled by the
+ * Scale of the settings. It does not depend on the engine, the actor and the standalone tests and
+ * benchmarks drive the same code. Buffers are kept from build to build.
+ */
+class METABALLSCORE_API CMetaballPolygonizer
+{
+public:
+	enum MinMax
+	{
+		MAX_POLYGONIZER_THREADS = 16,
+		MAX_POLYGONIZER_SLABS = 32,
+		MIN_SLAB_DEPTH = 8,
+		DIRTY_VOXEL_MARGIN = 3,
+		MAX_OCTREE_SURFACE_LEAF = 8,
+		MIN_DECIMATION_TOLERANCE = 1,
+		MAX_DECIMATION_TOLERANCE = 16,
+		DECIMATION_CHUNKS = 32,
+		MAX_DECIMATION_PASSES = 4,
+		VOXEL_TIMING_SAMPLE = 16,
+		SLICE_CLOCK_VOXELS = 64,
+	};
+
+	CMetaballPolygonizer();
+	~CMetaballPolygonizer();
+
+	CMetaballPolygonizer(const CMetaballPolygonizer&) = delete;
+	CMetaballPolygonizer& operator=(const CMetaballPolygonizer&) = delete;
+
+	// Grid of nSize voxels per axis, up to CVoxelWorkList::MAX_GRID_SIZE. Not while a build runs.
+	void  SetGridSize(int nSize);
+
+	int   GetGridSize() const { return m_nGridSize; }
+	float GetVoxelSize() const { return m_fVoxelSize; }
+	float GetLevel() const { return m_fLevel; }
+
+	// Runs the slabs of threaded builds and the chunks of the decimation, serially until one is set
+	void  SetParallelFor(const ParallelForFunction& InParallelFor);
+
+	// Polygonizes the balls into the output. The balls have to stay unchanged until it returns.
+	void  Build(const SMetaBallSoA& Balls, const SMetaBallBuildSettings& Settings);
+
+	// Starts a build that ContinueSlicedBuild spreads over several calls. It runs the serial fill,
+	// incremental builds and threads are ignored. The balls have to stay unchanged until it is done.
+	void  BeginSlicedBuild(const SMetaBallSoA& Balls, const SMetaBallBuildSettings& Settings);
+
+	// Polygonizes up to nMaxVoxels voxels or for about fMaxSeconds, true once the build is done.
+	// The clock is read every few voxels, so every call polygonizes at least that many.
+	bool  ContinueSlicedBuild(int32_t nMaxVoxels, double fMaxSeconds);
+
+	bool  IsSlicedBuildActive() const { return m_bSlicedBuildActive; }
+
+	// Drops a sliced build that is not done, the output keeps what it had
+	void  CancelSlicedBuild() { m_bSlicedBuildActive = false; }
+
+	// Mesh and counters of the last build that was done
+	const SPolygonizerOutput& GetOutput() const { return m_Output; }
+
+	const CMetaballField& GetField() const { return m_Field; }
+	const CBrickGrid& GetGrid() const { return m_Grid; }
+
+	int32_t GetNumDirtyBricks() const { return m_nNumDirtyBricks; }
+	float GetDirtyFraction() const { return m_fDirtyFraction; }
+	int32_t GetNumOctreeNodes() const { return m_Octree.GetNumNodes(); }
+	int32_t GetNumUndecimatedTriangles() const { return m_nNumUndecimatedTriangles; }
+	int64_t GetNumSplattedSamples() const { return m_nNumSplattedSamples; }
+	uint32_t GetNumReallocatingBuilds() const { return m_nNumReallocatingBuilds; }
+
+	// Seconds the last build spent on the field before the fill, on the fill, and on the decimation
+	double GetFieldSeconds() const { return m_fFieldSeconds; }
+	double GetPolygonizeSeconds() const { return m_fPolygonizeSeconds; }
+	double GetDecimateSeconds() const { return m_fDecimateSeconds; }
+
+	// Memory the build buffers hold, the grid is not included
+	size_t GetAllocatedSize() const;
+
+private:
+	void  ComputeNormal(const SVector3f& Vertex, SPolygonizerOutput& Output) const;
+	void  ComputeGridNormal(const SVector3f& Vertex, int x, int y, int z, int nIndex0, int nIndex1, float t, SPolygonizerOutput& Output) const;
+	SVector3f ComputeGridGradient(int x, int y, int z, SPolygonizerOutput& Output) const;
+
+	void  SplatGridEnergy();
+
+	float ComputeGridPointEnergy(int x, int y, int z, SPolygonizerOutput& Output) const;
+	int   ComputeGridVoxelCase(int x, int y, int z, float* b, SPolygonizerOutput& Output) const;
+	int   ComputeGridVoxel(int x, int y, int z, SPolygonizerOutput& Output);
+	int   ComputeMarchingCubesVoxel(int x, int y, int z, SPolygonizerOutput& Output);
+	int32_t ComputeMarchingCubesVertex(int x, int y, int z, int nIndex0, int nIndex1, const float* b, SPolygonizerOutput& Output);
+	int   ComputeSurfaceNetVoxel(int x, int y, int z, SPolygonizerOutput& Output);
+	void  AddSurfaceNetQuads(const SPolygonizerOutput& Source, const int32_t* SlabVertexOffsets);
+
+	float EvaluateGridPointEnergy(int x, int y, int z, SPolygonizerOutput& Output) const;
+
+	bool  BeginBuildPass(const SMetaBallSoA& Balls, const SMetaBallBuildSettings& Settings, bool bSliced);
+	void  EndBuildPass();
+
+	void  PolygonizeSerial();
+	void  BeginSerialFill();
+	bool  ContinueSerialFill(int32_t nMaxVoxels, double fEndTime);
+	void  PolygonizeParallel();
+	void  FloodFillSlab(SPolygonizerSlab& Slab);
+	void  AddSlabNeighbor(SPolygonizerSlab& Slab, int x, int y, int z);
+
+	void  PolygonizeIncremental();
+	void  MarkDirtyBricks();
+	void  MarkDirtyBall(float x, float y, float z);
+	bool  IsVoxelBrickDirty(int x, int y, int z) const;
+	int32_t GetVoxelBrick(int x, int y, int z) const;
+	SBrickFragment& GetBrickFragment(int x, int y, int z);
+
+	void  PolygonizeOctree();
+	void  RefineOctreeNode(int32_t nNode);
+	bool  OctreeNodeHasBall(const SOctreeNode& Node) const;
+	float GetOctreeEnergy(int x, int y, int z, SPolygonizerOutput& Output) const;
+	int32_t GetOctreeLeafVertex(int32_t nLeaf, const int32_t* Quad, SPolygonizerOutput& Output);
+
+	void  DecimateMesh();
+
+	bool  IsGridPointComputed(int x, int y, int z) const;
+	bool  IsGridVoxelComputed(int x, int y, int z) const;
+	bool  IsGridVoxelInList(int x, int y, int z) const;
+	bool  IsGridVoxelVisited(int x, int y, int z) const;
+	void  SetGridPointComputed(int x, int y, int z) const;
+	void  SetGridVoxelComputed(int x, int y, int z) const;
+	void  SetGridVoxelInList(int x, int y, int z) const;
+	int   GetGridStatus(uint64_t* Words, int Cell) const;
+	void  SetGridStatus(uint64_t* Words, int Cell, int Status) const;
+
+	float ConvertGridPointToWorldCoordinate(int x) const;
+	int   ConvertWorldCoordinateToGridPoint(float x) const;
+	int   GetBallGridVoxel(float x) const;
+	void  AddNeighborsToList(int nCase, int x, int y, int z);
+	void  AddNeighbor(int x, int y, int z);
+
+	int32_t* GetGridEdgeVertex(int x, int y, int z, int nIndex0, int nIndex1) const;
+	int32_t* GetGridVoxelVertex(int x, int y, int z) const;
+	int   GetSlabOfLayer(int z) const;
+
+	float	m_fLevel;
+
+	int		m_nGridSize;
+	float	m_fVoxelSize;
+
+	// Balls and settings of the build that runs, or ran last
+	const SMetaBallSoA* m_pBuildBalls;
+	SMetaBallBuildSettings m_BuildSettings;
+
+	CMetaballField m_Field;
+
+	ParallelForFunction m_ParallelFor;
+
+	// Open voxels of the serial and the incremental flood fill
+	CVoxelWorkList m_OpenVoxels;
+
+	// Builds that had to grow one of their buffers. It stops counting once the surface settles.
+	uint32_t m_nNumReallocatingBuilds;
+	size_t	m_nPassAllocatedSize;
+
+	// Sliced build in progress, and the next ball its flood fill seeds from
+	bool	m_bSlicedBuildActive;
+	int32_t	m_nFillBall;
+
+	bool	m_bGridEnergySplatted;
+	int64_t	m_nNumSplattedSamples;
+
+	// Energy, status and edge vertex index of every grid point the flood fill visits, allocated in
+	// bricks on demand. Statuses take 2 bits per cell and are cleared with the rest of a brick the
+	// first time a build touches it. Edge vertices let voxels that share an edge emit its vertex only once.
+	// Mutable because reading a grid point allocates its brick.
+	mutable CBrickGrid m_Grid;
+
+	// Output of the serial flood fill, and the merged output of the parallel one
+	SPolygonizerOutput m_Output;
+
+	// Slabs of the parallel polygonizer. Their number only depends on the grid size, so the
+	// merged mesh is the same whatever the thread count.
+	std::vector<SPolygonizerSlab> m_Slabs;
+
+	// True while slab workers fill the grid, grid points on slab borders are then claimed atomically
+	bool	m_bConcurrentFill;
+	int		m_nNumSlabs;
+
+	// Mesh fragments of the incremental mode, one per brick of 8^3 voxels the surface went through.
+	// m_BrickFragments maps every brick to its fragment or NO_INDEX. The fragments were built from
+	// m_FragmentBalls with m_FragmentSettings, the next build compares its balls against them.
+	std::vector<SBrickFragment> m_Fragments;
+	std::vector<int32_t> m_BrickFragments;
+	std::vector<int32_t> m_FreeFragments;
+	int		m_nFragmentBricksPerAxis;
+	int		m_nFragmentGridSize;
+	bool	m_bFragmentsValid;
+	SMetaBallBuildSettings m_FragmentSettings;
+	SMetaBallSoA m_FragmentBalls;
+
+	// Bricks the current incremental build polygonizes again, as flags and as a list
+	std::vector<uint8_t> m_DirtyBricks;
+	std::vector<int32_t> m_DirtyBrickList;
+	bool	m_bAllBricksDirty;
+
+	// True while an incremental build fills the dirty bricks. Edges are then only shared inside a brick.
+	bool	m_bIncrementalFill;
+
+	int		m_nNumDirtyBricks;
+	float	m_fDirtyFraction;
+
+	// Cells of the adaptive octree mode, the quads its contour found, and the Morton codes of the
+	// grid voxels of the balls, sorted so that the balls inside a cell are one range
+	CAdaptiveOctree m_Octree;
+	std::vector<int32_t> m_OctreeQuads;
+	std::vector<uint32_t> m_OctreeBallKeys;
+
+	// Field is the ball bins and splatting before the fill, polygonize the fill itself
+	double	m_fFieldSeconds;
+	double	m_fPolygonizeSeconds;
+
+	// Vertex clustering of the decimation stage, the triangles the last build had before it and how long it took
+	CMeshDecimator m_Decimator;
+	int32_t	m_nNumUndecimatedTriangles;
+	double	m_fDecimateSeconds;
+};
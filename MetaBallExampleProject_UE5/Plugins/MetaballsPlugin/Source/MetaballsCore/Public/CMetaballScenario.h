@@ -0,0 +1,65 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+
+/**
+ * Recorded ball motion, frame by frame, for replaying the same builds again. A frame holds the grid size,
+ * the scale and the ball positions of one build. The masses are stored only when they changed since the
+ * frame before. The settings of the first frame are stored once for the whole scenario.
+ * Saved as a little endian byte stream, 16 bytes per ball per frame at most.
+ */
+class METABALLSCORE_API CMetaballScenario
+{
+public:
+	enum MinMax
+	{
+		FILE_VERSION = 1,
+	};
+
+	CMetaballScenario();
+	~CMetaballScenario();
+
+	// Drops all frames, the next one added stores its settings
+	void  Reset();
+
+	void  AddFrame(int nGridSize, const SMetaBallBuildSettings& Settings, const SMetaBallSoA& Balls);
+
+	int32_t GetNumFrames() const { return static_cast<int32_t>(m_Frames.size()); }
+
+	// Settings of the first frame. Every frame has its own grid size and scale.
+	const SMetaBallBuildSettings& GetSettings() const { return m_Settings; }
+
+	int   GetFrameGridSize(int32_t nFrame) const { return m_Frames[nFrame].GridSize; }
+	float GetFrameScale(int32_t nFrame) const { return m_Frames[nFrame].Scale; }
+
+	// Balls of a frame, masses included
+	void  GetFrameBalls(int32_t nFrame, SMetaBallSoA& Balls) const;
+
+	void  Save(std::vector<uint8_t>& Data) const;
+
+	// False if the data is no scenario of this version, the scenario is empty then
+	bool  Load(const uint8_t* Data, size_t Size);
+
+	size_t GetAllocatedSize() const;
+
+private:
+	struct SFrame
+	{
+		int32_t GridSize;
+		float Scale;
+		int32_t NumBalls;
+
+		// Start of the positions in m_Values, x, then y, then z of all balls
+		size_t Positions;
+
+		// Start of the masses this frame uses, stored with this frame or an earlier one
+		size_t Masses;
+	};
+
+	SMetaBallBuildSettings m_Settings;
+	std::vector<SFrame> m_Frames;
+	std::vector<float> m_Values;
+};
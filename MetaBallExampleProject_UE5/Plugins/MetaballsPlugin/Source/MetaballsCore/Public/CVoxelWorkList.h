@@ -0,0 +1,92 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+
+/**
+ * Open voxels of a flood fill, as packed 32 bit ids of 10 bits per axis. Voxels of the brick the
+ * fill is in are taken before any other, so the fill finishes the surface of a brick while its
+ * energies, statuses and edges are in cache, and only then moves on to the brick it queued last.
+ * Within a brick, and between bricks, the order is last in first out. The storage is kept from
+ * build to build, so a steady surface does not allocate.
+ */
+class METABALLSCORE_API CVoxelWorkList
+{
+public:
+	enum MinMax
+	{
+		AXIS_BITS = 10,
+		AXIS_MASK = (1 << AXIS_BITS) - 1,
+		MAX_GRID_SIZE = 1 << AXIS_BITS,
+		INITIAL_CAPACITY = 256,
+	};
+
+	CVoxelWorkList();
+	~CVoxelWorkList();
+
+	static uint32_t Pack(const int x, const int y, const int z)
+	{
+		return static_cast<uint32_t>(x) | (static_cast<uint32_t>(y) << AXIS_BITS) | (static_cast<uint32_t>(z) << (2 * AXIS_BITS));
+	}
+
+	static void Unpack(const uint32_t Voxel, int& x, int& y, int& z)
+	{
+		x = static_cast<int>(Voxel & AXIS_MASK);
+		y = static_cast<int>((Voxel >> AXIS_BITS) & AXIS_MASK);
+		z = static_cast<int>(Voxel >> (2 * AXIS_BITS));
+	}
+
+	void  Clear();
+
+	bool  IsEmpty() const { return m_Brick.empty() && m_Other.empty(); }
+	int32_t Num() const { return static_cast<int32_t>(m_Brick.size() + m_Other.size()); }
+
+	void  Push(const int x, const int y, const int z)
+	{
+		const uint32_t Voxel = Pack(x, y, z);
+
+		if (((Voxel ^ m_nBrick) & BrickBits) == 0)
+			m_Brick.push_back(Voxel);
+		else
+			m_Other.push_back(Voxel);
+	}
+
+	// Not on an empty list
+	void  Pop(int& x, int& y, int& z)
+	{
+		uint32_t Voxel;
+
+		if (!m_Brick.empty())
+		{
+			Voxel = m_Brick.back();
+			m_Brick.pop_back();
+		}
+		else
+		{
+			Voxel = m_Other.back();
+			m_Other.pop_back();
+			m_nBrick = Voxel;
+		}
+
+		Unpack(Voxel, x, y, z);
+	}
+
+	void  ReserveLike(const CVoxelWorkList& Other)
+	{
+		::ReserveLike(m_Brick, Other.m_Brick);
+		::ReserveLike(m_Other, Other.m_Other);
+	}
+
+	size_t GetAllocatedSize() const { return GetVectorAllocatedSize(m_Brick) + GetVectorAllocatedSize(m_Other); }
+
+private:
+	// Bits of a voxel id that select its brick of 8^3 voxels
+	static constexpr uint32_t BrickBits = (AXIS_MASK & ~7u) * (1u | (1u << AXIS_BITS) | (1u << (2 * AXIS_BITS)));
+
+	// Voxels of the brick of m_nBrick, the last voxel taken from m_Other, and of all other bricks
+	std::vector<uint32_t> m_Brick;
+	std::vector<uint32_t> m_Other;
+	uint32_t m_nBrick;
+};
@@ -0,0 +1,370 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// The engine build defines the export macro, standalone builds link the core statically
+#ifndef METABALLSCORE_API
+#define METABALLSCORE_API
+#endif
+
+// Index of no element, the INDEX_NONE of the core
+constexpr int32_t NO_INDEX = -1;
+
+// Runs Body(0) .. Body(Num - 1), the calls may run at the same time on different threads
+typedef std::function<void(int32_t Num, const std::function<void(int32_t)>& Body)> ParallelForFunction;
+
+// Clock of the build timers, seconds for the phases and ticks for the sampled voxels
+inline double MetaballsCoreSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t MetaballsCoreCycles()
+{
+	return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+inline double MetaballsCoreCyclesToSeconds(const uint64_t Cycles)
+{
+	return static_cast<double>(Cycles) * std::chrono::steady_clock::period::num / std::chrono::steady_clock::period::den;
+}
+
+// Float vector of the core, positions and normals in ball space and in mesh space
+struct SVector3f
+{
+	float X;
+	float Y;
+	float Z;
+
+	SVector3f() : X(0), Y(0), Z(0) {}
+	SVector3f(const float InX, const float InY, const float InZ) : X(InX), Y(InY), Z(InZ) {}
+	explicit SVector3f(const float InF) : X(InF), Y(InF), Z(InF) {}
+
+	SVector3f operator+(const SVector3f& V) const { return SVector3f(X + V.X, Y + V.Y, Z + V.Z); }
+	SVector3f operator-(const SVector3f& V) const { return SVector3f(X - V.X, Y - V.Y, Z - V.Z); }
+	SVector3f operator-() const { return SVector3f(-X, -Y, -Z); }
+	SVector3f operator*(const float Scale) const { return SVector3f(X * Scale, Y * Scale, Z * Scale); }
+	SVector3f operator/(const float Scale) const { const float Inv = 1.0f / Scale; return SVector3f(X * Inv, Y * Inv, Z * Inv); }
+
+	SVector3f& operator+=(const SVector3f& V) { X += V.X; Y += V.Y; Z += V.Z; return *this; }
+	SVector3f& operator-=(const SVector3f& V) { X -= V.X; Y -= V.Y; Z -= V.Z; return *this; }
+	SVector3f& operator*=(const float Scale) { X *= Scale; Y *= Scale; Z *= Scale; return *this; }
+	SVector3f& operator/=(const float Scale) { const float Inv = 1.0f / Scale; X *= Inv; Y *= Inv; Z *= Inv; return *this; }
+
+	float SizeSquared() const { return X * X + Y * Y + Z * Z; }
+	float Size() const { return std::sqrt(SizeSquared()); }
+	bool  IsZero() const { return X == 0 && Y == 0 && Z == 0; }
+
+	// Scales to unit length, false and unchanged when too short to have a direction
+	bool Normalize(const float Tolerance = 1e-8f)
+	{
+		const float SquareSum = SizeSquared();
+
+		if (SquareSum <= Tolerance)
+			return false;
+
+		*this *= 1.0f / std::sqrt(SquareSum);
+		return true;
+	}
+
+	// Unit length copy, zero when too short to have a direction
+	SVector3f GetSafeNormal(const float Tolerance = 1e-8f) const
+	{
+		const float SquareSum = SizeSquared();
+
+		if (SquareSum == 1.0f)
+			return *this;
+
+		if (SquareSum < Tolerance)
+			return SVector3f();
+
+		return *this * (1.0f / std::sqrt(SquareSum));
+	}
+
+	static float DotProduct(const SVector3f& A, const SVector3f& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z; }
+};
+
+inline SVector3f operator*(const float Scale, const SVector3f& V)
+{
+	return V * Scale;
+}
+
+template <typename T>
+size_t GetVectorAllocatedSize(const std::vector<T>& Vector)
+{
+	return Vector.capacity() * sizeof(T);
+}
+
+// Grows the capacity of Vector to at least that of Other, buffers that take turns holding
+// the same data then only allocate when one of them sees more than any did before
+template <typename T>
+void ReserveLike(std::vector<T>& Vector, const std::vector<T>& Other)
+{
+	if (Vector.capacity() < Other.capacity())
+		Vector.reserve(Other.capacity());
+}
+
+// How the vertex normals are computed, see EMetaBallNormalMode
+enum class EPolygonizerNormals : uint8_t
+{
+	Analytic,
+	GridGradient
+};
+
+// How the surface is extracted from the field, see EMetaBallPolygonizer
+enum class EPolygonizerMode : uint8_t
+{
+	MarchingCubes,
+	AdaptiveOctree,
+	SurfaceNets
+};
+
+// Float structure of arrays mirror of the balls, the layout the vectorized energy kernel consumes
+struct SMetaBallSoA
+{
+	std::vector<float> X;
+	std::vector<float> Y;
+	std::vector<float> Z;
+	std::vector<float> M;
+
+	int Num() const { return static_cast<int>(M.size()); }
+
+	// Keeps the memory when the count goes down
+	void SetNum(const int Num)
+	{
+		X.resize(Num);
+		Y.resize(Num);
+		Z.resize(Num);
+		M.resize(Num);
+	}
+
+	void Add(const float InX, const float InY, const float InZ, const float InM)
+	{
+		X.push_back(InX);
+		Y.push_back(InY);
+		Z.push_back(InZ);
+		M.push_back(InM);
+	}
+
+	size_t GetAllocatedSize() const
+	{
+		return GetVectorAllocatedSize(X) + GetVectorAllocatedSize(Y) + GetVectorAllocatedSize(Z) + GetVectorAllocatedSize(M);
+	}
+};
+
+// Settings a build reads. They are captured together with the ball snapshot,
+// so changing them cannot affect a build that already runs in the background.
+struct SMetaBallBuildSettings
+{
+	bool bFiniteSupport;
+	float InfluenceRadius;
+	bool bSplatEnergy;
+	EPolygonizerNormals NormalMode;
+	bool bIncrementalBuild;
+	EPolygonizerMode Polygonizer;
+	float OctreeTolerance;
+	bool bDecimate;
+	float DecimationTolerance;
+	int32_t DecimationBudget;
+	int PolygonizerThreads;
+	float Scale;
+	bool bInstrument;
+
+	// The defaults of a new metaballs actor
+	SMetaBallBuildSettings() : bFiniteSupport(false), InfluenceRadius(0.4f), bSplatEnergy(false), NormalMode(EPolygonizerNormals::Analytic), bIncrementalBuild(false),
+		Polygonizer(EPolygonizerMode::MarchingCubes), OctreeTolerance(0.25f), bDecimate(false), DecimationTolerance(2.0f), DecimationBudget(0), PolygonizerThreads(1),
+		Scale(100.0f), bInstrument(false) {}
+};
+
+// Tier of a screen size among LOD tiers ordered from the largest screen size to the smallest, each with
+// a ScreenSize member. The first tier the screen size reaches is used, the last one below all of them.
+// Finer tiers than nCurrentTier have to be passed by the hysteresis share, coarser ones fallen short of
+// by it, so a screen size that wavers around a threshold does not switch the grid back and forth.
+// NO_INDEX without tiers.
+template <typename TierType>
+int SelectLODTier(const TierType* Tiers, const int nNumTiers, const float ScreenSize, const int nCurrentTier, const float Hysteresis)
+{
+	if (nNumTiers <= 0)
+		return NO_INDEX;
+
+	int Tier = nNumTiers - 1;
+
+	for (int i = 0; i < nNumTiers; i++)
+	{
+		if (ScreenSize >= Tiers[i].ScreenSize)
+		{
+			Tier = i;
+			break;
+		}
+	}
+
+	const int Current = nCurrentTier < 0 ? 0 : (nCurrentTier < nNumTiers ? nCurrentTier : nNumTiers - 1);
+
+	while (Tier < Current && ScreenSize < Tiers[Tier].ScreenSize * (1.0f + Hysteresis))
+		Tier++;
+
+	while (Tier > Current && ScreenSize >= Tiers[Tier - 1].ScreenSize * (1.0f - Hysteresis))
+		Tier--;
+
+	return Tier;
+}
+
+// What one flood fill produces: the mesh, vertices and normals in mesh space, and its sample counters
+struct SPolygonizerOutput
+{
+	std::vector<SVector3f> Vertices;
+	std::vector<int32_t> Triangles;
+	std::vector<SVector3f> Normals;
+
+	// Voxels that got a surface nets vertex, as x, y, z, case quadruples. The quads between them are added once the fill found all of them.
+	std::vector<int32_t> DualVoxels;
+
+	// Triangle corners on an edge in the plane above a slab, which the slab above owns, as index, x, y,
+	// edge quadruples. The index is that of the corner in Triangles, it is set once the slabs are merged.
+	std::vector<int32_t> BorderEdges;
+
+	int64_t NumEnergySamples;
+	int64_t NumEnergyBallEvals;
+	int64_t NumNormalSamples;
+	int64_t NumNormalBallEvals;
+	int64_t NumEdgeLookups;
+	int64_t NumEdgeCacheHits;
+	int64_t NumVoxels;
+	int32_t PeakOpenVoxels;
+
+	// Instrumented builds time a sample of the voxels. The cycles of the field samples, of the corner
+	// classification and of the normals are counted apart, the rest of a timed voxel is emitting.
+	bool bTimingVoxel;
+	int64_t NumTimedVoxels;
+	uint64_t VoxelCycles;
+	uint64_t FieldCycles;
+	uint64_t ClassifyCycles;
+	uint64_t NormalCycles;
+
+	SPolygonizerOutput() : NumEnergySamples(0), NumEnergyBallEvals(0), NumNormalSamples(0), NumNormalBallEvals(0), NumEdgeLookups(0), NumEdgeCacheHits(0),
+		NumVoxels(0), PeakOpenVoxels(0), bTimingVoxel(false), NumTimedVoxels(0), VoxelCycles(0), FieldCycles(0), ClassifyCycles(0), NormalCycles(0) {}
+
+	void Reset()
+	{
+		Vertices.clear();
+		Triangles.clear();
+		Normals.clear();
+		DualVoxels.clear();
+		BorderEdges.clear();
+
+		NumEnergySamples = 0;
+		NumEnergyBallEvals = 0;
+		NumNormalSamples = 0;
+		NumNormalBallEvals = 0;
+		NumEdgeLookups = 0;
+		NumEdgeCacheHits = 0;
+		NumVoxels = 0;
+		PeakOpenVoxels = 0;
+
+		bTimingVoxel = false;
+		NumTimedVoxels = 0;
+		VoxelCycles = 0;
+		FieldCycles = 0;
+		ClassifyCycles = 0;
+		NormalCycles = 0;
+	}
+
+	// Adds the counters of a slab or brick fill
+	void AddCounters(const SPolygonizerOutput& Other)
+	{
+		NumEnergySamples += Other.NumEnergySamples;
+		NumEnergyBallEvals += Other.NumEnergyBallEvals;
+		NumNormalSamples += Other.NumNormalSamples;
+		NumNormalBallEvals += Other.NumNormalBallEvals;
+		NumEdgeLookups += Other.NumEdgeLookups;
+		NumEdgeCacheHits += Other.NumEdgeCacheHits;
+		NumVoxels += Other.NumVoxels;
+		PeakOpenVoxels = PeakOpenVoxels > Other.PeakOpenVoxels ? PeakOpenVoxels : Other.PeakOpenVoxels;
+
+		NumTimedVoxels += Other.NumTimedVoxels;
+		VoxelCycles += Other.VoxelCycles;
+		FieldCycles += Other.FieldCycles;
+		ClassifyCycles += Other.ClassifyCycles;
+		NormalCycles += Other.NormalCycles;
+	}
+
+	// Appends the mesh of a slab or brick fill, its indices moved past the vertices already here
+	void AppendMesh(const SPolygonizerOutput& Other)
+	{
+		const int32_t VertexOffset = static_cast<int32_t>(Vertices.size());
+		const size_t IndexOffset = Triangles.size();
+
+		Vertices.insert(Vertices.end(), Other.Vertices.begin(), Other.Vertices.end());
+		Normals.insert(Normals.end(), Other.Normals.begin(), Other.Normals.end());
+		Triangles.resize(IndexOffset + Other.Triangles.size());
+
+		for (size_t i = 0; i < Other.Triangles.size(); i++)
+			Triangles[IndexOffset + i] = Other.Triangles[i] + VertexOffset;
+	}
+
+	void Reserve(const int32_t NumVertices, const int32_t NumIndices)
+	{
+		Vertices.reserve(NumVertices);
+		Triangles.reserve(NumIndices);
+		Normals.reserve(NumVertices);
+	}
+
+	// Reset that keeps the memory. Once the last build left less than a quarter to spare the buffers
+	// grow to twice its size, so a growing surface reallocates every few doublings instead of every frame.
+	void Recycle()
+	{
+		const int32_t NumVertices = static_cast<int32_t>(Vertices.size());
+		const int32_t NumIndices = static_cast<int32_t>(Triangles.size());
+
+		Reset();
+
+		if (Vertices.capacity() < static_cast<size_t>(NumVertices + NumVertices / 4) || Triangles.capacity() < static_cast<size_t>(NumIndices + NumIndices / 4))
+			Reserve(NumVertices * 2, NumIndices * 2);
+	}
+
+	void ReserveLike(const SPolygonizerOutput& Other)
+	{
+		::ReserveLike(Vertices, Other.Vertices);
+		::ReserveLike(Triangles, Other.Triangles);
+		::ReserveLike(Normals, Other.Normals);
+		::ReserveLike(DualVoxels, Other.DualVoxels);
+		::ReserveLike(BorderEdges, Other.BorderEdges);
+	}
+
+	size_t GetAllocatedSize() const
+	{
+		return GetVectorAllocatedSize(Vertices) + GetVectorAllocatedSize(Triangles) + GetVectorAllocatedSize(Normals) + GetVectorAllocatedSize(DualVoxels) + GetVectorAllocatedSize(BorderEdges);
+	}
+};
+
+// Counts the cycles of one phase of a timed voxel into Cycles. The field samples it waits for are left
+// out, they count as field. Does nothing while the voxel is not timed.
+struct SVoxelPhaseTimer
+{
+	SPolygonizerOutput& Output;
+	uint64_t& Cycles;
+	uint64_t StartCycles;
+	uint64_t StartFieldCycles;
+
+	SVoxelPhaseTimer(SPolygonizerOutput& InOutput, uint64_t& InCycles)
+		: Output(InOutput)
+		, Cycles(InCycles)
+		, StartCycles(InOutput.bTimingVoxel ? MetaballsCoreCycles() : 0)
+		, StartFieldCycles(InOutput.FieldCycles)
+	{
+	}
+
+	~SVoxelPhaseTimer()
+	{
+		if (StartCycles)
+			Cycles += MetaballsCoreCycles() - StartCycles - (Output.FieldCycles - StartFieldCycles);
+	}
+};
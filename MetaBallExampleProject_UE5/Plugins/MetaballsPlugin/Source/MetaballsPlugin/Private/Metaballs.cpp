@@ -17,45 +17,89 @@
 // See "License.md" for full licensing details.
 
 #include "Metaballs.h"
-#include "CMarchingCubes.h"
+#include "MetaballsSubsystem.h"
 #include "GameFramework/MovementComponent.h"
 #include "GameFramework/Actor.h"
 #include "ProceduralMeshComponent.h"
 #include "Components/CapsuleComponent.h"
 #include "Components/BoxComponent.h"
-
-constexpr int GetIndex(const int X, const int Y, const int Z, const int GridSize)
-{
-	/* Replaces all instances of:
-	x +
-	y*(m_nGridSize + 1) +
-    z*(m_nGridSize + 1)*(m_nGridSize + 1)
-    */
-	
-	return X + Y*(GridSize + 1) + Z*(GridSize + 1) * (GridSize + 1);
-}
-
-constexpr int GetIndexNoAdd(const int X, const int Y, const int Z, const int GridSize)
-{
-	/* Replaces all instances of:
-	x +
-	y*m_nGridSize +
-	z*m_nGridSize*m_nGridSize
-	*/
-	
-	return X + Y * GridSize + Z * GridSize * GridSize;
-}
-
+#include "Async/ParallelFor.h"
+#include "EngineUtils.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "Engine/World.h"
+#include "GameFramework/PlayerController.h"
+#include "Camera/PlayerCameraManager.h"
 DECLARE_CYCLE_STAT(TEXT("MetaBall - Update"), STAT_MetaBallUpdate, STATGROUP_MetaBall);
 DECLARE_CYCLE_STAT(TEXT("MetaBall - Render"), STAT_MetaBallRender, STATGROUP_MetaBall);
 
-DECLARE_CYCLE_STAT(TEXT("MetaBall - ComputeNormal"), STAT_MetaBallComputeNormal, STATGROUP_MetaBall);
-DECLARE_CYCLE_STAT(TEXT("MetaBall - AddNeighborToList"), STAT_MetaBallAddNeighborToList, STATGROUP_MetaBall);
-DECLARE_CYCLE_STAT(TEXT("MetaBall - AddNeighbor"), STAT_MetaBallAddNeighbor, STATGROUP_MetaBall);
-DECLARE_CYCLE_STAT(TEXT("MetaBall - ComputeEnergy"), STAT_MetaBallComputeEnergy, STATGROUP_MetaBall);
-DECLARE_CYCLE_STAT(TEXT("MetaBall - ComputeGridpointEnergy"), STAT_MetaBallComputeGridpointEnergy, STATGROUP_MetaBall);
-DECLARE_CYCLE_STAT(TEXT("MetaBall - ComputeGridVoxel"), STAT_MetaBallComputeGridVoxel, STATGROUP_MetaBall);
-DECLARE_CYCLE_STAT(TEXT("MetaBall - ComputeGridVoxel For Loop"), STAT_MetaBallComputeGridVoxelForLoop, STATGROUP_MetaBall);
+DECLARE_CYCLE_STAT(TEXT("MetaBall - BuildMesh"), STAT_MetaBallBuildMesh, STATGROUP_MetaBall);
+DECLARE_CYCLE_STAT(TEXT("MetaBall - UploadMesh"), STAT_MetaBallUploadMesh, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Reallocating builds"), STAT_MetaBallReallocatingBuilds, STATGROUP_MetaBall);
+DECLARE_MEMORY_STAT(TEXT("MetaBall - Build memory"), STAT_MetaBallBuildMemory, STATGROUP_MetaBall);
+DECLARE_MEMORY_STAT(TEXT("MetaBall - Grid memory"), STAT_MetaBallGridMemory, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Grid bricks"), STAT_MetaBallGridBricks, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Dirty bricks"), STAT_MetaBallDirtyBricks, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Dirty fraction"), STAT_MetaBallDirtyFraction, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - LOD tier"), STAT_MetaBallLODTier, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - LOD time saved (ms, all actors)"), STAT_MetaBallLODTimeSaved, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Octree nodes"), STAT_MetaBallOctreeNodes, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Undecimated triangles"), STAT_MetaBallUndecimatedTriangles, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Decimation (ms)"), STAT_MetaBallDecimationMs, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Time slices per build"), STAT_MetaBallTimeSlices, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Voxels visited"), STAT_MetaBallVoxels, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Grid points evaluated"), STAT_MetaBallGridPoints, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Ball evaluations"), STAT_MetaBallBallEvals, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Open list peak"), STAT_MetaBallOpenListPeak, STATGROUP_MetaBall);
+
+// Phase times, only set while Metaballs.Instrument is on
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Phase update (ms)"), STAT_MetaBallPhaseUpdate, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Phase field (ms)"), STAT_MetaBallPhaseField, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Phase classify (ms)"), STAT_MetaBallPhaseClassify, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Phase emit (ms)"), STAT_MetaBallPhaseEmit, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Phase normals (ms)"), STAT_MetaBallPhaseNormals, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Phase upload (ms)"), STAT_MetaBallPhaseUpload, STATGROUP_MetaBall);
+
+CSV_DEFINE_CATEGORY(Metaballs, true);
+
+static TAutoConsoleVariable<int32> CVarMetaballsInstrument(
+	TEXT("Metaballs.Instrument"),
+	0,
+	TEXT("1 - time the phases of every metaballs build (update, field, classify, emit, normals, upload) into the MetaBall stats and the Metaballs CSV category. ")
+	TEXT("The fill is split by timing one voxel in 16."),
+	ECVF_Default);
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Splatted ball samples"), STAT_MetaBallSplattedBallSamples, STATGROUP_MetaBall);
+
+static FAutoConsoleCommandWithWorldAndArgs GMetaballsBenchBallCountsCmd(
+	TEXT("Metaballs.BenchBallCounts"),
+	TEXT("Times the build of every metaballs actor with 32, 256, 1024 and 4096 balls. Optional argument: frames per count."),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&AMetaballs::BenchBallCounts));
+
+static FAutoConsoleCommandWithWorldAndArgs GMetaballsBenchDecimationCmd(
+	TEXT("Metaballs.BenchDecimation"),
+	TEXT("Times the build, the decimation and the mesh upload of every metaballs actor with decimation off and on. Optional argument: frames per run."),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&AMetaballs::BenchDecimation));
+
+static FAutoConsoleCommandWithWorldAndArgs GMetaballsRecordCmd(
+	TEXT("Metaballs.Record"),
+	TEXT("Records the builds of every metaballs actor to <directory>/<actor>.mbscenario until Metaballs.StopRecording. Optional argument: directory, Saved/Metaballs by default."),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&AMetaballs::RecordScenarios));
+
+static FAutoConsoleCommandWithWorldAndArgs GMetaballsStopRecordingCmd(
+	TEXT("Metaballs.StopRecording"),
+	TEXT("Saves the recordings Metaballs.Record started."),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&AMetaballs::StopRecordingScenarios));
+
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Balls per energy sample"), STAT_MetaBallBallsPerEnergySample, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Balls per normal sample"), STAT_MetaBallBallsPerNormalSample, STATGROUP_MetaBall);
+
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Vertices"), STAT_MetaBallVertices, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Indices"), STAT_MetaBallIndices, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Edge cache hit rate"), STAT_MetaBallEdgeCacheHitRate, STATGROUP_MetaBall);
 
 
 // Sets default values
@@ -88,16 +132,37 @@ AMetaballs::AMetaballs(const FObjectInitializer& ObjectInitializer) : Super(Obje
 	m_automode = true;
 	m_GridStep = 32;
 	m_randomseed = false;
+	m_BallSeed = 0;
 	m_AutoLimitX = 1.0f;
 	m_AutoLimitY = 1.0f;
 	m_AutoLimitZ = 1.0f;
+	m_FiniteSupport = false;
+	m_InfluenceRadius = 0.4f;
+	m_SplatEnergy = false;
+	m_NormalMode = EMetaBallNormalMode::Analytic;
+	m_Polygonizer = EMetaBallPolygonizer::MarchingCubes;
+	m_OctreeTolerance = 0.25f;
+	m_PolygonizerThreads = 1;
+	m_AsyncBuild = false;
+	m_IncrementalBuild = false;
+
+	m_TimeSlicedBuild = false;
+	m_TimeSliceMicroseconds = 2000.0f;
+	m_TimeSliceVoxels = 0;
+
+	m_Decimate = false;
+	m_DecimationTolerance = 2.0f;
+	m_DecimationBudget = 0;
+
+	m_AutoLOD = false;
+	m_LODTiers.Add(FMetaBallLODTier(0.5f, 64));
+	m_LODTiers.Add(FMetaBallLODTier(0.2f, 32));
+	m_LODTiers.Add(FMetaBallLODTier(0.0f, 16));
+	m_LODHysteresis = 0.15f;
 	
 	m_Material = nullptr;
 
 
-	m_pfGridEnergy = nullptr;
-	m_pnGridPointStatus = nullptr;
-	m_pnGridVoxelStatus = nullptr;
 
 }
 
@@ -107,24 +172,40 @@ void AMetaballs::PostInitializeComponents()
 	Super::PostInitializeComponents();
 
 
-	m_fLevel = 100.0f;
+	m_nNumSliceTicks = 0;
+	m_fSlicedBuildSeconds = 0;
+
+	m_nNumVertices = 0;
+	m_nNumIndices = 0;
 
-	m_nGridSize = 0;
+	m_nLODTier = 0;
+	m_fBuildSeconds = 0;
 
-	m_nMaxOpenVoxels = MAX_OPEN_VOXELS;
-	m_pOpenVoxels = new int[m_nMaxOpenVoxels * 3];
+	m_fUpdateSeconds = 0;
+	m_fConvertSeconds = 0;
+	m_fUploadSeconds = 0;
 
-	m_nNumOpenVoxels = 0;
-	m_pfGridEnergy = nullptr;
-	m_pnGridPointStatus = nullptr;
-	m_pnGridVoxelStatus = nullptr;
+	m_pSubsystem = nullptr;
+	m_nLastUploadFrame = 0;
+	m_fRebuildMs = 0;
 
-	m_nNumVertices = 0;
-	m_nNumIndices = 0;
+	m_bRecording = false;
+
+	m_nBallSoAWrite = 0;
+	m_pBuildBalls = &m_BallSoA[0];
+	m_nPendingGridSize = 0;
 
 	InitBalls();
 
-	CMarchingCubes::BuildTables();
+	// Slab workers and decimation chunks run on the task graph
+	m_Core.SetParallelFor([](const int32 Num, const std::function<void(int32)>& Body)
+	{
+		ParallelFor(Num, [&Body](int32 Index)
+		{
+			Body(Index);
+		});
+	});
+
 	SetGridSize(m_GridStep);
 
 	MetaBallsBoundBox->SetBoxExtent(FVector(m_Scale, m_Scale, m_Scale), false);
@@ -154,7 +235,7 @@ void AMetaballs::PostEditChangeProperty(FPropertyChangedEvent& e)
 
 		SetNumBalls(Value);
 
-		if (Value < 0 && Value > MAX_METABALLS)
+		if (Value < 0)
 		{
 			Prop->SetPropertyValue(Prop->ContainerPtrToValuePtr<int32>(this), m_NumBalls);
 		}
@@ -207,6 +288,24 @@ void AMetaballs::PostEditChangeProperty(FPropertyChangedEvent& e)
 	}
 
 
+	/// track Auto LOD value
+	if (PropertyName == GET_MEMBER_NAME_CHECKED(AMetaballs, m_AutoLOD))
+	{
+		SetAutoLOD(m_AutoLOD);
+
+		UE_LOG(MetaballLog, Warning, TEXT("Auto LOD value: %d"), m_AutoLOD);
+	}
+
+
+	/// track LOD tiers, edits of a tier report the tier member as the property
+	if (e.GetMemberPropertyName() == GET_MEMBER_NAME_CHECKED(AMetaballs, m_LODTiers))
+	{
+		SortLODTiers();
+
+		UE_LOG(MetaballLog, Warning, TEXT("LOD tiers: %d"), m_LODTiers.Num());
+	}
+
+
 	/// track LimitX value
 	if (PropertyName == GET_MEMBER_NAME_CHECKED(AMetaballs, m_AutoLimitX))
 	{
@@ -265,6 +364,26 @@ void AMetaballs::PostEditChangeProperty(FPropertyChangedEvent& e)
 
 	}
 
+
+	/// track Influence radius value
+	if (PropertyName == GET_MEMBER_NAME_CHECKED(AMetaballs, m_InfluenceRadius))
+	{
+
+		FFloatProperty* Prop = static_cast<FFloatProperty*>(e.Property);
+
+		const float Value = Prop->GetPropertyValue(Prop->ContainerPtrToValuePtr<float>(this));
+
+		SetInfluenceRadius(Value);
+
+		if (Value != m_InfluenceRadius)
+		{
+			Prop->SetPropertyValue(Prop->ContainerPtrToValuePtr<float>(this), m_InfluenceRadius);
+		}
+
+		UE_LOG(MetaballLog, Warning, TEXT("Influence radius value: %f"), m_InfluenceRadius);
+
+	}
+
 	Super::PostEditChangeProperty(e);
 
 }
@@ -275,6 +394,12 @@ void AMetaballs::BeginPlay()
 {
 	Super::BeginPlay();
 
+	if (UMetaballsSubsystem* Subsystem = GetWorld()->GetSubsystem<UMetaballsSubsystem>())
+	{
+		Subsystem->RegisterActor(this);
+		m_pSubsystem = Subsystem;
+	}
+
 }
 
 // Called every frame
@@ -284,34 +409,119 @@ void AMetaballs::Tick(const float DeltaSeconds)
 
 	if (m_NumBalls > 0)
 	{
+		if (m_AutoLOD)
+		{
+			const float ScreenSize = GetScreenSize();
+
+			if (ScreenSize >= 0)
+				UpdateLOD(ScreenSize);
+		}
+
+		if (!m_AsyncBuild)
+			WaitForBuild();
+
 		Update(DeltaSeconds);
+
+		// Actors of a playing world are rebuilt by the world subsystem, within its frame budget
+		if (!m_pSubsystem)
+			Rebuild();
+	}
+
+}
+
+
+void AMetaballs::Rebuild()
+{
+	if (!m_AsyncBuild)
+	{
+		WaitForBuild();
+
+		// The mesh shown stays until the sliced build is done
+		if (m_TimeSlicedBuild && m_Polygonizer != EMetaBallPolygonizer::AdaptiveOctree)
+		{
+			if (ContinueSlicedBuild())
+				UploadMesh();
+
+			return;
+		}
+
 		Render();
+		return;
 	}
 
+	// Show the last finished build, one frame behind the balls,
+	// then start the next one from the current ball positions
+	if (IsBuildInFlight())
+		return;
+
+	if (m_BuildTask.IsValid())
+	{
+		WaitForBuild();
+		UploadMesh();
+	}
+
+	LaunchAsyncBuild();
+}
+
+
+void AMetaballs::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (m_pSubsystem)
+	{
+		m_pSubsystem->UnregisterActor(this);
+		m_pSubsystem = nullptr;
+	}
+
+	WaitForBuild();
+
+	// A recording still running when the actor leaves play is saved, not lost
+	if (m_bRecording)
+		StopRecording();
+
+	Super::EndPlay(EndPlayReason);
+}
+
+
+void AMetaballs::BeginDestroy()
+{
+	WaitForBuild();
+
+	Super::BeginDestroy();
 }
 
 void AMetaballs::Update(const float dt)
 {
-#if METABALLS_PROFILE
 	SCOPE_CYCLE_COUNTER(STAT_MetaBallUpdate);
-#endif
+	TRACE_CPUPROFILER_EVENT_SCOPE(AMetaballs::Update);
 
-	if (!m_automode)
-		return;
+	const double StartTime = FPlatformTime::Seconds();
+
+	// m_NumBalls is Blueprint writable, follow it here
+	if (m_Balls.Num() != m_NumBalls)
+		SetNumBalls(m_NumBalls);
+
+	if (m_automode)
+		MoveBalls(dt);
 
+	BuildBallSoA();
 
-	for (int i = 0; i < m_NumBalls; i++)
+	m_fUpdateSeconds = FPlatformTime::Seconds() - StartTime;
+}
+
+void AMetaballs::MoveBalls(const float dt)
+{
+	for (int i = 0; i < m_Balls.Num(); i++)
 	{
 		m_Balls[i].p += dt * m_Balls[i].v;
 
 		m_Balls[i].t -= dt;
 		if (m_Balls[i].t < 0)
 		{
-			m_Balls[i].t = FMath::FRand();
+			m_Balls[i].t = m_BallStream.FRand();
 
-			m_Balls[i].a.X = m_AutoLimitY * (FMath::FRand() * 2 - 1);
-			m_Balls[i].a.Y = m_AutoLimitX * (FMath::FRand() * 2 - 1);
-			m_Balls[i].a.Z = m_AutoLimitZ * (FMath::FRand() * 2 - 1);
+			m_Balls[i].a.X = m_AutoLimitY * (m_BallStream.FRand() * 2 - 1);
+			m_Balls[i].a.Y = m_AutoLimitX * (m_BallStream.FRand() * 2 - 1);
+			m_Balls[i].a.Z = m_AutoLimitZ * (m_BallStream.FRand() * 2 - 1);
 
 		}
 
@@ -330,39 +540,39 @@ void AMetaballs::Update(const float dt)
 			m_Balls[i].v = 0.20f * m_Balls[i].v * fDist;
 		}
 
-		if (m_Balls[i].p.X < -m_AutoLimitY + m_fVoxelSize)
+		if (m_Balls[i].p.X < -m_AutoLimitY + m_Core.GetVoxelSize())
 		{
-			m_Balls[i].p.X = -m_AutoLimitY + m_fVoxelSize;
+			m_Balls[i].p.X = -m_AutoLimitY + m_Core.GetVoxelSize();
 			m_Balls[i].v.X = 0;
 		}
-		if (m_Balls[i].p.X >  m_AutoLimitY - m_fVoxelSize)
+		if (m_Balls[i].p.X >  m_AutoLimitY - m_Core.GetVoxelSize())
 		{
-			m_Balls[i].p.X = m_AutoLimitY - m_fVoxelSize;
+			m_Balls[i].p.X = m_AutoLimitY - m_Core.GetVoxelSize();
 			m_Balls[i].v.X = 0;
 		}
 
-		if (m_Balls[i].p.Y < -m_AutoLimitX + m_fVoxelSize)
+		if (m_Balls[i].p.Y < -m_AutoLimitX + m_Core.GetVoxelSize())
 		{
-			m_Balls[i].p.Y = -m_AutoLimitX + m_fVoxelSize;
+			m_Balls[i].p.Y = -m_AutoLimitX + m_Core.GetVoxelSize();
 			m_Balls[i].v.Y = 0;
 		}
 
 
-		if (m_Balls[i].p.Y >  m_AutoLimitX - m_fVoxelSize)
+		if (m_Balls[i].p.Y >  m_AutoLimitX - m_Core.GetVoxelSize())
 		{
-			m_Balls[i].p.Y = m_AutoLimitX - m_fVoxelSize;
+			m_Balls[i].p.Y = m_AutoLimitX - m_Core.GetVoxelSize();
 			m_Balls[i].v.Y = 0;
 		}
 
 
-		if (m_Balls[i].p.Z < -m_AutoLimitZ + m_fVoxelSize)
+		if (m_Balls[i].p.Z < -m_AutoLimitZ + m_Core.GetVoxelSize())
 		{
-			m_Balls[i].p.Z = -m_AutoLimitZ + m_fVoxelSize;
+			m_Balls[i].p.Z = -m_AutoLimitZ + m_Core.GetVoxelSize();
 			m_Balls[i].v.Z = 0;
 		}
-		if (m_Balls[i].p.Z >  m_AutoLimitZ - m_fVoxelSize)
+		if (m_Balls[i].p.Z >  m_AutoLimitZ - m_Core.GetVoxelSize())
 		{
-			m_Balls[i].p.Z = m_AutoLimitZ - m_fVoxelSize;
+			m_Balls[i].p.Z = m_AutoLimitZ - m_Core.GetVoxelSize();
 			m_Balls[i].v.Z = 0;
 		}
 	}
@@ -370,399 +580,605 @@ void AMetaballs::Update(const float dt)
 
 void AMetaballs::Render()
 {
-#if METABALLS_PROFILE
 	SCOPE_CYCLE_COUNTER(STAT_MetaBallRender);
-#endif
-	
-	m_vertices.Empty();
-	m_Triangles.Empty();
-	m_normals.Empty();
-	m_UV0.Empty();
-	m_tangents.Empty();
+	TRACE_CPUPROFILER_EVENT_SCOPE(AMetaballs::Render);
 
-	m_mesh->ClearAllMeshSections();
-
-	m_nNumIndices = 0;
-	m_nNumVertices = 0;
-	int nCase = 0;
+	BeginBuild();
+	BuildMesh();
+	UploadMesh();
+}
 
-	// Clear status grids
-	FMemory::Memset(m_pnGridPointStatus, 0, FMath::Pow(m_nGridSize+1, 3));
-	FMemory::Memset(m_pnGridVoxelStatus, 0, FMath::Pow(m_nGridSize, 3));
 
-	for (int i = 0; i < m_NumBalls; i++)
+void AMetaballs::BeginBuild()
+{
+	// Hand the freshest ball snapshot to the build and let Update fill the other buffer from now on
+	m_pBuildBalls = &m_BallSoA[m_nBallSoAWrite];
+	m_nBallSoAWrite = 1 - m_nBallSoAWrite;
+
+	// A new build drops a sliced one that was not done, it shares the grids and the work list
+	m_Core.CancelSlicedBuild();
+
+	m_BuildSettings.bFiniteSupport = m_FiniteSupport;
+	m_BuildSettings.InfluenceRadius = m_InfluenceRadius;
+	m_BuildSettings.bSplatEnergy = m_SplatEnergy;
+	m_BuildSettings.NormalMode = m_NormalMode == EMetaBallNormalMode::GridGradient ? EPolygonizerNormals::GridGradient : EPolygonizerNormals::Analytic;
+	m_BuildSettings.bIncrementalBuild = m_IncrementalBuild;
+	m_BuildSettings.Polygonizer =
+		m_Polygonizer == EMetaBallPolygonizer::AdaptiveOctree ? EPolygonizerMode::AdaptiveOctree :
+		m_Polygonizer == EMetaBallPolygonizer::SurfaceNets ? EPolygonizerMode::SurfaceNets : EPolygonizerMode::MarchingCubes;
+	m_BuildSettings.OctreeTolerance = m_OctreeTolerance;
+	m_BuildSettings.bDecimate = m_Decimate;
+	m_BuildSettings.DecimationTolerance = m_DecimationTolerance;
+	m_BuildSettings.DecimationBudget = m_DecimationBudget;
+	m_BuildSettings.PolygonizerThreads = m_PolygonizerThreads;
+	m_BuildSettings.Scale = m_Scale;
+	m_BuildSettings.bInstrument = CVarMetaballsInstrument.GetValueOnGameThread() != 0;
+
+	// Grid changes requested while a build was running
+	if (m_nPendingGridSize)
 	{
-		int x = ConvertWorldCoordinateToGridPoint(m_Balls[i].p[0]);
-		int y = ConvertWorldCoordinateToGridPoint(m_Balls[i].p[1]);
-		int z = ConvertWorldCoordinateToGridPoint(m_Balls[i].p[2]);
+		SetGridSize(m_nPendingGridSize);
+		m_nPendingGridSize = 0;
+	}
 
-		bool bComputed = false;
+	if (m_bRecording)
+		m_Recording.AddFrame(m_Core.GetGridSize(), m_BuildSettings, *m_pBuildBalls);
+}
 
-		// TODO: Check if bComputed can be used instead of constant
-		while (true)
-		{
-			if (IsGridVoxelComputed(x, y, z))
-			{
-				bComputed = true;
-				break;
-			}
 
-			nCase = ComputeGridVoxel(x, y, z);
-			if (nCase < 255)
-				break;
+void AMetaballs::BuildMesh()
+{
+	SCOPE_CYCLE_COUNTER(STAT_MetaBallBuildMesh);
+	TRACE_CPUPROFILER_EVENT_SCOPE(AMetaballs::BuildMesh);
 
-			z--;
-		}
+	const double StartTime = FPlatformTime::Seconds();
 
-		if (bComputed)
-			continue;
+	m_Core.Build(*m_pBuildBalls, m_BuildSettings);
 
-		AddNeighborsToList(nCase, x, y, z);
+	m_nNumSliceTicks = 0;
+	m_fBuildSeconds = FPlatformTime::Seconds() - StartTime;
 
-		while (m_nNumOpenVoxels)
-		{
-			m_nNumOpenVoxels--;
-			x = m_pOpenVoxels[m_nNumOpenVoxels * 3];
-			y = m_pOpenVoxels[m_nNumOpenVoxels * 3 + 1];
-			z = m_pOpenVoxels[m_nNumOpenVoxels * 3 + 2];
+	ConvertMesh();
+}
 
-			nCase = ComputeGridVoxel(x, y, z);
 
-			AddNeighborsToList(nCase, x, y, z);
-		}
+bool AMetaballs::ContinueSlicedBuild()
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE(AMetaballs::ContinueSlicedBuild);
+
+	const double StartTime = FPlatformTime::Seconds();
+
+	if (!m_Core.IsSlicedBuildActive())
+	{
+		// The balls and settings of the whole build are the ones BeginBuild takes here
+		BeginBuild();
+		m_Core.BeginSlicedBuild(*m_pBuildBalls, m_BuildSettings);
 
+		m_nNumSliceTicks = 0;
+		m_fSlicedBuildSeconds = 0;
 	}
 
-	m_mesh->CreateMeshSection(1, m_vertices, m_Triangles, m_normals, m_UV0, m_vertexColors, m_tangents, false);
-}
+	// The slice started with the tick, starting the build already took part of it
+	const double SliceSeconds = FMath::Max<float>(m_TimeSliceMicroseconds, MIN_TIME_SLICE_MICROSECONDS) * 1e-6;
+	const double RemainingSeconds = FMath::Max(StartTime + SliceSeconds - FPlatformTime::Seconds(), 1e-9);
+	const int32 MaxVoxels = m_TimeSliceVoxels > 0 ? m_TimeSliceVoxels : MAX_int32;
 
+	const bool bDone = m_Core.ContinueSlicedBuild(MaxVoxels, RemainingSeconds);
 
-void AMetaballs::ComputeNormal(const FVector& Vertex)
-{
-#if METABALLS_PROFILE
-	SCOPE_CYCLE_COUNTER(STAT_MetaBallComputeNormal);
-#endif
-	
-	FVector NVector(FVector::ZeroVector);
+	m_nNumSliceTicks++;
+	m_fSlicedBuildSeconds += FPlatformTime::Seconds() - StartTime;
 
-	for (int i = 0; i < m_NumBalls; i++)
+	if (bDone)
 	{
-		FVector CalcVector(FVector(
-		Vertex.X - m_Balls[i].p.Z,
-		Vertex.Y - m_Balls[i].p.Y,
-		Vertex.Z - m_Balls[i].p.X));
+		m_fBuildSeconds = m_fSlicedBuildSeconds;
 
-		NVector += 2 * m_Balls[i].m * CalcVector / FMath::Square<float>(CalcVector.SizeSquared());
+		ConvertMesh();
 	}
 
-	NVector.Normalize();
-	m_normals.Add(NVector);
-	m_UV0.Add(FVector2D(NVector));
+	return bDone;
 }
 
 
-void AMetaballs::AddNeighborsToList(const int nCase, const int x, const int y, const int z)
+void AMetaballs::ConvertMesh()
 {
-#if METABALLS_PROFILE
-	SCOPE_CYCLE_COUNTER(STAT_MetaBallAddNeighborToList);
-#endif
-	
-	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 0))
-		AddNeighbor(x + 1, y, z);
+	TRACE_CPUPROFILER_EVENT_SCOPE(AMetaballs::ConvertMesh);
+
+	const double StartTime = FPlatformTime::Seconds();
+	const SPolygonizerOutput& Output = m_Core.GetOutput();
+	const int32 NumVertices = static_cast<int32>(Output.Vertices.size());
+	const int32 NumIndices = static_cast<int32>(Output.Triangles.size());
 
-	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 1))
-		AddNeighbor(x - 1, y, z);
+	// Sizes are set without shrinking, the arrays keep their memory from build to build like the core buffers
+	m_MeshVertices.SetNumUninitialized(NumVertices, false);
+	m_MeshNormals.SetNumUninitialized(NumVertices, false);
+	m_MeshUV0.SetNumUninitialized(NumVertices, false);
+	m_MeshTriangles.SetNumUninitialized(NumIndices, false);
+
+	for (int32 i = 0; i < NumVertices; i++)
+	{
+		const SVector3f& Vertex = Output.Vertices[i];
+		const SVector3f& Normal = Output.Normals[i];
 
-	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 2))
-		AddNeighbor(x, y + 1, z);
+		m_MeshVertices[i] = FVector(Vertex.X, Vertex.Y, Vertex.Z);
+		m_MeshNormals[i] = FVector(Normal.X, Normal.Y, Normal.Z);
 
-	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 3))
-		AddNeighbor(x, y - 1, z);
+		// UV0 has always carried the normal, materials may read it
+		m_MeshUV0[i] = FVector2D(Normal.X, Normal.Y);
+	}
 
-	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 4))
-		AddNeighbor(x, y, z + 1);
+	if (NumIndices)
+		FMemory::Memcpy(m_MeshTriangles.GetData(), Output.Triangles.data(), NumIndices * sizeof(int32));
 
-	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 5))
-		AddNeighbor(x, y, z - 1);
+	m_fConvertSeconds = FPlatformTime::Seconds() - StartTime;
 }
 
 
-void AMetaballs::AddNeighbor(const int x, const int y, const int z)
+void AMetaballs::UploadMesh()
 {
-#if METABALLS_PROFILE
-	SCOPE_CYCLE_COUNTER(STAT_MetaBallAddNeighbor);
-#endif
+	SCOPE_CYCLE_COUNTER(STAT_MetaBallUploadMesh);
+	TRACE_CPUPROFILER_EVENT_SCOPE(AMetaballs::UploadMesh);
+
+	const SPolygonizerOutput& Output = m_Core.GetOutput();
+
+	m_nNumVertices = m_MeshVertices.Num();
+	m_nNumIndices = m_MeshTriangles.Num();
+	m_nLastUploadFrame = GFrameCounter;
+
+	const double StartTime = FPlatformTime::Seconds();
+
+	// Creating the section again replaces it in place, clearing all sections first would free the section array every frame
+	if (m_nNumIndices)
+		m_mesh->CreateMeshSection(1, m_MeshVertices, m_MeshTriangles, m_MeshNormals, m_MeshUV0, m_vertexColors, m_tangents, false);
+	else
+		m_mesh->ClearMeshSection(1);
+
+	m_fUploadSeconds = FPlatformTime::Seconds() - StartTime;
+
+	SET_FLOAT_STAT(STAT_MetaBallBallsPerEnergySample, Output.NumEnergySamples ? static_cast<float>(Output.NumEnergyBallEvals) / Output.NumEnergySamples : 0.0f);
+	SET_FLOAT_STAT(STAT_MetaBallBallsPerNormalSample, Output.NumNormalSamples ? static_cast<float>(Output.NumNormalBallEvals) / Output.NumNormalSamples : 0.0f);
+	SET_DWORD_STAT(STAT_MetaBallVertices, m_nNumVertices);
+	SET_DWORD_STAT(STAT_MetaBallIndices, m_nNumIndices);
+	SET_FLOAT_STAT(STAT_MetaBallEdgeCacheHitRate, Output.NumEdgeLookups ? static_cast<float>(Output.NumEdgeCacheHits) / Output.NumEdgeLookups : 0.0f);
+	SET_DWORD_STAT(STAT_MetaBallReallocatingBuilds, m_Core.GetNumReallocatingBuilds());
+	SET_MEMORY_STAT(STAT_MetaBallBuildMemory, m_Core.GetAllocatedSize() + m_MeshVertices.GetAllocatedSize() + m_MeshTriangles.GetAllocatedSize() +
+		m_MeshNormals.GetAllocatedSize() + m_MeshUV0.GetAllocatedSize());
+	SET_MEMORY_STAT(STAT_MetaBallGridMemory, m_Core.GetGrid().GetAllocatedSize());
+	SET_DWORD_STAT(STAT_MetaBallGridBricks, m_Core.GetGrid().GetNumBricks());
+	SET_DWORD_STAT(STAT_MetaBallDirtyBricks, m_Core.GetNumDirtyBricks());
+	SET_FLOAT_STAT(STAT_MetaBallDirtyFraction, m_Core.GetDirtyFraction());
+	SET_DWORD_STAT(STAT_MetaBallOctreeNodes, m_BuildSettings.Polygonizer == EPolygonizerMode::AdaptiveOctree ? m_Core.GetNumOctreeNodes() : 0);
+	SET_DWORD_STAT(STAT_MetaBallUndecimatedTriangles, m_BuildSettings.bDecimate ? m_Core.GetNumUndecimatedTriangles() : m_nNumIndices / 3);
+	SET_FLOAT_STAT(STAT_MetaBallDecimationMs, m_BuildSettings.bDecimate ? static_cast<float>(m_Core.GetDecimateSeconds() * 1000.0) : 0.0f);
+	SET_DWORD_STAT(STAT_MetaBallSplattedBallSamples, m_Core.GetNumSplattedSamples());
+	SET_DWORD_STAT(STAT_MetaBallTimeSlices, m_nNumSliceTicks);
+	SET_DWORD_STAT(STAT_MetaBallVoxels, Output.NumVoxels);
+	SET_DWORD_STAT(STAT_MetaBallGridPoints, Output.NumEnergySamples);
+	SET_DWORD_STAT(STAT_MetaBallBallEvals, Output.NumEnergyBallEvals + Output.NumNormalBallEvals);
+	SET_DWORD_STAT(STAT_MetaBallOpenListPeak, Output.PeakOpenVoxels);
+
+	if (m_BuildSettings.bInstrument)
+		ReportPhaseTimes();
+
+	if (m_AutoLOD)
+	{
+		int FinestSteps = m_Core.GetGridSize();
 
-	if (IsGridVoxelComputed(x, y, z) || IsGridVoxelInList(x, y, z))
-		return;
+		for (const FMetaBallLODTier& Tier : m_LODTiers)
+			FinestSteps = FMath::Max(FinestSteps, FMath::Clamp<int>(Tier.GridSteps, MIN_GRID_STEPS, MAX_GRID_STEPS));
 
-	// Make sure the array is large enough
-	if (m_nMaxOpenVoxels == m_nNumOpenVoxels)
-	{
-		m_nMaxOpenVoxels *= 2;
-		int *pTmp = new int[m_nMaxOpenVoxels * 3];
-		FMemory::Memcpy(pTmp, m_pOpenVoxels, m_nNumOpenVoxels * 3 * sizeof(int));
-		delete[] m_pOpenVoxels;
-		m_pOpenVoxels = pTmp;
+		// The surface, and with it the build time, grows with the square of the grid steps
+		const float Ratio = static_cast<float>(FinestSteps) / m_Core.GetGridSize();
+
+		SET_DWORD_STAT(STAT_MetaBallLODTier, m_nLODTier);
+		INC_FLOAT_STAT_BY(STAT_MetaBallLODTimeSaved, static_cast<float>(m_fBuildSeconds * 1000.0) * (Ratio * Ratio - 1.0f));
 	}
-	
-	m_pOpenVoxels[m_nNumOpenVoxels * 3] = x;
-	m_pOpenVoxels[m_nNumOpenVoxels * 3 + 1] = y;
-	m_pOpenVoxels[m_nNumOpenVoxels * 3 + 2] = z;
+}
 
-	SetGridVoxelInList(x, y, z);
 
-	m_nNumOpenVoxels++;
-}
 
-float AMetaballs::ComputeEnergy(const float x, const float y, const float z) const
+void AMetaballs::ReportPhaseTimes() const
 {
-#if METABALLS_PROFILE
-	SCOPE_CYCLE_COUNTER(STAT_MetaBallComputeEnergy);
-#endif
+	const SPolygonizerOutput& Output = m_Core.GetOutput();
 
-	float fEnergy = 0;
+	// The timed voxels split the fill. Builds without them, like the octree, count it all as emitting.
+	double FieldShare = 0;
+	double ClassifyShare = 0;
+	double NormalShare = 0;
 
-	for (int i = 0; i < m_NumBalls; i++)
+	if (Output.VoxelCycles)
 	{
-		// The formula for the energy is 
-		// 
-		//   e += mass/distance^2
-
-		const float fSqDist = FMath::Max<float>(FVector::DistSquared(m_Balls[i].p, FVector(x, y, z)), 0.0001f);
-		
-		fEnergy += m_Balls[i].m / fSqDist;
+		FieldShare = static_cast<double>(Output.FieldCycles) / Output.VoxelCycles;
+		ClassifyShare = static_cast<double>(Output.ClassifyCycles) / Output.VoxelCycles;
+		NormalShare = static_cast<double>(Output.NormalCycles) / Output.VoxelCycles;
 	}
 
-	return fEnergy;
+	const double FillMs = m_Core.GetPolygonizeSeconds() * 1000.0;
+
+	const float UpdateMs = static_cast<float>(m_fUpdateSeconds * 1000.0);
+	const float FieldMs = static_cast<float>(m_Core.GetFieldSeconds() * 1000.0 + FillMs * FieldShare);
+	const float ClassifyMs = static_cast<float>(FillMs * ClassifyShare);
+	const float NormalsMs = static_cast<float>(FillMs * NormalShare);
+	const float EmitMs = static_cast<float>(FMath::Max(FillMs * (1.0 - FieldShare - ClassifyShare - NormalShare), 0.0));
+	const float UploadMs = static_cast<float>((m_fConvertSeconds + m_fUploadSeconds) * 1000.0);
+
+	SET_FLOAT_STAT(STAT_MetaBallPhaseUpdate, UpdateMs);
+	SET_FLOAT_STAT(STAT_MetaBallPhaseField, FieldMs);
+	SET_FLOAT_STAT(STAT_MetaBallPhaseClassify, ClassifyMs);
+	SET_FLOAT_STAT(STAT_MetaBallPhaseEmit, EmitMs);
+	SET_FLOAT_STAT(STAT_MetaBallPhaseNormals, NormalsMs);
+	SET_FLOAT_STAT(STAT_MetaBallPhaseUpload, UploadMs);
+
+	// Summed over the actors of a frame
+	CSV_CUSTOM_STAT(Metaballs, UpdateMs, UpdateMs, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, FieldMs, FieldMs, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, ClassifyMs, ClassifyMs, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, EmitMs, EmitMs, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, NormalsMs, NormalsMs, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, UploadMs, UploadMs, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, BuildMs, static_cast<float>(m_fBuildSeconds * 1000.0), ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, Voxels, static_cast<int32>(Output.NumVoxels), ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, GridPoints, static_cast<int32>(Output.NumEnergySamples), ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, Vertices, m_nNumVertices, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(Metaballs, Indices, m_nNumIndices, ECsvCustomStatOp::Accumulate);
 }
 
-
-float AMetaballs::ComputeGridPointEnergy(const int x, const int y, const int z) const
+void AMetaballs::LaunchAsyncBuild()
 {
-#if METABALLS_PROFILE
-	SCOPE_CYCLE_COUNTER(STAT_MetaBallComputeGridpointEnergy);
-#endif
-	
-	const int Index = GetIndex(x, y, z, m_nGridSize);
-	
-	if (IsGridPointComputed(x, y, z))
-		return m_pfGridEnergy[Index];
+	BeginBuild();
 
-	// The energy on the edges are always zero to make sure the isosurface is
-	// always closed.
-	if (x == 0 || y == 0 || z == 0 ||
-		x == m_nGridSize || y == m_nGridSize || z == m_nGridSize)
+	m_BuildTask = UE::Tasks::Launch(TEXT("MetaballsBuildMesh"), [this]()
 	{
-		m_pfGridEnergy[Index] = 0;
-		SetGridPointComputed(x, y, z);
-		return 0;
-	}
-
-	m_pfGridEnergy[Index] = ComputeEnergy(
-		ConvertGridPointToWorldCoordinate(x),
-		ConvertGridPointToWorldCoordinate(y),
-		ConvertGridPointToWorldCoordinate(z));
+		BuildMesh();
+	});
+}
 
-	SetGridPointComputed(x, y, z);
 
-	return m_pfGridEnergy[Index];
+bool AMetaballs::IsBuildInFlight() const
+{
+	return !m_BuildTask.IsCompleted();
 }
 
 
-int AMetaballs::ComputeGridVoxel(int x, int y, int z)
+void AMetaballs::WaitForBuild()
 {
-#if METABALLS_PROFILE
-	SCOPE_CYCLE_COUNTER(STAT_MetaBallComputeGridVoxel);
-#endif
+	if (m_BuildTask.IsValid())
+	{
+		m_BuildTask.Wait();
+		m_BuildTask = UE::Tasks::FTask();
+	}
+}
 
-	float b[8];
-
-	b[0] = ComputeGridPointEnergy(x, y, z);
-	b[1] = ComputeGridPointEnergy(x + 1, y, z);
-	b[2] = ComputeGridPointEnergy(x + 1, y, z + 1);
-	b[3] = ComputeGridPointEnergy(x, y, z + 1);
-	b[4] = ComputeGridPointEnergy(x, y + 1, z);
-	b[5] = ComputeGridPointEnergy(x + 1, y + 1, z);
-	b[6] = ComputeGridPointEnergy(x + 1, y + 1, z + 1);
-	b[7] = ComputeGridPointEnergy(x, y + 1, z + 1);
-
-	int c = 0;
-	c |= b[0] > m_fLevel ? (1 << 0) : 0;
-	c |= b[1] > m_fLevel ? (1 << 1) : 0;
-	c |= b[2] > m_fLevel ? (1 << 2) : 0;
-	c |= b[3] > m_fLevel ? (1 << 3) : 0;
-	c |= b[4] > m_fLevel ? (1 << 4) : 0;
-	c |= b[5] > m_fLevel ? (1 << 5) : 0;
-	c |= b[6] > m_fLevel ? (1 << 6) : 0;
-	c |= b[7] > m_fLevel ? (1 << 7) : 0;
 
-	
-	const FVector PyramidVector(FVector(
-		ConvertGridPointToWorldCoordinate(x),
-		ConvertGridPointToWorldCoordinate(y),
-		ConvertGridPointToWorldCoordinate(z)));
-		
-	int i = 0;
-	unsigned short EdgeIndices[12];
-	FMemory::Memset(EdgeIndices, 0xFF, 12 * sizeof(unsigned short));
+void AMetaballs::BuildBallSoA()
+{
+	// The other buffer may be read by a build in flight
+	SMetaBallSoA& Balls = m_BallSoA[m_nBallSoAWrite];
 
-	while (true)
-	{
-		const int nEdge = CMarchingCubes::m_CubeTriangles[c][i];
-		if (nEdge == -1)
-			break;
+	Balls.SetNum(m_Balls.Num());
 
-		if (EdgeIndices[nEdge] == 0xFFFF)
-		{
-			#if METABALLS_PROFILE
-						SCOPE_CYCLE_COUNTER(STAT_MetaBallComputeGridVoxelForLoop);
-			#endif
-			EdgeIndices[nEdge] = m_nNumVertices;
+	for (int i = 0; i < m_Balls.Num(); i++)
+	{
+		Balls.X[i] = m_Balls[i].p.X;
+		Balls.Y[i] = m_Balls[i].p.Y;
+		Balls.Z[i] = m_Balls[i].p.Z;
+		Balls.M[i] = m_Balls[i].m;
+	}
+}
 
-			// Compute the vertex by interpolating between the two points
-			const int nIndex0 = CMarchingCubes::m_CubeEdges[nEdge][0];
-			const int nIndex1 = CMarchingCubes::m_CubeEdges[nEdge][1];
 
-			const float t = (m_fLevel - b[nIndex0]) / (b[nIndex1] - b[nIndex0]);
+void AMetaballs::SetGridSize(const int nSize)
+{
+	m_Core.SetGridSize(nSize);
+}
 
-			FVector CubesVector(FVector(
-			CMarchingCubes::m_CubeVertices[nIndex0][0] * (1 - t) + CMarchingCubes::m_CubeVertices[nIndex1][0] * t,
-			CMarchingCubes::m_CubeVertices[nIndex0][1] * (1 - t) + CMarchingCubes::m_CubeVertices[nIndex1][1] * t,
-			CMarchingCubes::m_CubeVertices[nIndex0][2] * (1 - t) + CMarchingCubes::m_CubeVertices[nIndex1][2] * t));
+void AMetaballs::InitBalls()
+{
+	m_BallStream.Initialize(m_BallSeed ? m_BallSeed : static_cast<int32>(FDateTime::Now().GetTicks()));
 
-			FVector EdgeVector(PyramidVector + CubesVector * m_fVoxelSize);
-			EdgeVector = FVector(EdgeVector.Z, EdgeVector.Y, EdgeVector.X);			
+	m_Balls.Reset();
+	SetNumBalls(m_NumBalls);
+}
 
-			ComputeNormal(EdgeVector);
 
-			m_vertices.Add(EdgeVector * m_Scale);
+void AMetaballs::InitBall(SMetaBall& Ball) const
+{
+	Ball.p.X = m_randomseed ? m_AutoLimitY * (m_BallStream.FRand() * 2 - 1) : 0.0f;
+	Ball.p.Y = m_randomseed ? m_AutoLimitX * (m_BallStream.FRand() * 2 - 1) : 0.0f;
+	Ball.p.Z = m_randomseed ? m_AutoLimitZ * (m_BallStream.FRand() * 2 - 1) : 0.0f;
+	Ball.v.X = m_randomseed ? (m_BallStream.FRand() * 2 - 1) / 2 : 0.0f;
+	Ball.v.Y = m_randomseed ? (m_BallStream.FRand() * 2 - 1) / 2 : 0.0f;
+	Ball.v.Z = m_randomseed ? (m_BallStream.FRand() * 2 - 1) / 2 : 0.0f;
+	Ball.a.X = m_AutoLimitY * (m_BallStream.FRand() * 2 - 1);
+	Ball.a.Y = m_AutoLimitX * (m_BallStream.FRand() * 2 - 1);
+	Ball.a.Z = m_AutoLimitZ * (m_BallStream.FRand() * 2 - 1);
+	Ball.t = m_BallStream.FRand();
+	Ball.m = 1;
+}
 
-			m_nNumVertices++;
-		}
 
-		m_Triangles.Add(EdgeIndices[nEdge]);
+void AMetaballs::SetBallTransform(const int32 Index, const FVector& Transform)
+{
+	if (!m_Balls.IsValidIndex(Index))
+	{
+		return;
+	}
 
-		m_nNumIndices++;
+	m_Balls[Index].p = FVector(Transform.Y, Transform.X, Transform.Z);
+}
 
-		i++;
-	}
+void AMetaballs::SetNumBalls(const int Value)
+{
+	m_NumBalls = FMath::Max<int32>(Value, 0);
 
-	SetGridVoxelComputed(x, y, z);
+	const int OldNum = m_Balls.Num();
 
-	return c;
+	m_Balls.SetNum(m_NumBalls);
 
+	for (int i = OldNum; i < m_NumBalls; i++)
+		InitBall(m_Balls[i]);
 }
 
-float AMetaballs::ConvertGridPointToWorldCoordinate(const int x) const
+int32 AMetaballs::AddBall(const FVector& Transform, const float Mass)
 {
-	return static_cast<float>(x) * m_fVoxelSize - 1.0f;
+	SMetaBall Ball;
+	InitBall(Ball);
+
+	Ball.p = FVector(Transform.Y, Transform.X, Transform.Z);
+	Ball.m = Mass;
+
+	m_NumBalls = m_Balls.Num() + 1;
+
+	return m_Balls.Add(Ball);
 }
 
-int AMetaballs::ConvertWorldCoordinateToGridPoint(const float x) const
+void AMetaballs::RemoveBall(const int32 Index)
 {
-	return static_cast<int>((x + 1.0f) / m_fVoxelSize + 0.5f);
+	if (!m_Balls.IsValidIndex(Index))
+	{
+		return;
+	}
+
+	m_Balls.RemoveAtSwap(Index);
+	m_NumBalls = m_Balls.Num();
 }
 
-void AMetaballs::SetGridSize(const int nSize)
+void AMetaballs::BenchBallCounts(const TArray<FString>& Args, UWorld* World)
 {
-	if (m_pfGridEnergy)
-		delete m_pfGridEnergy;
+	static const int32 BallCounts[] = { 32, 256, 1024, 4096 };
 
-	if (m_pnGridPointStatus)
-		delete m_pnGridPointStatus;
+	const int32 NumFrames = Args.Num() > 0 ? FMath::Max(FCString::Atoi(*Args[0]), 1) : 30;
 
-	if (m_pnGridVoxelStatus)
-		delete m_pnGridVoxelStatus;
+	for (TActorIterator<AMetaballs> It(World); It; ++It)
+	{
+		AMetaballs* Actor = *It;
 
-	m_fVoxelSize = 2 / static_cast<float>(nSize);
-	m_nGridSize = nSize;
+		Actor->WaitForBuild();
 
-	m_pfGridEnergy = new float[FMath::Pow(nSize+1, 3)];
-	m_pnGridPointStatus = new char[FMath::Pow(nSize+1, 3)];
-	m_pnGridVoxelStatus = new char[FMath::Pow(nSize, 3)];
-}
+		const TArray<SMetaBall> SavedBalls = Actor->m_Balls;
+		const int32 SavedNumBalls = Actor->m_NumBalls;
+		const bool bSavedAsyncBuild = Actor->m_AsyncBuild;
 
-inline bool AMetaballs::IsGridPointComputed(const int x, const int y, const int z) const
-{
-	return static_cast<bool>(m_pnGridPointStatus[GetIndex(x, y, z, m_nGridSize)] == 1);
+		Actor->m_AsyncBuild = false;
+
+		for (const int32 Count : BallCounts)
+		{
+			Actor->SetNumBalls(Count);
+
+			// The first frames grow the build buffers and grid bricks
+			for (int32 Frame = 0; Frame < 3; Frame++)
+			{
+				Actor->Update(1.0f / 60.0f);
+				Actor->Render();
+			}
+
+			const double Start = FPlatformTime::Seconds();
+
+			for (int32 Frame = 0; Frame < NumFrames; Frame++)
+			{
+				Actor->Update(1.0f / 60.0f);
+				Actor->Render();
+			}
+
+			const double Ms = (FPlatformTime::Seconds() - Start) * 1000.0 / NumFrames;
+			const SPolygonizerOutput& Output = Actor->m_Core.GetOutput();
+
+			UE_LOG(MetaballLog, Log, TEXT("Metaballs %s: %d balls, grid %d, %.3f ms/frame, %d vertices, %.1f balls per sample"),
+				*Actor->GetName(), Count, Actor->m_GridStep, Ms, Actor->m_MeshVertices.Num(),
+				Output.NumEnergySamples > 0 ? static_cast<double>(Output.NumEnergyBallEvals) / Output.NumEnergySamples : 0.0);
+		}
+
+		Actor->m_Balls = SavedBalls;
+		Actor->m_NumBalls = SavedNumBalls;
+		Actor->m_AsyncBuild = bSavedAsyncBuild;
+	}
 }
 
-inline bool AMetaballs::IsGridVoxelComputed(const int x, const int y, const int z) const
+void AMetaballs::BenchDecimation(const TArray<FString>& Args, UWorld* World)
 {
-	 return static_cast<bool>(m_pnGridVoxelStatus[GetIndexNoAdd(x, y, z, m_nGridSize)] == 1);
+	const int32 NumFrames = Args.Num() > 0 ? FMath::Max(FCString::Atoi(*Args[0]), 1) : 30;
+
+	for (TActorIterator<AMetaballs> It(World); It; ++It)
+	{
+		AMetaballs* Actor = *It;
+
+		Actor->WaitForBuild();
+
+		const TArray<SMetaBall> SavedBalls = Actor->m_Balls;
+		const bool bSavedAsyncBuild = Actor->m_AsyncBuild;
+		const bool bSavedDecimate = Actor->m_Decimate;
+
+		Actor->m_AsyncBuild = false;
+
+		for (int32 Run = 0; Run < 2; Run++)
+		{
+			// Both runs start from the same balls, so they polygonize the same surfaces
+			Actor->m_Balls = SavedBalls;
+			Actor->m_Decimate = Run == 1;
+
+			for (int32 Frame = 0; Frame < 3; Frame++)
+			{
+				Actor->Update(1.0f / 60.0f);
+				Actor->Render();
+			}
+
+			double BuildSeconds = 0;
+			double DecimateSeconds = 0;
+			double UploadSeconds = 0;
+
+			for (int32 Frame = 0; Frame < NumFrames; Frame++)
+			{
+				Actor->Update(1.0f / 60.0f);
+				Actor->BeginBuild();
+				Actor->BuildMesh();
+
+				const double Start = FPlatformTime::Seconds();
+
+				Actor->UploadMesh();
+
+				UploadSeconds += FPlatformTime::Seconds() - Start;
+				BuildSeconds += Actor->m_fBuildSeconds;
+				DecimateSeconds += Actor->m_Decimate ? Actor->m_Core.GetDecimateSeconds() : 0.0;
+			}
+
+			UE_LOG(MetaballLog, Log, TEXT("Metaballs %s: decimation %s, grid %d, %d triangles, build %.3f ms (decimation %.3f ms), upload %.3f ms"),
+				*Actor->GetName(), Actor->m_Decimate ? TEXT("on") : TEXT("off"), Actor->m_GridStep, Actor->m_nNumIndices / 3,
+				BuildSeconds * 1000.0 / NumFrames, DecimateSeconds * 1000.0 / NumFrames, UploadSeconds * 1000.0 / NumFrames);
+		}
+
+		Actor->m_Balls = SavedBalls;
+		Actor->m_AsyncBuild = bSavedAsyncBuild;
+		Actor->m_Decimate = bSavedDecimate;
+	}
 }
 
-inline bool AMetaballs::IsGridVoxelInList(const int x, const int y, const int z) const
+void AMetaballs::StartRecording(const FString& Path)
 {
-	return static_cast<bool>(m_pnGridVoxelStatus[GetIndexNoAdd(x, y, z, m_nGridSize)] == 2);
+	m_Recording.Reset();
+	m_RecordingPath = Path;
+	m_bRecording = true;
 }
 
-inline void AMetaballs::SetGridPointComputed(const int x, const int y, const int z) const
+bool AMetaballs::StopRecording()
 {
-	m_pnGridPointStatus[GetIndex(x, y, z, m_nGridSize)] = 1;
+	if (!m_bRecording)
+		return false;
+
+	m_bRecording = false;
+
+	std::vector<uint8_t> Data;
+	m_Recording.Save(Data);
+
+	const int32 NumFrames = m_Recording.GetNumFrames();
+	const bool bSaved = FFileHelper::SaveArrayToFile(TArrayView<const uint8>(Data.data(), static_cast<int32>(Data.size())), *m_RecordingPath);
+
+	UE_LOG(MetaballLog, Log, TEXT("Metaballs %s: %s %d recorded builds, %d bytes, to %s"),
+		*GetName(), bSaved ? TEXT("saved") : TEXT("failed to save"), NumFrames, static_cast<int32>(Data.size()), *m_RecordingPath);
+
+	m_Recording.Reset();
+
+	return bSaved && NumFrames > 0;
 }
 
-inline void AMetaballs::SetGridVoxelComputed(const int x, const int y, const int z) const
+void AMetaballs::RecordScenarios(const TArray<FString>& Args, UWorld* World)
 {
-	m_pnGridVoxelStatus[GetIndexNoAdd(x, y, z, m_nGridSize)] = 1;
+	const FString Directory = Args.Num() > 0 ? Args[0] : FPaths::ProjectSavedDir() / TEXT("Metaballs");
+
+	for (TActorIterator<AMetaballs> It(World); It; ++It)
+		It->StartRecording(Directory / It->GetName() + TEXT(".mbscenario"));
 }
 
-inline void AMetaballs::SetGridVoxelInList(const int x, const int y, const int z) const
+void AMetaballs::StopRecordingScenarios(const TArray<FString>& Args, UWorld* World)
 {
-	m_pnGridVoxelStatus[GetIndexNoAdd(x, y, z, m_nGridSize)] = 2;
+	for (TActorIterator<AMetaballs> It(World); It; ++It)
+		It->StopRecording();
 }
 
-inline FVector AMetaballs::ConvertGridPointToWorldCoordinate(const FVector& Vector) const
+void AMetaballs::SetScale(const float Value)
 {
-	return Vector * m_fVoxelSize - FVector::OneVector;
+	m_Scale = FMath::Max<float>(Value, MIN_SCALE);
 }
 
-void AMetaballs::InitBalls()
+void AMetaballs::SetGridSteps(const int32 Value)
 {
-	const FRandomStream InitStream(FDateTime::Now().GetTicks());
+	m_GridStep = FMath::Clamp<int32>(Value, MIN_GRID_STEPS, MAX_GRID_STEPS);
 
-	for (int i = 0; i < MAX_METABALLS; i++)
-	{
-		m_Balls[i].p.X = m_randomseed ? m_AutoLimitY * (InitStream.FRand() * 2 - 1) : 0.0f;
-		m_Balls[i].p.Y = m_randomseed ? m_AutoLimitX * (InitStream.FRand() * 2 - 1) : 0.0f;
-		m_Balls[i].p.Z = m_randomseed ? m_AutoLimitZ * (InitStream.FRand() * 2 - 1) : 0.0f;
-		m_Balls[i].v.X = m_randomseed ? (InitStream.FRand() * 2 - 1) / 2 : 0.0f;
-		m_Balls[i].v.Y = m_randomseed ? (InitStream.FRand() * 2 - 1) / 2 : 0.0f;
-		m_Balls[i].v.Z = m_randomseed ? (InitStream.FRand() * 2 - 1) / 2 : 0.0f;
-		m_Balls[i].a.X = m_AutoLimitY * (InitStream.FRand() * 2 - 1);
-		m_Balls[i].a.Y = m_AutoLimitX * (InitStream.FRand() * 2 - 1);
-		m_Balls[i].a.Z = m_AutoLimitZ * (InitStream.FRand() * 2 - 1);
-		m_Balls[i].t = InitStream.FRand();
-		m_Balls[i].m = 1;
-	}
+	// The LOD tiers decide while auto LOD is on
+	if (!m_AutoLOD)
+		RequestGridSize(m_GridStep);
 }
 
-
-void AMetaballs::SetBallTransform(const int32 Index, const FVector& Transform)
+void AMetaballs::RequestGridSize(const int nSize)
 {
-	if (Index > m_NumBalls - 1)
+	// The grids belong to the running build, the next one picks the new size up
+	if (IsBuildInFlight() || m_Core.IsSlicedBuildActive())
 	{
+		m_nPendingGridSize = nSize;
 		return;
 	}
 
-	m_Balls[Index].p = FVector(Transform.Y, Transform.X, Transform.Z);
+	m_nPendingGridSize = 0;
+
+	if (nSize != m_Core.GetGridSize())
+		SetGridSize(nSize);
 }
 
-void AMetaballs::SetNumBalls(const int Value)
+void AMetaballs::SetAutoLOD(const bool bAuto)
 {
-	m_NumBalls = FMath::Clamp<int32>(Value, 0, MAX_METABALLS);
+	m_AutoLOD = bAuto;
+
+	SortLODTiers();
+
+	if (!m_AutoLOD)
+		RequestGridSize(m_GridStep);
 }
 
-void AMetaballs::SetScale(const float Value)
+float AMetaballs::GetScreenSize() const
 {
-	m_Scale = FMath::Max<float>(Value, MIN_SCALE);
+	const UWorld* World = GetWorld();
+	const APlayerController* Controller = World ? World->GetFirstPlayerController() : nullptr;
+
+	if (!Controller || !Controller->PlayerCameraManager)
+		return -1.0f;
+
+	const FBoxSphereBounds& Bounds = MetaBallsBoundBox->Bounds;
+	const float Distance = FVector::Dist(Bounds.Origin, Controller->PlayerCameraManager->GetCameraLocation());
+	const float HalfWidth = Distance * FMath::Tan(FMath::DegreesToRadians(Controller->PlayerCameraManager->GetFOVAngle() * 0.5f));
+
+	return HalfWidth > KINDA_SMALL_NUMBER ? static_cast<float>(Bounds.SphereRadius) / HalfWidth : 1.0f;
 }
 
-void AMetaballs::SetGridSteps(const int32 Value)
+void AMetaballs::UpdateLOD(const float ScreenSize)
 {
-	m_GridStep = FMath::Clamp<int32>(Value, MIN_GRID_STEPS, MAX_GRID_STEPS);
-	SetGridSize(m_GridStep);
+	// Blueprints can write the tiers directly, in any order
+	SortLODTiers();
+
+	const int Tier = SelectLODTier(m_LODTiers.GetData(), m_LODTiers.Num(), ScreenSize, m_nLODTier, m_LODHysteresis);
+
+	if (Tier == NO_INDEX)
+		return;
+
+	m_nLODTier = Tier;
+
+	const int nSize = FMath::Clamp<int>(m_LODTiers[Tier].GridSteps, MIN_GRID_STEPS, MAX_GRID_STEPS);
+
+	if (nSize != (m_nPendingGridSize ? m_nPendingGridSize : m_Core.GetGridSize()))
+		RequestGridSize(nSize);
+}
+
+void AMetaballs::SortLODTiers()
+{
+	bool bSorted = true;
+
+	for (int32 i = 1; i < m_LODTiers.Num(); i++)
+		bSorted &= m_LODTiers[i - 1].ScreenSize >= m_LODTiers[i].ScreenSize;
+
+	if (bSorted)
+		return;
+
+	m_LODTiers.StableSort([](const FMetaBallLODTier& A, const FMetaBallLODTier& B) { return A.ScreenSize > B.ScreenSize; });
+
+	// The index of the current tier no longer matches, the next update picks it again
+	m_nLODTier = 0;
 }
 
 void AMetaballs::SetRandomSeed(const bool bSeed)
@@ -793,4 +1209,80 @@ void AMetaballs::SetAutoLimitY(const float Limit)
 void AMetaballs::SetAutoLimitZ(const float Limit)
 {
 	m_AutoLimitZ = FMath::Clamp<float>(Limit, MIN_LIMIT, MAX_LIMIT);
-}
\ No newline at end of file
+}
+
+void AMetaballs::SetFiniteSupport(const bool bFinite)
+{
+	m_FiniteSupport = bFinite;
+}
+
+void AMetaballs::SetInfluenceRadius(const float Radius)
+{
+	// Below a few voxels the balls no longer blend, above the whole area the bins are useless
+	m_InfluenceRadius = FMath::Clamp<float>(Radius, 0.05f, 2.0f);
+}
+
+void AMetaballs::SetSplatEnergy(const bool bSplat)
+{
+	m_SplatEnergy = bSplat;
+}
+
+void AMetaballs::SetNormalMode(const EMetaBallNormalMode Mode)
+{
+	m_NormalMode = Mode;
+}
+
+void AMetaballs::SetPolygonizer(const EMetaBallPolygonizer Value)
+{
+	m_Polygonizer = Value;
+}
+
+void AMetaballs::SetOctreeTolerance(const float Tolerance)
+{
+	m_OctreeTolerance = FMath::Clamp<float>(Tolerance, 0.01f, 2.0f);
+}
+
+void AMetaballs::SetPolygonizerThreads(const int32 Value)
+{
+	m_PolygonizerThreads = FMath::Clamp<int32>(Value, 1, CMetaballPolygonizer::MAX_POLYGONIZER_THREADS);
+}
+
+void AMetaballs::SetAsyncBuild(const bool bAsync)
+{
+	m_AsyncBuild = bAsync;
+}
+
+void AMetaballs::SetIncrementalBuild(const bool bIncremental)
+{
+	m_IncrementalBuild = bIncremental;
+}
+
+void AMetaballs::SetDecimate(const bool bDecimate)
+{
+	m_Decimate = bDecimate;
+}
+
+void AMetaballs::SetDecimationTolerance(const float Tolerance)
+{
+	m_DecimationTolerance = FMath::Clamp<float>(Tolerance, CMetaballPolygonizer::MIN_DECIMATION_TOLERANCE, CMetaballPolygonizer::MAX_DECIMATION_TOLERANCE);
+}
+
+void AMetaballs::SetDecimationBudget(const int32 Triangles)
+{
+	m_DecimationBudget = FMath::Max<int32>(Triangles, 0);
+}
+
+void AMetaballs::SetTimeSlicedBuild(const bool bSliced)
+{
+	m_TimeSlicedBuild = bSliced;
+}
+
+void AMetaballs::SetTimeSliceMicroseconds(const float Microseconds)
+{
+	m_TimeSliceMicroseconds = FMath::Max<float>(Microseconds, MIN_TIME_SLICE_MICROSECONDS);
+}
+
+void AMetaballs::SetTimeSliceVoxels(const int32 Voxels)
+{
+	m_TimeSliceVoxels = FMath::Max<int32>(Voxels, 0);
+}
@@ -0,0 +1,161 @@
+#include "MetaballsReplayCommandlet.h"
+#include "Metaballs.h"
+#include "CMetaballPolygonizer.h"
+#include "CMetaballScenario.h"
+#include "Async/ParallelFor.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+
+// What one replayed build took and produced
+struct SReplayFrame
+{
+	int32 GridSize;
+	int32 NumBalls;
+	double BuildSeconds;
+	double FieldSeconds;
+	double PolygonizeSeconds;
+	double DecimateSeconds;
+	int32 NumVertices;
+	int32 NumTriangles;
+	int64 NumVoxels;
+	int64 NumEnergySamples;
+};
+
+UMetaballsReplayCommandlet::UMetaballsReplayCommandlet()
+{
+	IsClient = false;
+	IsServer = false;
+	IsEditor = false;
+	LogToConsole = true;
+
+	HelpDescription = TEXT("Replays a recorded metaballs scenario through the polygonizer and logs the time and output of every build.");
+	HelpUsage = TEXT("-run=MetaballsReplay -Scenario=<file> [-Csv=<file>] [-Repeat=N] [-Threads=N] [-Polygonizer=mc|octree|sn]");
+}
+
+//=============================================================================
+int32 UMetaballsReplayCommandlet::Main(const FString& Params)
+{
+	FString ScenarioPath;
+
+	if (!FParse::Value(*Params, TEXT("Scenario="), ScenarioPath))
+	{
+		UE_LOG(MetaballLog, Error, TEXT("MetaballsReplay: no -Scenario=<file> given. Usage: %s"), *HelpUsage);
+		return 1;
+	}
+
+	TArray<uint8> Data;
+	CMetaballScenario Scenario;
+
+	if (!FFileHelper::LoadFileToArray(Data, *ScenarioPath) || !Scenario.Load(Data.GetData(), Data.Num()))
+	{
+		UE_LOG(MetaballLog, Error, TEXT("MetaballsReplay: %s is no metaballs scenario"), *ScenarioPath);
+		return 1;
+	}
+
+	SMetaBallBuildSettings Settings = Scenario.GetSettings();
+
+	int32 NumRepeats = 1;
+	FParse::Value(*Params, TEXT("Repeat="), NumRepeats);
+	NumRepeats = FMath::Max(NumRepeats, 1);
+
+	FParse::Value(*Params, TEXT("Threads="), Settings.PolygonizerThreads);
+
+	FString Polygonizer;
+
+	if (FParse::Value(*Params, TEXT("Polygonizer="), Polygonizer))
+	{
+		Settings.Polygonizer =
+			Polygonizer == TEXT("octree") ? EPolygonizerMode::AdaptiveOctree :
+			Polygonizer == TEXT("sn") ? EPolygonizerMode::SurfaceNets : EPolygonizerMode::MarchingCubes;
+	}
+
+	const int32 NumFrames = Scenario.GetNumFrames();
+
+	TArray<SReplayFrame> Frames;
+	Frames.SetNumZeroed(NumFrames);
+
+	CMetaballPolygonizer Core;
+	SMetaBallSoA Balls;
+
+	Core.SetParallelFor([](const int32 Num, const std::function<void(int32)>& Body)
+	{
+		ParallelFor(Num, [&Body](int32 Index)
+		{
+			Body(Index);
+		});
+	});
+
+	for (int32 Repeat = 0; Repeat < NumRepeats; Repeat++)
+	{
+		for (int32 i = 0; i < NumFrames; i++)
+		{
+			Scenario.GetFrameBalls(i, Balls);
+			Settings.Scale = Scenario.GetFrameScale(i);
+
+			if (Scenario.GetFrameGridSize(i) != Core.GetGridSize())
+				Core.SetGridSize(Scenario.GetFrameGridSize(i));
+
+			const double StartTime = FPlatformTime::Seconds();
+
+			Core.Build(Balls, Settings);
+
+			const double BuildSeconds = FPlatformTime::Seconds() - StartTime;
+
+			SReplayFrame& Frame = Frames[i];
+
+			if (Repeat > 0 && BuildSeconds >= Frame.BuildSeconds)
+				continue;
+
+			const SPolygonizerOutput& Output = Core.GetOutput();
+
+			Frame.GridSize = Core.GetGridSize();
+			Frame.NumBalls = Balls.Num();
+			Frame.BuildSeconds = BuildSeconds;
+			Frame.FieldSeconds = Core.GetFieldSeconds();
+			Frame.PolygonizeSeconds = Core.GetPolygonizeSeconds();
+			Frame.DecimateSeconds = Settings.bDecimate ? Core.GetDecimateSeconds() : 0.0;
+			Frame.NumVertices = static_cast<int32>(Output.Vertices.size());
+			Frame.NumTriangles = static_cast<int32>(Output.Triangles.size() / 3);
+			Frame.NumVoxels = Output.NumVoxels;
+			Frame.NumEnergySamples = Output.NumEnergySamples;
+		}
+	}
+
+	FString Csv = TEXT("frame,grid,balls,build_ms,field_ms,polygonize_ms,decimate_ms,vertices,triangles,voxels,energy_samples\n");
+	TArray<double> BuildMs;
+	double TotalMs = 0;
+
+	for (int32 i = 0; i < NumFrames; i++)
+	{
+		const SReplayFrame& Frame = Frames[i];
+
+		UE_LOG(MetaballLog, Display, TEXT("frame %d: grid %d, %d balls, build %.3f ms (field %.3f, polygonize %.3f, decimate %.3f), %d vertices, %d triangles, %lld voxels"),
+			i, Frame.GridSize, Frame.NumBalls, Frame.BuildSeconds * 1000.0, Frame.FieldSeconds * 1000.0, Frame.PolygonizeSeconds * 1000.0, Frame.DecimateSeconds * 1000.0,
+			Frame.NumVertices, Frame.NumTriangles, Frame.NumVoxels);
+
+		Csv += FString::Printf(TEXT("%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%d,%d,%lld,%lld\n"),
+			i, Frame.GridSize, Frame.NumBalls, Frame.BuildSeconds * 1000.0, Frame.FieldSeconds * 1000.0, Frame.PolygonizeSeconds * 1000.0, Frame.DecimateSeconds * 1000.0,
+			Frame.NumVertices, Frame.NumTriangles, Frame.NumVoxels, Frame.NumEnergySamples);
+
+		BuildMs.Add(Frame.BuildSeconds * 1000.0);
+		TotalMs += Frame.BuildSeconds * 1000.0;
+	}
+
+	if (NumFrames > 0)
+	{
+		BuildMs.Sort();
+
+		UE_LOG(MetaballLog, Display, TEXT("MetaballsReplay %s: %d frames, best of %d, build mean %.3f ms, median %.3f ms, 95th percentile %.3f ms, max %.3f ms"),
+			*ScenarioPath, NumFrames, NumRepeats, TotalMs / NumFrames, BuildMs[NumFrames / 2], BuildMs[FMath::Min(NumFrames * 95 / 100, NumFrames - 1)], BuildMs.Last());
+	}
+
+	FString CsvPath;
+
+	if (FParse::Value(*Params, TEXT("Csv="), CsvPath) && !FFileHelper::SaveStringToFile(Csv, *CsvPath))
+	{
+		UE_LOG(MetaballLog, Error, TEXT("MetaballsReplay: cannot write %s"), *CsvPath);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include "MetaballsSubsystem.h"
+#include "Metaballs.h"
+#include "HAL/IConsoleManager.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+
+DECLARE_CYCLE_STAT(TEXT("MetaBall - Scheduler"), STAT_MetaBallScheduler, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Scheduled actors"), STAT_MetaBallScheduledActors, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Deferred actors"), STAT_MetaBallDeferredActors, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Budget overruns"), STAT_MetaBallBudgetOverruns, STATGROUP_MetaBall);
+DECLARE_DWORD_COUNTER_STAT(TEXT("MetaBall - Stalest mesh (frames)"), STAT_MetaBallStaleFrames, STATGROUP_MetaBall);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("MetaBall - Scheduled rebuilds (ms)"), STAT_MetaBallScheduledMs, STATGROUP_MetaBall);
+
+static TAutoConsoleVariable<float> CVarMetaballsFrameBudgetMs(
+	TEXT("Metaballs.FrameBudgetMs"),
+	0.0f,
+	TEXT("Game thread milliseconds per frame the metaballs actors of a world may spend on rebuilding their meshes (0 - no budget)."),
+	ECVF_Default);
+
+// Actors that were not rendered lately still rebuild, but only when the visible ones leave room
+static const float HiddenPriorityScale = 0.1f;
+
+UMetaballsSubsystem::UMetaballsSubsystem()
+	: m_nNumBudgetOverruns(0)
+	, m_nNumDeferred(0)
+	, m_nMaxStaleFrames(0)
+	, m_fLastFrameMs(0)
+{
+}
+
+//=============================================================================
+void UMetaballsSubsystem::Deinitialize()
+{
+	for (AMetaballs* Actor : m_Actors)
+		Actor->m_pSubsystem = nullptr;
+
+	m_Actors.Empty();
+	m_Queue.Empty();
+
+	Super::Deinitialize();
+}
+
+//=============================================================================
+TStatId UMetaballsSubsystem::GetStatId() const
+{
+	RETURN_QUICK_DECLARE_CYCLE_STAT(UMetaballsSubsystem, STATGROUP_Tickables);
+}
+
+//=============================================================================
+void UMetaballsSubsystem::RegisterActor(AMetaballs* Actor)
+{
+	m_Actors.AddUnique(Actor);
+}
+
+//=============================================================================
+void UMetaballsSubsystem::UnregisterActor(AMetaballs* Actor)
+{
+	m_Actors.Remove(Actor);
+}
+
+//=============================================================================
+float UMetaballsSubsystem::GetPriority(const AMetaballs* Actor) const
+{
+	// Without a camera every actor counts as filling the screen
+	const float ScreenSize = Actor->GetScreenSize();
+
+	float Priority = ScreenSize >= 0 ? ScreenSize : 1.0f;
+
+	if (!Actor->WasRecentlyRendered())
+		Priority *= HiddenPriorityScale;
+
+	// Every frame the mesh waits raises it, so a small or hidden actor is not deferred forever
+	return Priority * (1 + static_cast<float>(GFrameCounter - Actor->m_nLastUploadFrame));
+}
+
+//=============================================================================
+void UMetaballsSubsystem::Tick(const float DeltaTime)
+{
+	SCOPE_CYCLE_COUNTER(STAT_MetaBallScheduler);
+	TRACE_CPUPROFILER_EVENT_SCOPE(UMetaballsSubsystem::Tick);
+
+	Super::Tick(DeltaTime);
+
+	const float BudgetMs = CVarMetaballsFrameBudgetMs.GetValueOnGameThread();
+
+	m_Queue.Reset();
+
+	for (AMetaballs* Actor : m_Actors)
+	{
+		if (Actor->m_NumBalls > 0)
+			m_Queue.Add({ Actor, GetPriority(Actor) });
+	}
+
+	m_Queue.Sort([](const SScheduledActor& A, const SScheduledActor& B) { return A.Priority > B.Priority; });
+
+	double SpentMs = 0;
+	int32 NumRebuilt = 0;
+
+	m_nNumDeferred = 0;
+
+	for (const SScheduledActor& Entry : m_Queue)
+	{
+		AMetaballs* Actor = Entry.Actor;
+
+		// An actor is skipped when its last rebuild cost does not fit what is left. The first one always
+		// rebuilds, so a budget smaller than any actor still lets the meshes take turns.
+		if (BudgetMs > 0 && NumRebuilt > 0 && SpentMs + Actor->m_fRebuildMs > BudgetMs)
+		{
+			m_nNumDeferred++;
+			continue;
+		}
+
+		const double Start = FPlatformTime::Seconds();
+
+		Actor->Rebuild();
+
+		Actor->m_fRebuildMs = static_cast<float>((FPlatformTime::Seconds() - Start) * 1000.0);
+
+		SpentMs += Actor->m_fRebuildMs;
+		NumRebuilt++;
+	}
+
+	if (BudgetMs > 0 && SpentMs > BudgetMs)
+		m_nNumBudgetOverruns++;
+
+	m_nMaxStaleFrames = 0;
+
+	for (const SScheduledActor& Entry : m_Queue)
+		m_nMaxStaleFrames = FMath::Max<int32>(m_nMaxStaleFrames, static_cast<int32>(GFrameCounter - Entry.Actor->m_nLastUploadFrame));
+
+	m_fLastFrameMs = static_cast<float>(SpentMs);
+
+	SET_DWORD_STAT(STAT_MetaBallScheduledActors, m_Queue.Num());
+	SET_DWORD_STAT(STAT_MetaBallDeferredActors, m_nNumDeferred);
+	SET_DWORD_STAT(STAT_MetaBallBudgetOverruns, m_nNumBudgetOverruns);
+	SET_DWORD_STAT(STAT_MetaBallStaleFrames, m_nMaxStaleFrames);
+	SET_FLOAT_STAT(STAT_MetaBallScheduledMs, m_fLastFrameMs);
+}
@@ -20,6 +20,9 @@
 #include "ProceduralMeshComponent.h"
 #include "Components/BoxComponent.h"
 #include "Materials/MaterialInterface.h"
+#include "Tasks/Task.h"
+#include "CMetaballPolygonizer.h"
+#include "CMetaballScenario.h"
 #include "Metaballs.generated.h"
 
 
@@ -28,6 +31,32 @@
 DECLARE_STATS_GROUP(TEXT("MetaBall"), STATGROUP_MetaBall, STATCAT_Advanced);
 DECLARE_LOG_CATEGORY_EXTERN(MetaballLog, Log, All);
 
+class UMetaballsSubsystem;
+
+// How the vertex normals are computed
+UENUM(BlueprintType)
+enum class EMetaBallNormalMode : uint8
+{
+	// Gradient of the ball sum at the vertex. Exact, but every vertex sums the balls again.
+	Analytic UMETA(DisplayName = "Analytic"),
+	// Central differences of the grid energies at the edge ends, blended like the vertex. With splatted energies the cost
+	// does not depend on the ball count. Otherwise the grid points next to the surface that the fill did not sample sum
+	// the balls like any other, still fewer sums than Analytic takes.
+	GridGradient UMETA(DisplayName = "Grid gradient")
+};
+
+// How the surface is extracted from the field
+UENUM(BlueprintType)
+enum class EMetaBallPolygonizer : uint8
+{
+	// Flood fill of the uniform grid from the balls
+	MarchingCubes UMETA(DisplayName = "Marching cubes"),
+	// Dual contouring of an octree that only goes down to the grid steps where the field is not smooth
+	AdaptiveOctree UMETA(DisplayName = "Adaptive octree"),
+	// Same flood fill as marching cubes, but one vertex per voxel the surface goes through and quads between them
+	SurfaceNets UMETA(DisplayName = "Surface nets")
+};
+
 struct SMetaBall
 {
 
@@ -39,23 +68,42 @@ struct SMetaBall
 	float m;
 };
 
+// Grid resolution the auto LOD uses down to a screen size
+USTRUCT(BlueprintType)
+struct FMetaBallLODTier
+{
+	GENERATED_BODY()
+
+	/*Smallest share of the screen width the metaballs have to cover for this tier*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = LOD, meta = (DisplayName = "Screen size"))
+	float ScreenSize;
+
+	/*Grid steps used by this tier*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = LOD, meta = (DisplayName = "Grid steps"))
+	int32 GridSteps;
+
+	FMetaBallLODTier() : ScreenSize(0.0f), GridSteps(32) {}
+	FMetaBallLODTier(const float InScreenSize, const int32 InGridSteps) : ScreenSize(InScreenSize), GridSteps(InGridSteps) {}
+};
+
 
 UCLASS()
 class METABALLSPLUGIN_API AMetaballs : public AActor
 {
 	GENERATED_UCLASS_BODY()
+
+	friend class UMetaballsSubsystem;
 	
 public:	
 
 	enum MinMax
 	{
-		MAX_METABALLS = 32,
 		MIN_GRID_STEPS = 16,
-		MAX_GRID_STEPS = 128,
+		MAX_GRID_STEPS = 1024,
 		MIN_SCALE = 1,
-		MAX_OPEN_VOXELS = 32,
 		MIN_LIMIT = 0,
 		MAX_LIMIT = 1,
+		MIN_TIME_SLICE_MICROSECONDS = 50,
 	};
 
 
@@ -67,6 +115,10 @@ public:
 
 
 	virtual void BeginPlay() override;
+
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	virtual void BeginDestroy() override;
 	
 	// Called every frame
 	virtual void Tick( float DeltaSeconds ) override;
@@ -81,6 +133,36 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Metaballs")
 	void SetNumBalls(int32 Value);
 
+	// Adds a ball at Transform and returns its index
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	int32 AddBall(const FVector& Transform, float Mass = 1.0f);
+
+	// Removes a ball. The last ball takes its index.
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void RemoveBall(int32 Index);
+
+	// Times synchronous builds of every metaballs actor in the world over a sweep of ball counts
+	static void BenchBallCounts(const TArray<FString>& Args, UWorld* World);
+
+	// Times the build, the decimation and the mesh upload of every metaballs actor with and without decimation
+	static void BenchDecimation(const TArray<FString>& Args, UWorld* World);
+
+	// Records the balls, grid size and scale of every build from now on. StopRecording writes them to Path
+	// as a scenario that the MetaballsReplay commandlet replays.
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void StartRecording(const FString& Path);
+
+	// Ends the recording and saves it, false if there was none or the file could not be written
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	bool StopRecording();
+
+	UFUNCTION(BlueprintPure, Category = "Metaballs")
+	bool IsRecording() const { return m_bRecording; }
+
+	// Starts and stops recording every metaballs actor of the world, to one file per actor
+	static void RecordScenarios(const TArray<FString>& Args, UWorld* World);
+	static void StopRecordingScenarios(const TArray<FString>& Args, UWorld* World);
+
 	UFUNCTION(BlueprintCallable, Category = "Metaballs")
 	void SetScale(float Value);
 
@@ -102,6 +184,63 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Metaballs")
 	void SetAutoLimitZ(float Limit);
 
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetFiniteSupport(bool bFinite);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetInfluenceRadius(float Radius);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetSplatEnergy(bool bSplat);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetNormalMode(EMetaBallNormalMode Mode);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetPolygonizer(EMetaBallPolygonizer Value);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetOctreeTolerance(float Tolerance);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetPolygonizerThreads(int32 Value);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetAsyncBuild(bool bAsync);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetIncrementalBuild(bool bIncremental);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetTimeSlicedBuild(bool bSliced);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetTimeSliceMicroseconds(float Microseconds);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetTimeSliceVoxels(int32 Voxels);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetDecimate(bool bDecimate);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetDecimationTolerance(float Tolerance);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetDecimationBudget(int32 Triangles);
+
+	UFUNCTION(BlueprintCallable, Category = "Metaballs")
+	void SetAutoLOD(bool bAuto);
+
+	// Share of the screen width the bounds cover from the first player's camera, negative without one
+	float GetScreenSize() const;
+
+	// Picks the LOD tier for a screen size and switches the grid to its resolution
+	void  UpdateLOD(float ScreenSize);
+
+	// Orders the LOD tiers from the largest screen size to the smallest, the order UpdateLOD expects
+	void  SortLODTiers();
+
 	/*Number of metaballs (0 - disable)*/
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Number of balls"))
 	int32 m_NumBalls;
@@ -118,6 +257,10 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Random seed"))
 	bool m_randomseed;
 
+	/*Seed of the ball positions and paths, the same seed gives the same scene on every run. 0 seeds from the clock*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Ball seed"))
+	int32 m_BallSeed;
+
 	/*If true, metaballs will do automatic movement. Otherwise you should set position manually*/
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Auto fly mode"))
 	bool m_automode;
@@ -134,6 +277,78 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Auto limit Z"))
 	float m_AutoLimitZ;
 
+	/*If true, every ball has zero energy beyond its influence radius, so each grid point only sums nearby balls*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Finite support"))
+	bool m_FiniteSupport;
+
+	/*Distance at which the energy of a ball falls to zero. Only for Finite support!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Influence radius"))
+	float m_InfluenceRadius;
+
+	/*If true, every ball adds its energy into the grid before polygonization, instead of every grid point summing the balls. Only for Finite support!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Splat energy"))
+	bool m_SplatEnergy;
+
+	/*Analytic normals sum the balls for every vertex. Grid gradient normals reuse the grid energies, they are cheaper with many balls but follow the voxel steps*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Normal mode"))
+	EMetaBallNormalMode m_NormalMode;
+
+	/*Marching cubes polygonizes every voxel the surface goes through. The adaptive octree uses larger cells where the surface is flat, it samples fewer grid points and outputs fewer triangles. Surface nets sample the same grid points as marching cubes but put one vertex in each voxel, their triangles have no slivers and threaded builds do not split vertices between slabs*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Polygonizer"))
+	EMetaBallPolygonizer m_Polygonizer;
+
+	/*How far, in grid steps, the surface may bend away from a flat octree cell. Smaller values give more cells. Only for Adaptive octree!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Octree tolerance"))
+	float m_OctreeTolerance;
+
+	/*Number of worker threads that build the surface (1 - build it on the game thread)*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Polygonizer threads"))
+	int32 m_PolygonizerThreads;
+
+	/*If true, the surface is built on a background task and shown one frame late, so the game thread only copies the balls and uploads the mesh*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Async build"))
+	bool m_AsyncBuild;
+
+	/*If true, only the bricks near balls that moved since the last build are polygonized again, the rest of the mesh is kept. Only for Finite support!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Incremental build"))
+	bool m_IncrementalBuild;
+
+	/*If true, one build is spread over several ticks and the mesh is swapped once it is done. The balls are taken when a build starts. Not for Async build or Adaptive octree, Incremental build and Polygonizer threads are ignored while it is on*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Time sliced build"))
+	bool m_TimeSlicedBuild;
+
+	/*Game thread time a tick may spend on a sliced build. Only for Time sliced build!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Time slice (microseconds)"))
+	float m_TimeSliceMicroseconds;
+
+	/*Most voxels a tick may polygonize (0 - only the time counts). Only for Time sliced build!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Time slice voxels"))
+	int32 m_TimeSliceVoxels;
+
+	/*If true, vertices close to each other are merged before the mesh is uploaded, so smooth parts get fewer and larger triangles*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Decimation, meta = (DisplayName = "Decimate"))
+	bool m_Decimate;
+
+	/*Size, in grid steps, of the cubes whose vertices are merged. A vertex moves at most about this far. Only for Decimate!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Decimation, meta = (DisplayName = "Decimation tolerance"))
+	float m_DecimationTolerance;
+
+	/*Most triangles the mesh may have, the cubes grow until it fits (0 - only the tolerance counts). Only for Decimate!*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Decimation, meta = (DisplayName = "Decimation triangle budget"))
+	int32 m_DecimationBudget;
+
+	/*If true, the grid steps follow the LOD tiers instead of Grid steps*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = LOD, meta = (DisplayName = "Auto LOD"))
+	bool m_AutoLOD;
+
+	/*Tiers from the largest screen size to the smallest. The first tier the screen size reaches is used, the last one below all of them*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = LOD, meta = (DisplayName = "LOD tiers"))
+	TArray<FMetaBallLODTier> m_LODTiers;
+
+	/*Share by which the screen size has to pass a tier boundary before the tier changes, so a camera near a boundary does not switch every frame*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = LOD, meta = (DisplayName = "LOD hysteresis"))
+	float m_LODHysteresis;
+
 	/*Metaballs material*/
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = Settings, meta = (DisplayName = "Material"))
 	UMaterialInterface* m_Material;
@@ -146,60 +361,91 @@ public:
 	void  Update(float fDeltaTime);
 	void  Render();
 
+	// Renders now, or uploads the last finished async build and starts the next one
+	void  Rebuild();
+
+	void  BeginBuild();
+	void  BuildMesh();
+	void  ConvertMesh();
+	void  UploadMesh();
+	void  ReportPhaseTimes() const;
+
+	void  LaunchAsyncBuild();
+	bool  IsBuildInFlight() const;
+	void  WaitForBuild();
+
 	void  SetGridSize(int nSize);
 
 protected:
 
+	// Switches the grid size now, or once the build in flight is done
+	void  RequestGridSize(int nSize);
+
 	void InitBalls();
+	void InitBall(SMetaBall& Ball) const;
+	void MoveBalls(float fDeltaTime);
+	void BuildBallSoA();
 	float CheckLimit(float Value) const;
 
-	float ComputeEnergy(float x, float y, float z) const;
-	void  ComputeNormal(const FVector& Vertex);
+	// Polygonizes the next slice of a time sliced build, true once the build is done
+	bool  ContinueSlicedBuild();
 
-	float ComputeGridPointEnergy(int x, int y, int z) const;
-	int   ComputeGridVoxel(int x, int y, int z);
+	// Polygonizer of the surface, and its last mesh in the layout CreateMeshSection takes
+	CMetaballPolygonizer m_Core;
 
-	bool  IsGridPointComputed(int x, int y, int z) const;
-	bool  IsGridVoxelComputed(int x, int y, int z) const;
-	bool  IsGridVoxelInList(int x, int y, int z) const;
-	void  SetGridPointComputed(int x, int y, int z) const;
-	void  SetGridVoxelComputed(int x, int y, int z) const;
-	void  SetGridVoxelInList(int x, int y, int z) const;
+	TArray<FVector> m_MeshVertices;
+	TArray<int32> m_MeshTriangles;
+	TArray<FVector> m_MeshNormals;
+	TArray<FVector2D> m_MeshUV0;
 
-	float ConvertGridPointToWorldCoordinate(int x) const;
-	FVector ConvertGridPointToWorldCoordinate(const FVector& Vector) const;
-	int   ConvertWorldCoordinateToGridPoint(float x) const;
-	void  AddNeighborsToList(int nCase, int x, int y, int z);
-	void  AddNeighbor(int x, int y, int z);
+	TArray<SMetaBall> m_Balls;
 
-	float  m_fLevel;
+	// Starting state of the balls that SetNumBalls adds, and the targets MoveBalls picks for them
+	FRandomStream m_BallStream;
 
+	// Ticks the time sliced build in progress has taken and the game thread time they spent
+	int32	m_nNumSliceTicks;
+	double	m_fSlicedBuildSeconds;
 
-	SMetaBall  m_Balls[MAX_METABALLS];
-	//TArray<SMetaBall> m_Balls;
+	int		m_nNumVertices;
+	int		m_nNumIndices;
 
-	int		m_nNumOpenVoxels;
-	int		m_nMaxOpenVoxels;
-	int		*m_pOpenVoxels;
+	// Float mirror of m_Balls, rebuilt once per Update. It is double buffered: Update writes
+	// m_BallSoA[m_nBallSoAWrite] while a build reads the other one through m_pBuildBalls.
+	SMetaBallSoA m_BallSoA[2];
+	int		m_nBallSoAWrite;
+	const SMetaBallSoA* m_pBuildBalls;
 
-	int		m_nGridSize;
-	float	m_fVoxelSize;
+	SMetaBallBuildSettings m_BuildSettings;
 
-	float	*m_pfGridEnergy;
-	char	*m_pnGridPointStatus;
-	char	*m_pnGridVoxelStatus;
+	// Background build of the async mode, and a grid size to switch to once it is done
+	UE::Tasks::FTask m_BuildTask;
+	int		m_nPendingGridSize;
 
-	int		m_nNumVertices;
-	int		m_nNumIndices;
+	// Tier the auto LOD is at, and how long the last build took
+	int		m_nLODTier;
+	double	m_fBuildSeconds;
+
+	// Phase times of the last update, mesh conversion and upload. The polygonizer times the field
+	// and the fill, instrumented builds split the fill itself by the voxels they timed.
+	double	m_fUpdateSeconds;
+	double	m_fConvertSeconds;
+	double	m_fUploadSeconds;
+
+	// Builds recorded since StartRecording, saved to m_RecordingPath
+	CMetaballScenario m_Recording;
+	FString	m_RecordingPath;
+	bool	m_bRecording;
+
+	// World subsystem that rebuilds this actor under the frame budget, null when the actor rebuilds itself.
+	// The frame the mesh was last uploaded and what the last rebuild cost the game thread.
+	UMetaballsSubsystem* m_pSubsystem;
+	uint64	m_nLastUploadFrame;
+	float	m_fRebuildMs;
 
 	UPROPERTY(VisibleDefaultsOnly)
 	UProceduralMeshComponent* m_mesh;
 
-	TArray<FVector> m_vertices;
-	TArray<int32> m_Triangles;
-	TArray<FVector> m_normals;
-
-	TArray<FVector2D> m_UV0;
 	TArray<FColor> m_vertexColors;
 
 	TArray<FProcMeshTangent> m_tangents;
@@ -0,0 +1,15 @@
+using UnrealBuildTool;
+
+public class MetaballsCore : ModuleRules
+{
+
+    public MetaballsCore(ReadOnlyTargetRules Target) : base(Target)
+    {
+        // Standard C++ on purpose, so the standalone tests and benchmarks build the same sources
+        PCHUsage = PCHUsageMode.NoPCHs;
+
+        PrivateDependencyModuleNames.AddRange(new string[] { "Core" });
+
+        PrivateDefinitions.Add("METABALLS_CORE_ENGINE_TRACE=1");
+    }
+}
\ No newline at end of file
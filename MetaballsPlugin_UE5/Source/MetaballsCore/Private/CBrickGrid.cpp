@@ -0,0 +1,211 @@
+#include "CBrickGrid.h"
+#include <cstring>
+
+CBrickGrid::CBrickGrid()
+	: m_nBricksPerAxis(0)
+	, m_nPagesPerAxis(0)
+	, m_pPages(nullptr)
+	, m_nMaxPageSlots(0)
+	, m_nNumPages(0)
+	, m_nEpoch(0)
+	, m_bZeroEnergy(false)
+{
+}
+
+CBrickGrid::~CBrickGrid()
+{
+	Empty();
+}
+
+//=============================================================================
+void CBrickGrid::Empty()
+{
+	if (m_pPages)
+	{
+		for (int i = 0; i < m_nMaxPageSlots; i++)
+			delete m_pPages[i].load(std::memory_order_relaxed);
+
+		delete[] m_pPages;
+		m_pPages = nullptr;
+		m_nMaxPageSlots = 0;
+	}
+
+	for (SGridBrick* Chunk : m_Chunks)
+		delete[] Chunk;
+
+	m_Chunks.clear();
+	m_MappedBricks.clear();
+	m_FreeBricks.clear();
+	m_nNumPages = 0;
+}
+
+//=============================================================================
+void CBrickGrid::SetSize(const int nGridSize)
+{
+	// Every brick goes back to the pool, the pages stay allocated but empty
+	for (SGridBrick* Brick : m_MappedBricks)
+		m_FreeBricks.push_back(Brick);
+
+	m_MappedBricks.clear();
+
+	for (int i = 0; i < m_nMaxPageSlots; i++)
+	{
+		if (SPage* pPage = m_pPages[i].load(std::memory_order_relaxed))
+		{
+			for (int j = 0; j < PAGE_BRICKS; j++)
+				pPage->Bricks[j].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	m_nBricksPerAxis = (nGridSize + BRICK_SIZE) >> BRICK_SHIFT;
+	m_nPagesPerAxis = (m_nBricksPerAxis + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	const int NumPageSlots = m_nPagesPerAxis * m_nPagesPerAxis * m_nPagesPerAxis;
+
+	if (NumPageSlots > m_nMaxPageSlots)
+	{
+		std::atomic<SPage*>* pPages = new std::atomic<SPage*>[NumPageSlots];
+
+		for (int i = 0; i < NumPageSlots; i++)
+			pPages[i].store(i < m_nMaxPageSlots ? m_pPages[i].load(std::memory_order_relaxed) : nullptr, std::memory_order_relaxed);
+
+		delete[] m_pPages;
+		m_pPages = pPages;
+		m_nMaxPageSlots = NumPageSlots;
+	}
+
+	// The epoch keeps counting, pooled bricks still carry stamps of earlier builds
+}
+
+//=============================================================================
+void CBrickGrid::BeginBuild(const bool bZeroEnergy)
+{
+	// Bricks the last build did not visit go back to the free list
+	for (int i = static_cast<int>(m_MappedBricks.size()) - 1; i >= 0; i--)
+	{
+		SGridBrick* Brick = m_MappedBricks[i];
+
+		if (Brick->Epoch.load(std::memory_order_relaxed) == m_nEpoch)
+			continue;
+
+		m_pPages[Brick->Page].load(std::memory_order_relaxed)->Bricks[Brick->Slot].store(nullptr, std::memory_order_relaxed);
+		m_MappedBricks[i] = m_MappedBricks.back();
+		m_MappedBricks.pop_back();
+		m_FreeBricks.push_back(Brick);
+	}
+
+	// When the epoch runs out of bits, a brick of an old build could look touched by a new one
+	if (m_nEpoch == MAX_EPOCH)
+	{
+		for (SGridBrick* Chunk : m_Chunks)
+		{
+			for (int i = 0; i < BRICKS_PER_CHUNK; i++)
+				Chunk[i].Epoch.store(0, std::memory_order_relaxed);
+		}
+
+		m_nEpoch = 0;
+	}
+
+	m_nEpoch++;
+	m_bZeroEnergy = bZeroEnergy;
+}
+
+//=============================================================================
+SGridBrick* CBrickGrid::GetBrick(const int x, const int y, const int z)
+{
+	const int bx = x >> BRICK_SHIFT;
+	const int by = y >> BRICK_SHIFT;
+	const int bz = z >> BRICK_SHIFT;
+
+	const int Page = (bx >> PAGE_SHIFT) + ((by >> PAGE_SHIFT) + (bz >> PAGE_SHIFT) * m_nPagesPerAxis) * m_nPagesPerAxis;
+	const int Slot = (bx & (PAGE_SIZE - 1)) | ((by & (PAGE_SIZE - 1)) << PAGE_SHIFT) | ((bz & (PAGE_SIZE - 1)) << (2 * PAGE_SHIFT));
+
+	if (const SPage* pPage = m_pPages[Page].load(std::memory_order_acquire))
+	{
+		SGridBrick* Brick = pPage->Bricks[Slot].load(std::memory_order_acquire);
+
+		if (Brick && Brick->Epoch.load(std::memory_order_acquire) == m_nEpoch)
+			return Brick;
+	}
+
+	return TouchBrick(Page, Slot);
+}
+
+//=============================================================================
+SGridBrick* CBrickGrid::TouchBrick(const int Page, const int Slot)
+{
+	std::lock_guard<std::mutex> Lock(m_Lock);
+
+	SPage* pPage = m_pPages[Page].load(std::memory_order_relaxed);
+
+	if (!pPage)
+	{
+		pPage = new SPage;
+
+		for (int i = 0; i < PAGE_BRICKS; i++)
+			pPage->Bricks[i].store(nullptr, std::memory_order_relaxed);
+
+		m_pPages[Page].store(pPage, std::memory_order_release);
+		m_nNumPages++;
+	}
+
+	SGridBrick* Brick = pPage->Bricks[Slot].load(std::memory_order_relaxed);
+
+	if (!Brick)
+	{
+		if (m_FreeBricks.empty())
+		{
+			SGridBrick* Chunk = new SGridBrick[BRICKS_PER_CHUNK];
+			m_Chunks.push_back(Chunk);
+
+			// Either list can end up holding every brick, so moving bricks between them never grows them
+			const size_t NumBricks = m_Chunks.size() * BRICKS_PER_CHUNK;
+			m_MappedBricks.reserve(NumBricks);
+			m_FreeBricks.reserve(NumBricks);
+
+			for (int i = BRICKS_PER_CHUNK - 1; i >= 0; i--)
+			{
+				Chunk[i].Epoch.store(0, std::memory_order_relaxed);
+				m_FreeBricks.push_back(&Chunk[i]);
+			}
+		}
+
+		Brick = m_FreeBricks.back();
+		m_FreeBricks.pop_back();
+		Brick->Page = Page;
+		Brick->Slot = Slot;
+		Brick->Epoch.store(0, std::memory_order_relaxed);
+
+		m_MappedBricks.push_back(Brick);
+		pPage->Bricks[Slot].store(Brick, std::memory_order_release);
+	}
+
+	// Another worker may have touched it while this one waited for the lock
+	if (Brick->Epoch.load(std::memory_order_relaxed) != m_nEpoch)
+	{
+		ResetBrick(Brick);
+		Brick->Epoch.store(m_nEpoch, std::memory_order_release);
+	}
+
+	return Brick;
+}
+
+//=============================================================================
+void CBrickGrid::ResetBrick(SGridBrick* Brick) const
+{
+	memset(Brick->PointStatus, 0, sizeof(Brick->PointStatus));
+	memset(Brick->VoxelStatus, 0, sizeof(Brick->VoxelStatus));
+	memset(Brick->EdgeVertices, 0xFF, sizeof(Brick->EdgeVertices));
+
+	if (m_bZeroEnergy)
+		memset(Brick->Energy, 0, sizeof(Brick->Energy));
+}
+
+//=============================================================================
+size_t CBrickGrid::GetAllocatedSize() const
+{
+	return m_Chunks.size() * BRICKS_PER_CHUNK * sizeof(SGridBrick) +
+		m_nNumPages * sizeof(SPage) +
+		m_nMaxPageSlots * sizeof(std::atomic<SPage*>) +
+		GetVectorAllocatedSize(m_MappedBricks) + GetVectorAllocatedSize(m_FreeBricks) + GetVectorAllocatedSize(m_Chunks);
+}
@@ -0,0 +1,255 @@
+#include "CMetaballField.h"
+#include "MetaBallKernels.h"
+
+static constexpr int GetIndexNoAdd(const int X, const int Y, const int Z, const int GridSize)
+{
+	/* Replaces all instances of:
+	x +
+	y*m_nGridSize +
+	z*m_nGridSize*m_nGridSize
+	*/
+
+	return X + Y * GridSize + Z * GridSize * GridSize;
+}
+
+// Sums the energy of the balls [Begin, End) at the point (x, y, z), eight balls per iteration where vector intrinsics are available
+static float SumMetaBallEnergy(const SMetaBallSoA& Balls, const int Begin, const int End, const float x, const float y, const float z, const float InvSqRadius)
+{
+	float fEnergy = 0;
+	int i = Begin;
+
+#if METABALLS_VECTOR_INTRINSICS
+	const SimdFloat4 X = SimdSet1(x);
+	const SimdFloat4 Y = SimdSet1(y);
+	const SimdFloat4 Z = SimdSet1(z);
+	const SimdFloat4 VInvSqRadius = SimdSet1(InvSqRadius);
+
+	SimdFloat4 Sum0 = SimdZero();
+	SimdFloat4 Sum1 = SimdZero();
+
+	for (; i + 8 <= End; i += 8)
+	{
+		Sum0 = SimdAdd(Sum0, MetaBallEnergy4(Balls, i, X, Y, Z, VInvSqRadius));
+		Sum1 = SimdAdd(Sum1, MetaBallEnergy4(Balls, i + 4, X, Y, Z, VInvSqRadius));
+	}
+
+	if (i + 4 <= End)
+	{
+		Sum0 = SimdAdd(Sum0, MetaBallEnergy4(Balls, i, X, Y, Z, VInvSqRadius));
+		i += 4;
+	}
+
+	fEnergy = SumLanes(SimdAdd(Sum0, Sum1));
+#endif
+
+	for (; i < End; i++)
+	{
+		const float fSqDist = std::max(Square(x - Balls.X[i]) + Square(y - Balls.Y[i]) + Square(z - Balls.Z[i]), 0.0001f);
+
+		fEnergy += MetaBallEnergy(Balls.M[i], fSqDist, InvSqRadius);
+	}
+
+	return fEnergy;
+}
+
+// Sums the normal contribution of the balls [Begin, End) at the point (x, y, z), the same way as SumMetaBallEnergy
+static SVector3f SumMetaBallNormal(const SMetaBallSoA& Balls, const int Begin, const int End, const float x, const float y, const float z, const float InvSqRadius)
+{
+	SVector3f Normal(0.0f, 0.0f, 0.0f);
+	int i = Begin;
+
+#if METABALLS_VECTOR_INTRINSICS
+	const SimdFloat4 X = SimdSet1(x);
+	const SimdFloat4 Y = SimdSet1(y);
+	const SimdFloat4 Z = SimdSet1(z);
+	const SimdFloat4 VInvSqRadius = SimdSet1(InvSqRadius);
+	const SimdFloat4 Two = SimdSet1(2.0f);
+
+	SimdFloat4 SumX = SimdZero();
+	SimdFloat4 SumY = SimdZero();
+	SimdFloat4 SumZ = SimdZero();
+
+	for (; i + 4 <= End; i += 4)
+	{
+		SimdFloat4 DX, DY, DZ;
+		const SimdFloat4 SqDist = MetaBallSqDist4(Balls, i, X, Y, Z, DX, DY, DZ);
+
+		const SimdFloat4 Ratio = SimdMultiply(SqDist, VInvSqRadius);
+		const SimdFloat4 Falloff = SimdMax(SimdNegateMultiplyAdd(Ratio, Ratio, SimdOne()), SimdZero());
+		const SimdFloat4 Scale = SimdDivide(SimdMultiply(SimdMultiply(Two, SimdLoad(Balls.M.data() + i)), Falloff), SimdMultiply(SqDist, SqDist));
+
+		SumX = SimdMultiplyAdd(Scale, DX, SumX);
+		SumY = SimdMultiplyAdd(Scale, DY, SumY);
+		SumZ = SimdMultiplyAdd(Scale, DZ, SumZ);
+	}
+
+	Normal = SVector3f(SumLanes(SumX), SumLanes(SumY), SumLanes(SumZ));
+#endif
+
+	for (; i < End; i++)
+	{
+		const SVector3f CalcVector(x - Balls.X[i], y - Balls.Y[i], z - Balls.Z[i]);
+		const float fSqDist = std::max(CalcVector.SizeSquared(), 0.0001f);
+
+		Normal += MetaBallNormalScale(Balls.M[i], fSqDist, InvSqRadius) * CalcVector;
+	}
+
+	return Normal;
+}
+
+
+CMetaballField::CMetaballField()
+	: m_pBalls(&m_NoBalls)
+	, m_bFiniteSupport(false)
+	, m_fInfluenceRadius(1.0f)
+	, m_fInvSqRadius(0.0f)
+	, m_nBallBinSize(0)
+	, m_fBallBinCellSize(0)
+{
+}
+
+CMetaballField::~CMetaballField()
+{
+}
+
+//=============================================================================
+void CMetaballField::Build(const SMetaBallSoA& Balls, const bool bFiniteSupport, const float InfluenceRadius)
+{
+	m_pBalls = &Balls;
+	m_bFiniteSupport = bFiniteSupport;
+	m_fInfluenceRadius = InfluenceRadius;
+	m_fInvSqRadius = bFiniteSupport ? 1.0f / Square(InfluenceRadius) : 0.0f;
+
+	if (!bFiniteSupport)
+		return;
+
+	METABALLS_CORE_SCOPE(CMetaballField::Build);
+
+	// Cells about as large as the influence radius keep the bins short
+	// without copying each ball into too many of them
+	m_nBallBinSize = Clamp<int>(static_cast<int>(2.0f / InfluenceRadius), 1, MAX_BALL_BINS);
+	m_fBallBinCellSize = 2.0f / static_cast<float>(m_nBallBinSize);
+
+	const int NumBins = m_nBallBinSize * m_nBallBinSize * m_nBallBinSize;
+
+	m_BallBinStart.assign(NumBins + 1, 0);
+
+	// Count pass, then prefix sum, then fill pass
+	for (int Pass = 0; Pass < 2; Pass++)
+	{
+		for (int i = 0; i < Balls.Num(); i++)
+		{
+			const float Position[3] = { Balls.X[i], Balls.Y[i], Balls.Z[i] };
+
+			int Min[3];
+			int Max[3];
+
+			for (int Axis = 0; Axis < 3; Axis++)
+			{
+				Min[Axis] = Clamp<int>(FloorToInt((Position[Axis] - InfluenceRadius + 1.0f) / m_fBallBinCellSize), 0, m_nBallBinSize - 1);
+				Max[Axis] = Clamp<int>(FloorToInt((Position[Axis] + InfluenceRadius + 1.0f) / m_fBallBinCellSize), 0, m_nBallBinSize - 1);
+			}
+
+			for (int z = Min[2]; z <= Max[2]; z++)
+			{
+				for (int y = Min[1]; y <= Max[1]; y++)
+				{
+					for (int x = Min[0]; x <= Max[0]; x++)
+					{
+						const int Bin = GetIndexNoAdd(x, y, z, m_nBallBinSize);
+
+						if (Pass == 0)
+						{
+							m_BallBinStart[Bin + 1]++;
+							continue;
+						}
+
+						const int Entry = m_BallBinStart[Bin]++;
+
+						m_BallBinSoA.X[Entry] = Balls.X[i];
+						m_BallBinSoA.Y[Entry] = Balls.Y[i];
+						m_BallBinSoA.Z[Entry] = Balls.Z[i];
+						m_BallBinSoA.M[Entry] = Balls.M[i];
+					}
+				}
+			}
+		}
+
+		if (Pass == 0)
+		{
+			for (int Bin = 0; Bin < NumBins; Bin++)
+				m_BallBinStart[Bin + 1] += m_BallBinStart[Bin];
+
+			m_BallBinSoA.SetNum(m_BallBinStart[NumBins]);
+		}
+	}
+
+	// The fill pass advanced every start to the end of its bin, shift them back
+	for (int Bin = NumBins; Bin > 0; Bin--)
+		m_BallBinStart[Bin] = m_BallBinStart[Bin - 1];
+
+	m_BallBinStart[0] = 0;
+}
+
+//=============================================================================
+float CMetaballField::ComputeEnergy(const float x, const float y, const float z, SPolygonizerOutput& Output) const
+{
+	const SMetaBallSoA& Balls = *m_pBalls;
+
+	Output.NumEnergySamples++;
+
+	if (m_bFiniteSupport)
+	{
+		// Only the balls binned with this point can reach it
+		const int Bin = GetBallBin(x, y, z);
+
+		Output.NumEnergyBallEvals += m_BallBinStart[Bin + 1] - m_BallBinStart[Bin];
+
+		return SumMetaBallEnergy(m_BallBinSoA, m_BallBinStart[Bin], m_BallBinStart[Bin + 1], x, y, z, m_fInvSqRadius);
+	}
+
+	// The formula for the energy is
+	//
+	//   e += mass/distance^2
+
+	Output.NumEnergyBallEvals += Balls.Num();
+
+	return SumMetaBallEnergy(Balls, 0, Balls.Num(), x, y, z, 0.0f);
+}
+
+//=============================================================================
+SVector3f CMetaballField::ComputeNormal(const float x, const float y, const float z, SPolygonizerOutput& Output) const
+{
+	const SMetaBallSoA& Balls = *m_pBalls;
+
+	Output.NumNormalSamples++;
+
+	if (m_bFiniteSupport)
+	{
+		const int Bin = GetBallBin(x, y, z);
+
+		Output.NumNormalBallEvals += m_BallBinStart[Bin + 1] - m_BallBinStart[Bin];
+
+		return SumMetaBallNormal(m_BallBinSoA, m_BallBinStart[Bin], m_BallBinStart[Bin + 1], x, y, z, m_fInvSqRadius);
+	}
+
+	Output.NumNormalBallEvals += Balls.Num();
+
+	return SumMetaBallNormal(Balls, 0, Balls.Num(), x, y, z, 0.0f);
+}
+
+//=============================================================================
+int CMetaballField::GetBallBin(const float x, const float y, const float z) const
+{
+	const int BinX = Clamp<int>(FloorToInt((x + 1.0f) / m_fBallBinCellSize), 0, m_nBallBinSize - 1);
+	const int BinY = Clamp<int>(FloorToInt((y + 1.0f) / m_fBallBinCellSize), 0, m_nBallBinSize - 1);
+	const int BinZ = Clamp<int>(FloorToInt((z + 1.0f) / m_fBallBinCellSize), 0, m_nBallBinSize - 1);
+
+	return GetIndexNoAdd(BinX, BinY, BinZ, m_nBallBinSize);
+}
+
+//=============================================================================
+size_t CMetaballField::GetAllocatedSize() const
+{
+	return GetVectorAllocatedSize(m_BallBinStart) + m_BallBinSoA.GetAllocatedSize();
+}
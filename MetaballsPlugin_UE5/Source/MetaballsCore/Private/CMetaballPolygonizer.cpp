@@ -0,0 +1,1897 @@
+#include "CMetaballPolygonizer.h"
+#include "CMarchingCubes.h"
+#include "MetaBallKernels.h"
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Status words shared by the slab workers. The engine atomics are not available here,
+// these are the same compiler intrinsics they wrap.
+static inline uint64_t AtomicLoad64(volatile uint64_t* Value)
+{
+#if defined(_MSC_VER)
+	return static_cast<uint64_t>(_InterlockedCompareExchange64(reinterpret_cast<volatile __int64*>(Value), 0, 0));
+#else
+	return __atomic_load_n(Value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Returns the value before the or
+static inline uint64_t AtomicOr64(volatile uint64_t* Value, const uint64_t Bits)
+{
+#if defined(_MSC_VER)
+	return static_cast<uint64_t>(_InterlockedOr64(reinterpret_cast<volatile __int64*>(Value), static_cast<__int64>(Bits)));
+#else
+	return __atomic_fetch_or(Value, Bits, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Marching cubes index of a corner on an edge the slab above owns, until the merge sets it
+static constexpr int32_t SLAB_BORDER_VERTEX = -2;
+
+// Runs the bodies one after another, until a ParallelFor is set
+static void SerialParallelFor(const int32_t Num, const std::function<void(int32_t)>& Body)
+{
+	for (int32_t i = 0; i < Num; i++)
+		Body(i);
+}
+
+
+CMetaballPolygonizer::CMetaballPolygonizer()
+	: m_fLevel(100.0f)
+	, m_nGridSize(0)
+	, m_fVoxelSize(0)
+	, m_pBuildBalls(nullptr)
+	, m_ParallelFor(SerialParallelFor)
+	, m_nNumReallocatingBuilds(0)
+	, m_nPassAllocatedSize(0)
+	, m_bSlicedBuildActive(false)
+	, m_nFillBall(0)
+	, m_bGridEnergySplatted(false)
+	, m_nNumSplattedSamples(0)
+	, m_bConcurrentFill(false)
+	, m_nNumSlabs(1)
+	, m_nFragmentBricksPerAxis(0)
+	, m_nFragmentGridSize(0)
+	, m_bFragmentsValid(false)
+	, m_bAllBricksDirty(false)
+	, m_bIncrementalFill(false)
+	, m_nNumDirtyBricks(0)
+	, m_fDirtyFraction(0)
+	, m_fFieldSeconds(0)
+	, m_fPolygonizeSeconds(0)
+	, m_nNumUndecimatedTriangles(0)
+	, m_fDecimateSeconds(0)
+{
+	CMarchingCubes::BuildTables();
+}
+
+CMetaballPolygonizer::~CMetaballPolygonizer()
+{
+}
+
+//=============================================================================
+void CMetaballPolygonizer::SetParallelFor(const ParallelForFunction& InParallelFor)
+{
+	m_ParallelFor = InParallelFor;
+	m_Decimator.SetParallelFor(InParallelFor);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::Build(const SMetaBallSoA& Balls, const SMetaBallBuildSettings& Settings)
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::Build);
+
+	m_bSlicedBuildActive = false;
+
+	const bool bIncremental = BeginBuildPass(Balls, Settings, false);
+	const double FillStartTime = MetaballsCoreSeconds();
+
+	if (bIncremental)
+	{
+		PolygonizeIncremental();
+	}
+	else if (m_BuildSettings.Polygonizer == EPolygonizerMode::AdaptiveOctree)
+	{
+		PolygonizeOctree();
+	}
+	else if (m_BuildSettings.PolygonizerThreads > 1)
+	{
+		PolygonizeParallel();
+	}
+	else
+	{
+		PolygonizeSerial();
+	}
+
+	m_fPolygonizeSeconds = MetaballsCoreSeconds() - FillStartTime;
+
+	EndBuildPass();
+}
+
+//=============================================================================
+void CMetaballPolygonizer::BeginSlicedBuild(const SMetaBallSoA& Balls, const SMetaBallBuildSettings& Settings)
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::BeginSlicedBuild);
+
+	BeginBuildPass(Balls, Settings, true);
+	BeginSerialFill();
+
+	m_bSlicedBuildActive = true;
+	m_fPolygonizeSeconds = 0;
+}
+
+//=============================================================================
+bool CMetaballPolygonizer::ContinueSlicedBuild(const int32_t nMaxVoxels, const double fMaxSeconds)
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::ContinueSlicedBuild);
+
+	if (!m_bSlicedBuildActive)
+		return true;
+
+	const double FillStartTime = MetaballsCoreSeconds();
+
+	const bool bDone = ContinueSerialFill(nMaxVoxels, FillStartTime + fMaxSeconds);
+
+	m_fPolygonizeSeconds += MetaballsCoreSeconds() - FillStartTime;
+
+	if (!bDone)
+		return false;
+
+	if (m_BuildSettings.Polygonizer == EPolygonizerMode::SurfaceNets)
+		AddSurfaceNetQuads(m_Output, nullptr);
+
+	EndBuildPass();
+
+	m_bSlicedBuildActive = false;
+
+	return true;
+}
+
+//=============================================================================
+bool CMetaballPolygonizer::BeginBuildPass(const SMetaBallSoA& Balls, const SMetaBallBuildSettings& Settings, const bool bSliced)
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::BeginBuildPass);
+
+	m_pBuildBalls = &Balls;
+	m_BuildSettings = Settings;
+
+	// The grid counts too, new bricks are allocations just as much as grown buffers
+	m_nPassAllocatedSize = GetAllocatedSize() + m_Grid.GetAllocatedSize();
+
+	m_Output.Recycle();
+
+	m_bGridEnergySplatted = false;
+	m_nNumSplattedSamples = 0;
+
+	// Only finite support leaves the field far from a moved ball unchanged. Incremental builds
+	// sample the dirty bricks lazily, splatting would visit every ball. The octree samples
+	// a fraction of the grid points, splatting would fill all of them around the balls.
+	// Surface nets quads join the vertices of neighboring voxels, so they cannot be kept per brick.
+	// Sliced builds run the serial fill, the fragments would go stale while it spans several ticks.
+	const bool bOctree = m_BuildSettings.Polygonizer == EPolygonizerMode::AdaptiveOctree;
+	const bool bSurfaceNets = m_BuildSettings.Polygonizer == EPolygonizerMode::SurfaceNets;
+	const bool bIncremental = m_BuildSettings.bFiniteSupport && m_BuildSettings.bIncrementalBuild && !bOctree && !bSurfaceNets && !bSliced;
+	const bool bSplat = m_BuildSettings.bFiniteSupport && m_BuildSettings.bSplatEnergy && !bIncremental && !bOctree;
+
+	// Splatting adds into the energies, so bricks have to start out at zero
+	m_Grid.BeginBuild(bSplat);
+
+	const double FieldStartTime = MetaballsCoreSeconds();
+
+	m_Field.Build(Balls, m_BuildSettings.bFiniteSupport, m_BuildSettings.InfluenceRadius);
+
+	if (bSplat)
+		SplatGridEnergy();
+
+	m_fFieldSeconds = MetaballsCoreSeconds() - FieldStartTime;
+
+	if (!bIncremental)
+	{
+		m_bFragmentsValid = false;
+		m_nNumDirtyBricks = 0;
+		m_fDirtyFraction = 1.0f;
+	}
+
+	return bIncremental;
+}
+
+//=============================================================================
+void CMetaballPolygonizer::EndBuildPass()
+{
+	if (m_BuildSettings.bDecimate)
+		DecimateMesh();
+
+	if (GetAllocatedSize() + m_Grid.GetAllocatedSize() != m_nPassAllocatedSize)
+		m_nNumReallocatingBuilds++;
+}
+
+//=============================================================================
+size_t CMetaballPolygonizer::GetAllocatedSize() const
+{
+	size_t Size = m_Output.GetAllocatedSize() + m_OpenVoxels.GetAllocatedSize() + GetVectorAllocatedSize(m_Slabs);
+
+	for (const SPolygonizerSlab& Slab : m_Slabs)
+		Size += Slab.GetAllocatedSize();
+
+	for (const SBrickFragment& Fragment : m_Fragments)
+		Size += Fragment.GetAllocatedSize();
+
+	Size += GetVectorAllocatedSize(m_Fragments) + GetVectorAllocatedSize(m_BrickFragments) + GetVectorAllocatedSize(m_FreeFragments) + m_FragmentBalls.GetAllocatedSize() +
+		GetVectorAllocatedSize(m_DirtyBricks) + GetVectorAllocatedSize(m_DirtyBrickList);
+
+	Size += m_Octree.GetAllocatedSize() + GetVectorAllocatedSize(m_OctreeQuads) + GetVectorAllocatedSize(m_OctreeBallKeys);
+	Size += m_Decimator.GetAllocatedSize();
+
+	return Size + m_Field.GetAllocatedSize();
+}
+
+//=============================================================================
+void CMetaballPolygonizer::DecimateMesh()
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::DecimateMesh);
+
+	const double StartTime = MetaballsCoreSeconds();
+	const int32_t NumTriangles = static_cast<int32_t>(m_Output.Triangles.size()) / 3;
+	const int32_t Budget = m_BuildSettings.DecimationBudget;
+	const int NumWorkers = Clamp<int>(m_BuildSettings.PolygonizerThreads, 1, MAX_POLYGONIZER_THREADS);
+
+	// Vertices are in mesh space, where the grid spans [-Scale, Scale]
+	const float GridStep = m_fVoxelSize * m_BuildSettings.Scale;
+	const SVector3f Origin(-m_BuildSettings.Scale);
+
+	float CellSize = Clamp<float>(m_BuildSettings.DecimationTolerance, MIN_DECIMATION_TOLERANCE, MAX_DECIMATION_TOLERANCE) * GridStep;
+
+	// Triangles fall with the square of the cube size. A budget starts from the size that should just meet it,
+	// and the cubes grow again while the estimate was too low.
+	if (Budget > 0 && NumTriangles > Budget)
+		CellSize = std::max(CellSize, GridStep * std::sqrt(static_cast<float>(NumTriangles) / Budget));
+
+	int32_t NumKept = m_Decimator.Cluster(m_Output.Vertices, m_Output.Triangles, Origin, 2 * m_BuildSettings.Scale, CellSize, DECIMATION_CHUNKS, NumWorkers);
+
+	for (int Pass = 1; Pass < MAX_DECIMATION_PASSES && Budget > 0 && NumKept > Budget; Pass++)
+	{
+		CellSize *= std::max(std::sqrt(static_cast<float>(NumKept) / Budget), 1.1f);
+		NumKept = m_Decimator.Cluster(m_Output.Vertices, m_Output.Triangles, Origin, 2 * m_BuildSettings.Scale, CellSize, DECIMATION_CHUNKS, NumWorkers);
+	}
+
+	m_Decimator.Apply(m_Output.Vertices, m_Output.Triangles, m_Output.Normals);
+
+	m_nNumUndecimatedTriangles = NumTriangles;
+	m_fDecimateSeconds = MetaballsCoreSeconds() - StartTime;
+}
+
+//=============================================================================
+void CMetaballPolygonizer::PolygonizeSerial()
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::PolygonizeSerial);
+
+	BeginSerialFill();
+	ContinueSerialFill(INT32_MAX, 0.0);
+
+	if (m_BuildSettings.Polygonizer == EPolygonizerMode::SurfaceNets)
+		AddSurfaceNetQuads(m_Output, nullptr);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::BeginSerialFill()
+{
+	m_OpenVoxels.Clear();
+	m_nFillBall = 0;
+}
+
+//=============================================================================
+bool CMetaballPolygonizer::ContinueSerialFill(const int32_t nMaxVoxels, const double fEndTime)
+{
+	const SMetaBallSoA& Balls = *m_pBuildBalls;
+	int32_t NumVoxels = 0;
+	int32_t NextClockVoxels = SLICE_CLOCK_VOXELS;
+	int nCase = 0;
+	int x, y, z;
+
+	// The clock is read every few voxels, and every call does at least one
+	auto IsSliceOver = [&]()
+	{
+		if (NumVoxels >= nMaxVoxels)
+			return true;
+
+		if (fEndTime <= 0 || NumVoxels < NextClockVoxels)
+			return false;
+
+		NextClockVoxels = NumVoxels + SLICE_CLOCK_VOXELS;
+
+		return MetaballsCoreSeconds() >= fEndTime;
+	};
+
+	while (true)
+	{
+		// A fill that was stopped goes on with its open voxels before the next ball seeds one
+		while (!m_OpenVoxels.IsEmpty())
+		{
+			if (IsSliceOver())
+				return false;
+
+			m_OpenVoxels.Pop(x, y, z);
+
+			nCase = ComputeGridVoxel(x, y, z, m_Output);
+
+			AddNeighborsToList(nCase, x, y, z);
+
+			NumVoxels++;
+		}
+
+		if (m_nFillBall >= Balls.Num())
+			return true;
+
+		if (IsSliceOver())
+			return false;
+
+		const int i = m_nFillBall++;
+
+		x = GetBallGridVoxel(Balls.X[i]);
+		y = GetBallGridVoxel(Balls.Y[i]);
+		z = GetBallGridVoxel(Balls.Z[i]);
+
+		bool bComputed = false;
+
+		// TODO: Check if bComputed can be used instead of constant
+		while (true)
+		{
+			if (IsGridVoxelComputed(x, y, z))
+			{
+				bComputed = true;
+				break;
+			}
+
+			nCase = ComputeGridVoxel(x, y, z, m_Output);
+			NumVoxels++;
+
+			if (nCase < 255)
+				break;
+
+			z--;
+		}
+
+		if (bComputed)
+			continue;
+
+		AddNeighborsToList(nCase, x, y, z);
+	}
+}
+
+//=============================================================================
+void CMetaballPolygonizer::PolygonizeParallel()
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::PolygonizeParallel);
+
+	// The slab count only depends on the grid size, the thread count only decides how many run at once
+	const int NumSlabs = Clamp<int>(m_nGridSize / MIN_SLAB_DEPTH, 1, MAX_POLYGONIZER_SLABS);
+	const int NumWorkers = std::min<int>(Clamp<int>(m_BuildSettings.PolygonizerThreads, 1, MAX_POLYGONIZER_THREADS), NumSlabs);
+
+	m_Slabs.resize(NumSlabs);
+	m_nNumSlabs = NumSlabs;
+
+	for (int k = 0; k < NumSlabs; k++)
+	{
+		SPolygonizerSlab& Slab = m_Slabs[k];
+
+		Slab.MinZ = k * m_nGridSize / NumSlabs;
+		Slab.MaxZ = (k + 1) * m_nGridSize / NumSlabs;
+
+		Slab.Seeds.clear();
+		Slab.OpenVoxels.Clear();
+		Slab.SendDown.clear();
+		Slab.SendUp.clear();
+		Slab.Output.Recycle();
+	}
+
+	// Walk down from every ball to the first voxel the surface goes through, like the serial
+	// path does, and hand it to the slab that owns it. Only energies are computed here.
+	const SMetaBallSoA& Balls = *m_pBuildBalls;
+
+	for (int i = 0; i < Balls.Num(); i++)
+	{
+		const int x = GetBallGridVoxel(Balls.X[i]);
+		const int y = GetBallGridVoxel(Balls.Y[i]);
+		int z = GetBallGridVoxel(Balls.Z[i]);
+
+		float b[8];
+		bool bComputed = false;
+
+		// Inside voxels are marked on the way down, so a ball that lands in the same blob
+		// as an earlier one stops early, like on the serial path
+		while (true)
+		{
+			if (IsGridVoxelVisited(x, y, z))
+			{
+				bComputed = true;
+				break;
+			}
+
+			if (ComputeGridVoxelCase(x, y, z, b, m_Output) < 255)
+				break;
+
+			SetGridVoxelComputed(x, y, z);
+			z--;
+		}
+
+		if (bComputed)
+			continue;
+
+		const int Owner = GetSlabOfLayer(z);
+
+		m_Slabs[Owner].Seeds.push_back(CVoxelWorkList::Pack(x, y, z));
+	}
+
+	// Every round fills all slabs from their seeds, then the voxels that crossed a slab
+	// border become the seeds of their owner. Rounds repeat until nothing crosses.
+	m_bConcurrentFill = true;
+
+	while (true)
+	{
+		m_ParallelFor(NumWorkers, [this, NumWorkers, NumSlabs](int32_t Worker)
+		{
+			for (int k = Worker; k < NumSlabs; k += NumWorkers)
+				FloodFillSlab(m_Slabs[k]);
+		});
+
+		bool bSent = false;
+
+		for (int k = 0; k < NumSlabs; k++)
+		{
+			std::vector<uint32_t>& Seeds = m_Slabs[k].Seeds;
+
+			Seeds.clear();
+
+			// Insert would reserve exactly, leave room so later rounds and frames fit
+			const size_t NumSeeds = (k > 0 ? m_Slabs[k - 1].SendUp.size() : 0) + (k < NumSlabs - 1 ? m_Slabs[k + 1].SendDown.size() : 0);
+
+			if (Seeds.capacity() < NumSeeds)
+				Seeds.reserve(NumSeeds * 2);
+
+			if (k > 0)
+				Seeds.insert(Seeds.end(), m_Slabs[k - 1].SendUp.begin(), m_Slabs[k - 1].SendUp.end());
+
+			if (k < NumSlabs - 1)
+				Seeds.insert(Seeds.end(), m_Slabs[k + 1].SendDown.begin(), m_Slabs[k + 1].SendDown.end());
+
+			bSent |= !Seeds.empty();
+		}
+
+		if (!bSent)
+			break;
+
+		for (int k = 0; k < NumSlabs; k++)
+		{
+			m_Slabs[k].SendDown.clear();
+			m_Slabs[k].SendUp.clear();
+		}
+	}
+
+	m_bConcurrentFill = false;
+
+	int32_t NumVertices = 0;
+	int32_t NumIndices = 0;
+
+	for (int k = 0; k < NumSlabs; k++)
+	{
+		NumVertices += static_cast<int32_t>(m_Slabs[k].Output.Vertices.size());
+		NumIndices += static_cast<int32_t>(m_Slabs[k].Output.Triangles.size());
+	}
+
+	m_Output.Reserve(NumVertices, NumIndices);
+
+	int32_t SlabVertexOffsets[MAX_POLYGONIZER_SLABS];
+	int32_t SlabIndexOffsets[MAX_POLYGONIZER_SLABS];
+
+	// Merge in slab order, so the mesh does not depend on which worker finished first
+	for (int k = 0; k < NumSlabs; k++)
+	{
+		const SPolygonizerOutput& SlabOutput = m_Slabs[k].Output;
+
+		SlabVertexOffsets[k] = static_cast<int32_t>(m_Output.Vertices.size());
+		SlabIndexOffsets[k] = static_cast<int32_t>(m_Output.Triangles.size());
+
+		m_Output.AppendMesh(SlabOutput);
+		m_Output.AddCounters(SlabOutput);
+	}
+
+	// Corners on the plane above a slab take the vertex the slab above put on the edge. The voxel
+	// above is always filled, the crossed edge on the top face makes it a neighbor.
+	for (int k = 0; k < NumSlabs - 1; k++)
+	{
+		const std::vector<int32_t>& BorderEdges = m_Slabs[k].Output.BorderEdges;
+		const int z = m_Slabs[k].MaxZ - 1;
+
+		for (size_t i = 0; i < BorderEdges.size(); i += 4)
+		{
+			const int nEdge = BorderEdges[i + 3];
+			const int32_t* EdgeVertex = GetGridEdgeVertex(BorderEdges[i + 1], BorderEdges[i + 2], z, CMarchingCubes::m_CubeEdges[nEdge][0], CMarchingCubes::m_CubeEdges[nEdge][1]);
+
+			m_Output.Triangles[SlabIndexOffsets[k] + BorderEdges[i]] = *EdgeVertex + SlabVertexOffsets[k + 1];
+		}
+	}
+
+	// Quads between slabs need the vertices of both, so they are added after the merge
+	if (m_BuildSettings.Polygonizer == EPolygonizerMode::SurfaceNets)
+	{
+		for (int k = 0; k < NumSlabs; k++)
+			AddSurfaceNetQuads(m_Slabs[k].Output, SlabVertexOffsets);
+	}
+
+	// The surface moves from slab to slab as the balls move. Every slab keeps the largest
+	// buffers any slab needed so far, the first slab collects them and hands them on.
+	for (int k = 1; k < NumSlabs; k++)
+		m_Slabs[0].ReserveLike(m_Slabs[k]);
+
+	for (int k = 1; k < NumSlabs; k++)
+		m_Slabs[k].ReserveLike(m_Slabs[0]);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::PolygonizeIncremental()
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::PolygonizeIncremental);
+
+	const int NumBricksPerAxis = (m_nGridSize + CBrickGrid::BRICK_MASK) >> CBrickGrid::BRICK_SHIFT;
+	const int NumBricks = NumBricksPerAxis * NumBricksPerAxis * NumBricksPerAxis;
+
+	if (m_nFragmentGridSize != m_nGridSize)
+	{
+		// Fragments and maps are kept for the next size, LOD switches would reallocate them otherwise
+		m_FreeFragments.clear();
+
+		for (int i = static_cast<int>(m_Fragments.size()) - 1; i >= 0; i--)
+		{
+			m_Fragments[i].Brick = NO_INDEX;
+			m_Fragments[i].SurfaceVoxels.clear();
+			m_Fragments[i].Mesh.Recycle();
+			m_FreeFragments.push_back(i);
+		}
+
+		m_BrickFragments.assign(NumBricks, NO_INDEX);
+		m_DirtyBricks.assign(NumBricks, 0);
+		m_DirtyBrickList.clear();
+
+		m_nFragmentBricksPerAxis = NumBricksPerAxis;
+		m_nFragmentGridSize = m_nGridSize;
+		m_bFragmentsValid = false;
+	}
+
+	// These move every vertex or change the field everywhere
+	bool bFull = !m_bFragmentsValid ||
+		m_FragmentSettings.InfluenceRadius != m_BuildSettings.InfluenceRadius ||
+		m_FragmentSettings.NormalMode != m_BuildSettings.NormalMode ||
+		m_FragmentSettings.Scale != m_BuildSettings.Scale;
+
+	for (const int32_t Brick : m_DirtyBrickList)
+		m_DirtyBricks[Brick] = 0;
+
+	m_DirtyBrickList.clear();
+	m_bAllBricksDirty = bFull;
+
+	if (!bFull)
+	{
+		MarkDirtyBricks();
+
+		// Once no surface is left in clean bricks, none can enter the dirty region and the
+		// balls alone find all of it, like in a full build
+		bFull = true;
+
+		for (const SBrickFragment& Fragment : m_Fragments)
+		{
+			if (!Fragment.Mesh.Triangles.empty() && !m_DirtyBricks[Fragment.Brick])
+			{
+				bFull = false;
+				break;
+			}
+		}
+
+		m_bAllBricksDirty = bFull;
+	}
+
+	m_OpenVoxels.Clear();
+	m_bIncrementalFill = true;
+
+	// The field did not change where the dirty region borders clean bricks, so surface that enters
+	// the region went through the same voxels in the last build. They are the seeds, together with
+	// the balls for surface that lies completely inside.
+	for (int32_t i = 0; i < static_cast<int32_t>(m_Fragments.size()); i++)
+	{
+		SBrickFragment& Fragment = m_Fragments[i];
+
+		if (Fragment.Brick == NO_INDEX)
+			continue;
+
+		if (!bFull)
+		{
+			if (!m_DirtyBricks[Fragment.Brick])
+				continue;
+
+			const int bx = Fragment.Brick % NumBricksPerAxis;
+			const int by = Fragment.Brick / NumBricksPerAxis % NumBricksPerAxis;
+			const int bz = Fragment.Brick / (NumBricksPerAxis * NumBricksPerAxis);
+
+			for (const uint16_t Cell : Fragment.SurfaceVoxels)
+			{
+				AddNeighbor(
+					(bx << CBrickGrid::BRICK_SHIFT) | CBrickGrid::GetCellCoordinate(Cell, 0),
+					(by << CBrickGrid::BRICK_SHIFT) | CBrickGrid::GetCellCoordinate(Cell, 1),
+					(bz << CBrickGrid::BRICK_SHIFT) | CBrickGrid::GetCellCoordinate(Cell, 2));
+			}
+		}
+
+		// Rebuilt bricks take a fragment again once the fill reaches them, so one the surface
+		// moved to can reuse the fragment of one it left
+		m_BrickFragments[Fragment.Brick] = NO_INDEX;
+		Fragment.Brick = NO_INDEX;
+		Fragment.SurfaceVoxels.clear();
+		Fragment.Mesh.Recycle();
+		m_FreeFragments.push_back(i);
+	}
+
+	const SMetaBallSoA& Balls = *m_pBuildBalls;
+
+	for (int i = 0; i < Balls.Num(); i++)
+	{
+		const int x = GetBallGridVoxel(Balls.X[i]);
+		const int y = GetBallGridVoxel(Balls.Y[i]);
+		int z = GetBallGridVoxel(Balls.Z[i]);
+
+		float b[8];
+
+		while (IsVoxelBrickDirty(x, y, z) && !IsGridVoxelVisited(x, y, z))
+		{
+			if (ComputeGridVoxelCase(x, y, z, b, m_Output) < 255)
+			{
+				AddNeighbor(x, y, z);
+				break;
+			}
+
+			SetGridVoxelComputed(x, y, z);
+			z--;
+		}
+	}
+
+	while (!m_OpenVoxels.IsEmpty())
+	{
+		int x, y, z;
+		m_OpenVoxels.Pop(x, y, z);
+
+		SBrickFragment& Fragment = GetBrickFragment(x, y, z);
+
+		const int nCase = ComputeGridVoxel(x, y, z, Fragment.Mesh);
+
+		if (nCase != 0 && nCase != 255)
+			Fragment.SurfaceVoxels.push_back(static_cast<uint16_t>(CBrickGrid::GetCell(x, y, z)));
+
+		AddNeighborsToList(nCase, x, y, z);
+	}
+
+	m_bIncrementalFill = false;
+
+	// The fill takes a fragment for every brick it visits, the ones the surface does not go through give it back
+	for (int32_t i = 0; i < static_cast<int32_t>(m_Fragments.size()); i++)
+	{
+		SBrickFragment& Fragment = m_Fragments[i];
+
+		if (Fragment.Brick == NO_INDEX || !Fragment.SurfaceVoxels.empty())
+			continue;
+
+		m_BrickFragments[Fragment.Brick] = NO_INDEX;
+		Fragment.Brick = NO_INDEX;
+		Fragment.Mesh.Reset();
+		m_FreeFragments.push_back(i);
+	}
+
+	// Clean and rebuilt fragments together make the mesh
+	int32_t NumVertices = 0;
+	int32_t NumIndices = 0;
+
+	for (const SBrickFragment& Fragment : m_Fragments)
+	{
+		NumVertices += static_cast<int32_t>(Fragment.Mesh.Vertices.size());
+		NumIndices += static_cast<int32_t>(Fragment.Mesh.Triangles.size());
+	}
+
+	m_Output.Reserve(NumVertices, NumIndices);
+
+	int NumSurfaceBricks = 0;
+	int NumRebuiltSurfaceBricks = 0;
+
+	for (const SBrickFragment& Fragment : m_Fragments)
+	{
+		const SPolygonizerOutput& Mesh = Fragment.Mesh;
+
+		if (Mesh.Triangles.empty())
+			continue;
+
+		m_Output.AppendMesh(Mesh);
+
+		NumSurfaceBricks++;
+
+		// The counters of clean fragments belong to the build that made them
+		if (!bFull && !m_DirtyBricks[Fragment.Brick])
+			continue;
+
+		NumRebuiltSurfaceBricks++;
+
+		m_Output.AddCounters(Mesh);
+	}
+
+	m_nNumDirtyBricks = m_bAllBricksDirty ? NumBricks : static_cast<int>(m_DirtyBrickList.size());
+	m_fDirtyFraction = NumSurfaceBricks ? static_cast<float>(NumRebuiltSurfaceBricks) / NumSurfaceBricks : 0.0f;
+
+	// Copied element wise, assigning the arrays could reallocate them whenever the ball count changes
+	m_FragmentBalls.SetNum(Balls.Num());
+
+	std::copy(Balls.X.begin(), Balls.X.end(), m_FragmentBalls.X.begin());
+	std::copy(Balls.Y.begin(), Balls.Y.end(), m_FragmentBalls.Y.begin());
+	std::copy(Balls.Z.begin(), Balls.Z.end(), m_FragmentBalls.Z.begin());
+	std::copy(Balls.M.begin(), Balls.M.end(), m_FragmentBalls.M.begin());
+
+	m_FragmentSettings = m_BuildSettings;
+	m_bFragmentsValid = true;
+
+	// Fragments go from brick to brick as the balls move. Every fragment keeps the largest
+	// buffers any fragment needed so far, the first one collects them and hands them on.
+	for (size_t i = 1; i < m_Fragments.size(); i++)
+		m_Fragments[0].ReserveLike(m_Fragments[i]);
+
+	for (size_t i = 1; i < m_Fragments.size(); i++)
+		m_Fragments[i].ReserveLike(m_Fragments[0]);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::MarkDirtyBricks()
+{
+	const SMetaBallSoA& Balls = *m_pBuildBalls;
+	const SMetaBallSoA& OldBalls = m_FragmentBalls;
+
+	// A ball that moved changed the field around where it was and around where it is now
+	for (int i = 0; i < std::max(Balls.Num(), OldBalls.Num()); i++)
+	{
+		const bool bNew = i < Balls.Num();
+		const bool bOld = i < OldBalls.Num();
+
+		if (bNew && bOld &&
+			Balls.X[i] == OldBalls.X[i] && Balls.Y[i] == OldBalls.Y[i] &&
+			Balls.Z[i] == OldBalls.Z[i] && Balls.M[i] == OldBalls.M[i])
+		{
+			continue;
+		}
+
+		if (bOld)
+			MarkDirtyBall(OldBalls.X[i], OldBalls.Y[i], OldBalls.Z[i]);
+
+		if (bNew)
+			MarkDirtyBall(Balls.X[i], Balls.Y[i], Balls.Z[i]);
+	}
+}
+
+//=============================================================================
+void CMetaballPolygonizer::MarkDirtyBall(const float x, const float y, const float z)
+{
+	// A voxel reads the grid points one step around it, two with grid gradient normals. The margin
+	// also keeps the outermost voxels of the region unchanged, which the seeding relies on.
+	const float Position[3] = { x, y, z };
+	int Min[3];
+	int Max[3];
+
+	for (int Axis = 0; Axis < 3; Axis++)
+	{
+		const int MinVoxel = FloorToInt((Position[Axis] - m_BuildSettings.InfluenceRadius + 1.0f) / m_fVoxelSize) - DIRTY_VOXEL_MARGIN;
+		const int MaxVoxel = CeilToInt((Position[Axis] + m_BuildSettings.InfluenceRadius + 1.0f) / m_fVoxelSize) + DIRTY_VOXEL_MARGIN;
+
+		Min[Axis] = Clamp<int>(MinVoxel, 0, m_nGridSize - 1) >> CBrickGrid::BRICK_SHIFT;
+		Max[Axis] = Clamp<int>(MaxVoxel, 0, m_nGridSize - 1) >> CBrickGrid::BRICK_SHIFT;
+	}
+
+	for (int bz = Min[2]; bz <= Max[2]; bz++)
+	{
+		for (int by = Min[1]; by <= Max[1]; by++)
+		{
+			for (int bx = Min[0]; bx <= Max[0]; bx++)
+			{
+				const int32_t Brick = bx + (by + bz * m_nFragmentBricksPerAxis) * m_nFragmentBricksPerAxis;
+
+				if (m_DirtyBricks[Brick])
+					continue;
+
+				m_DirtyBricks[Brick] = 1;
+				m_DirtyBrickList.push_back(Brick);
+			}
+		}
+	}
+}
+
+//=============================================================================
+inline int32_t CMetaballPolygonizer::GetVoxelBrick(const int x, const int y, const int z) const
+{
+	return (x >> CBrickGrid::BRICK_SHIFT) +
+		((y >> CBrickGrid::BRICK_SHIFT) + (z >> CBrickGrid::BRICK_SHIFT) * m_nFragmentBricksPerAxis) * m_nFragmentBricksPerAxis;
+}
+
+//=============================================================================
+inline bool CMetaballPolygonizer::IsVoxelBrickDirty(const int x, const int y, const int z) const
+{
+	return m_bAllBricksDirty || m_DirtyBricks[GetVoxelBrick(x, y, z)];
+}
+
+//=============================================================================
+SBrickFragment& CMetaballPolygonizer::GetBrickFragment(const int x, const int y, const int z)
+{
+	const int32_t Brick = GetVoxelBrick(x, y, z);
+	int32_t& Fragment = m_BrickFragments[Brick];
+
+	if (Fragment == NO_INDEX)
+	{
+		if (!m_FreeFragments.empty())
+		{
+			Fragment = m_FreeFragments.back();
+			m_FreeFragments.pop_back();
+		}
+		else
+		{
+			Fragment = static_cast<int32_t>(m_Fragments.size());
+			m_Fragments.emplace_back();
+		}
+
+		m_Fragments[Fragment].Brick = Brick;
+	}
+
+	return m_Fragments[Fragment];
+}
+
+// Interleaves the bits of a grid position, x highest like the child order of the octree, so the
+// positions inside an octree node form one range of codes
+static uint32_t GetOctreeMortonCode(const uint32_t X, const uint32_t Y, const uint32_t Z)
+{
+	uint32_t Code = 0;
+
+	for (int Bit = 0; Bit < 10; Bit++)
+		Code |= (((X >> Bit) & 1) << (3 * Bit + 2)) | (((Y >> Bit) & 1) << (3 * Bit + 1)) | (((Z >> Bit) & 1) << (3 * Bit));
+
+	return Code;
+}
+
+//=============================================================================
+void CMetaballPolygonizer::PolygonizeOctree()
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::PolygonizeOctree);
+
+	const SMetaBallSoA& Balls = *m_pBuildBalls;
+
+	m_OctreeBallKeys.clear();
+
+	for (int i = 0; i < Balls.Num(); i++)
+		m_OctreeBallKeys.push_back(GetOctreeMortonCode(GetBallGridVoxel(Balls.X[i]), GetBallGridVoxel(Balls.Y[i]), GetBallGridVoxel(Balls.Z[i])));
+
+	std::sort(m_OctreeBallKeys.begin(), m_OctreeBallKeys.end());
+
+	int RootSize = 1;
+
+	while (RootSize < m_nGridSize)
+		RootSize <<= 1;
+
+	m_Octree.Reset(RootSize);
+	RefineOctreeNode(0);
+
+	m_OctreeQuads.clear();
+	m_Octree.Contour(m_OctreeQuads);
+
+	for (size_t i = 0; i < m_OctreeQuads.size(); i += 4)
+	{
+		int32_t Quad[4];
+
+		for (int j = 0; j < 4; j++)
+			Quad[j] = GetOctreeLeafVertex(m_OctreeQuads[i + j], &m_OctreeQuads[i], m_Output);
+
+		// Where a larger leaf fills two places of the quad one of its triangles is degenerate
+		for (int j = 1; j < 3; j++)
+		{
+			if (Quad[0] == Quad[j] || Quad[j] == Quad[j + 1] || Quad[j + 1] == Quad[0])
+				continue;
+
+			m_Output.Triangles.push_back(Quad[0]);
+			m_Output.Triangles.push_back(Quad[j]);
+			m_Output.Triangles.push_back(Quad[j + 1]);
+		}
+	}
+}
+
+//=============================================================================
+void CMetaballPolygonizer::RefineOctreeNode(const int32_t nNode)
+{
+	// Subdividing grows the node array, so nodes are only held by index across it
+	const SOctreeNode Node = m_Octree.GetNode(nNode);
+	const int Half = Node.Size / 2;
+
+	float Energies[8];
+	uint8_t Corners = 0;
+
+	for (int i = 0; i < 8; i++)
+	{
+		const int ox = (i >> 2) & 1, oy = (i >> 1) & 1, oz = i & 1;
+
+		Energies[i] = GetOctreeEnergy(Node.X + ox * Node.Size, Node.Y + oy * Node.Size, Node.Z + oz * Node.Size, m_Output);
+		Corners |= Energies[i] > m_fLevel ? (1 << i) : 0;
+	}
+
+	m_Octree.GetNode(nNode).Corners = Corners;
+
+	if (Node.Size == 1)
+		return;
+
+	bool bSplit = false;
+
+	if (Corners != 0 && Corners != 0xFF)
+	{
+		// The surface goes through the node. The leaf vertex is moved onto the surface, so what
+		// a leaf gets wrong is how much the surface bends across it. Over half the node the
+		// gradient turns by the largest angle between a corner and the mean direction, a flat
+		// leaf is then off by about Size * Angle / 4 grid steps.
+		SVector3f Directions[8];
+		SVector3f Mean(0.0f, 0.0f, 0.0f);
+
+		for (int i = 0; i < 8; i++)
+		{
+			// Corners where the field of finite support is zero have no direction
+			Directions[i] = SVector3f(Energies[i | 4] - Energies[i & ~4], Energies[i | 2] - Energies[i & ~2], Energies[i | 1] - Energies[i & ~1]).GetSafeNormal();
+			Mean += Directions[i];
+		}
+
+		float MinCos = 1;
+
+		if (Mean.Normalize())
+		{
+			for (int i = 0; i < 8; i++)
+			{
+				if (!Directions[i].IsZero())
+					MinCos = std::min(MinCos, SVector3f::DotProduct(Directions[i], Mean));
+			}
+		}
+
+		bSplit = Node.Size > MAX_OCTREE_SURFACE_LEAF || Node.Size * std::acos(Clamp<float>(MinCos, -1, 1)) / 4 > m_BuildSettings.OctreeTolerance;
+	}
+	else if (Half == 1)
+	{
+		// The other samples of a node of two grid steps are the corners of its children,
+		// looking at them costs as much as splitting. Only a ball too small to reach the corners splits it.
+		bSplit = Corners == 0 && OctreeNodeHasBall(Node);
+	}
+	else
+	{
+		// A surface the corners miss: around a ball inside the node, or from a ball next to it,
+		// which shows at the faces first. A fold of the field that comes close to the surface
+		// between the samples could reach it. Deep inside a ball the energy varies a lot but
+		// the surface is far, so energies count up to twice the level.
+		static const int Probes[7][3] = { { 1, 1, 1 }, { 0, 1, 1 }, { 2, 1, 1 }, { 1, 0, 1 }, { 1, 2, 1 }, { 1, 1, 0 }, { 1, 1, 2 } };
+
+		float MaxError = 0;
+		float MinMargin = FLT_MAX;
+
+		for (int i = 0; i < 8; i++)
+			MinMargin = std::min(MinMargin, std::abs(std::min(Energies[i], 2 * m_fLevel) - m_fLevel));
+
+		for (int p = 0; p < 7; p++)
+		{
+			const int a = Probes[p][0], b = Probes[p][1], c = Probes[p][2];
+			const float Energy = GetOctreeEnergy(Node.X + a * Half, Node.Y + b * Half, Node.Z + c * Half, m_Output);
+			float Predicted = 0;
+
+			// Blend of the corners of the face, or of all corners for the center
+			for (int i = 0; i < 8; i++)
+			{
+				const int ox = (i >> 2) & 1, oy = (i >> 1) & 1, oz = i & 1;
+				const float Weight = (a == 1 ? 0.5f : (a == ox * 2)) * (b == 1 ? 0.5f : (b == oy * 2)) * (c == 1 ? 0.5f : (c == oz * 2));
+
+				Predicted += Weight * std::min(Energies[i], 2 * m_fLevel);
+			}
+
+			bSplit |= (Energy > m_fLevel) != (Corners != 0);
+			MaxError = std::max(MaxError, std::abs(std::min(Energy, 2 * m_fLevel) - Predicted));
+			MinMargin = std::min(MinMargin, std::abs(std::min(Energy, 2 * m_fLevel) - m_fLevel));
+		}
+
+		bSplit |= MaxError >= MinMargin || (Corners == 0 && OctreeNodeHasBall(Node));
+	}
+
+	if (!bSplit)
+		return;
+
+	const int32_t First = m_Octree.Subdivide(nNode);
+
+	for (int i = 0; i < 8; i++)
+		RefineOctreeNode(First + i);
+}
+
+//=============================================================================
+bool CMetaballPolygonizer::OctreeNodeHasBall(const SOctreeNode& Node) const
+{
+	const uint32_t First = GetOctreeMortonCode(Node.X, Node.Y, Node.Z);
+	const std::vector<uint32_t>::const_iterator Key = std::lower_bound(m_OctreeBallKeys.begin(), m_OctreeBallKeys.end(), First);
+
+	return Key != m_OctreeBallKeys.end() && *Key - First < static_cast<uint32_t>(Node.Size * Node.Size * Node.Size);
+}
+
+//=============================================================================
+float CMetaballPolygonizer::GetOctreeEnergy(const int x, const int y, const int z, SPolygonizerOutput& Output) const
+{
+	// The root is rounded up to a power of two, grid points past the grid are outside like the grid border
+	if (x >= m_nGridSize || y >= m_nGridSize || z >= m_nGridSize)
+		return 0;
+
+	return ComputeGridPointEnergy(x, y, z, Output);
+}
+
+//=============================================================================
+int32_t CMetaballPolygonizer::GetOctreeLeafVertex(const int32_t nLeaf, const int32_t* Quad, SPolygonizerOutput& Output)
+{
+	const SOctreeNode Leaf = m_Octree.GetNode(nLeaf);
+
+	if (Leaf.Vertex != NO_INDEX)
+		return Leaf.Vertex;
+
+	float Energies[8];
+
+	for (int i = 0; i < 8; i++)
+		Energies[i] = GetOctreeEnergy(Leaf.X + ((i >> 2) & 1) * Leaf.Size, Leaf.Y + ((i >> 1) & 1) * Leaf.Size, Leaf.Z + (i & 1) * Leaf.Size, Output);
+
+	// Start from the mass point of the crossings on the leaf edges
+	SVector3f Offset(0.0f, 0.0f, 0.0f);
+	int NumCrossings = 0;
+
+	for (int i = 0; i < 8; i++)
+	{
+		for (int Bit = 1; Bit < 8; Bit <<= 1)
+		{
+			const int j = i | Bit;
+
+			if (j == i || !(Leaf.Corners & (1 << i)) == !(Leaf.Corners & (1 << j)))
+				continue;
+
+			const float t = (m_fLevel - Energies[i]) / (Energies[j] - Energies[i]);
+
+			Offset += SVector3f(static_cast<float>((i >> 2) & 1), static_cast<float>((i >> 1) & 1), static_cast<float>(i & 1)) * (1 - t) +
+				SVector3f(static_cast<float>((j >> 2) & 1), static_cast<float>((j >> 1) & 1), static_cast<float>(j & 1)) * t;
+			NumCrossings++;
+		}
+	}
+
+	const SVector3f Min(ConvertGridPointToWorldCoordinate(Leaf.X), ConvertGridPointToWorldCoordinate(Leaf.Y), ConvertGridPointToWorldCoordinate(Leaf.Z));
+	const SVector3f Max(Min + SVector3f(Leaf.Size * m_fVoxelSize));
+
+	SVector3f Position = Min + SVector3f(0.5f * Leaf.Size * m_fVoxelSize);
+
+	if (NumCrossings)
+	{
+		Position = Min + Offset * (Leaf.Size * m_fVoxelSize / NumCrossings);
+	}
+	else
+	{
+		// A leaf with all corners on one side is in the quad only because of the smaller leaves
+		// around the edge. It starts from their vertices, its center can be far from the surface.
+		SVector3f Sum(0.0f, 0.0f, 0.0f);
+		int NumVertices = 0;
+
+		for (int i = 0; i < 4; i++)
+		{
+			const uint8_t Corners = m_Octree.GetNode(Quad[i]).Corners;
+
+			if (Corners != 0 && Corners != 0xFF)
+			{
+				const SVector3f Vertex = Output.Vertices[GetOctreeLeafVertex(Quad[i], Quad, Output)] / m_BuildSettings.Scale;
+
+				Sum += SVector3f(Vertex.Z, Vertex.Y, Vertex.X);
+				NumVertices++;
+			}
+		}
+
+		if (NumVertices)
+		{
+			Position = Sum / static_cast<float>(NumVertices);
+			Position = SVector3f(Clamp(Position.X, Min.X, Max.X), Clamp(Position.Y, Min.Y, Max.Y), Clamp(Position.Z, Min.Z, Max.Z));
+		}
+	}
+
+	float Energy = m_Field.ComputeEnergy(Position.X, Position.Y, Position.Z, Output);
+	SVector3f Normal = m_Field.ComputeNormal(Position.X, Position.Y, Position.Z, Output);
+
+	// The mass point sits on the blend of the corners, a couple of Newton steps along the
+	// gradient move it onto the surface. The leaf and a step that makes it worse stop it.
+	for (int Step = 0; Step < 3; Step++)
+	{
+		const float SqSize = Normal.SizeSquared();
+
+		if (SqSize < 1e-8f || std::abs(Energy - m_fLevel) < 0.001f * m_fLevel)
+			break;
+
+		// The normal is the negative gradient
+		SVector3f Next = Position + Normal * ((Energy - m_fLevel) / SqSize);
+
+		Next = SVector3f(Clamp(Next.X, Min.X, Max.X), Clamp(Next.Y, Min.Y, Max.Y), Clamp(Next.Z, Min.Z, Max.Z));
+
+		const float NextEnergy = m_Field.ComputeEnergy(Next.X, Next.Y, Next.Z, Output);
+
+		if (std::abs(NextEnergy - m_fLevel) >= std::abs(Energy - m_fLevel))
+			break;
+
+		Position = Next;
+		Energy = NextEnergy;
+		Normal = m_Field.ComputeNormal(Position.X, Position.Y, Position.Z, Output);
+	}
+
+	SVector3f NVector(Normal.Z, Normal.Y, Normal.X);
+
+	NVector.Normalize();
+
+	const int32_t Vertex = static_cast<int32_t>(Output.Vertices.size());
+
+	Output.Vertices.push_back(SVector3f(Position.Z, Position.Y, Position.X) * m_BuildSettings.Scale);
+	Output.Normals.push_back(NVector);
+
+	m_Octree.GetNode(nLeaf).Vertex = Vertex;
+
+	return Vertex;
+}
+
+//=============================================================================
+void CMetaballPolygonizer::FloodFillSlab(SPolygonizerSlab& Slab)
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::FloodFillSlab);
+
+	for (const uint32_t Seed : Slab.Seeds)
+	{
+		int x, y, z;
+		CVoxelWorkList::Unpack(Seed, x, y, z);
+		AddSlabNeighbor(Slab, x, y, z);
+	}
+
+	while (!Slab.OpenVoxels.IsEmpty())
+	{
+		int x, y, z;
+		Slab.OpenVoxels.Pop(x, y, z);
+
+		const int nCase = ComputeGridVoxel(x, y, z, Slab.Output);
+
+		if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 0))
+			AddSlabNeighbor(Slab, x + 1, y, z);
+
+		if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 1))
+			AddSlabNeighbor(Slab, x - 1, y, z);
+
+		if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 2))
+			AddSlabNeighbor(Slab, x, y + 1, z);
+
+		if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 3))
+			AddSlabNeighbor(Slab, x, y - 1, z);
+
+		if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 4))
+			AddSlabNeighbor(Slab, x, y, z + 1);
+
+		if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 5))
+			AddSlabNeighbor(Slab, x, y, z - 1);
+	}
+}
+
+//=============================================================================
+void CMetaballPolygonizer::AddSlabNeighbor(SPolygonizerSlab& Slab, const int x, const int y, const int z)
+{
+	// Voxels of other slabs are only ever touched by their own worker
+	if (z < Slab.MinZ || z >= Slab.MaxZ)
+	{
+		std::vector<uint32_t>& Send = z < Slab.MinZ ? Slab.SendDown : Slab.SendUp;
+
+		Send.push_back(CVoxelWorkList::Pack(x, y, z));
+		return;
+	}
+
+	if (IsGridVoxelVisited(x, y, z))
+		return;
+
+	Slab.OpenVoxels.Push(x, y, z);
+
+	Slab.Output.PeakOpenVoxels = std::max<int32_t>(Slab.Output.PeakOpenVoxels, Slab.OpenVoxels.Num());
+
+	SetGridVoxelInList(x, y, z);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::ComputeNormal(const SVector3f& Vertex, SPolygonizerOutput& Output) const
+{
+	
+	// The vertex is already swizzled to (z, y, x), the balls are not
+	const SVector3f BallSpaceNormal = m_Field.ComputeNormal(Vertex.Z, Vertex.Y, Vertex.X, Output);
+
+	SVector3f NVector(BallSpaceNormal.Z, BallSpaceNormal.Y, BallSpaceNormal.X);
+
+	NVector.Normalize();
+	Output.Normals.push_back(NVector);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::ComputeGridNormal(const SVector3f& Vertex, const int x, const int y, const int z, const int nIndex0, const int nIndex1, const float t, SPolygonizerOutput& Output) const
+{
+
+	const float* Corner0 = CMarchingCubes::m_CubeVertices[nIndex0];
+	const float* Corner1 = CMarchingCubes::m_CubeVertices[nIndex1];
+
+	const SVector3f Gradient0 = ComputeGridGradient(x + static_cast<int>(Corner0[0]), y + static_cast<int>(Corner0[1]), z + static_cast<int>(Corner0[2]), Output);
+	const SVector3f Gradient1 = ComputeGridGradient(x + static_cast<int>(Corner1[0]), y + static_cast<int>(Corner1[1]), z + static_cast<int>(Corner1[2]), Output);
+	const SVector3f Gradient = Gradient0 * (1 - t) + Gradient1 * t;
+
+	// The energy grows towards the balls, the normal points the other way
+	SVector3f NVector(-Gradient.Z, -Gradient.Y, -Gradient.X);
+
+	// Flat spots, like the forced zeros on the grid border, have no gradient
+	if (!NVector.Normalize())
+	{
+		ComputeNormal(Vertex, Output);
+		return;
+	}
+
+	Output.NumNormalSamples++;
+	Output.Normals.push_back(NVector);
+}
+
+//=============================================================================
+SVector3f CMetaballPolygonizer::ComputeGridGradient(const int x, const int y, const int z, SPolygonizerOutput& Output) const
+{
+	// Central differences, one sided on the grid border. Points the fill did not sample are computed
+	// here like any other, so unless the energies were splatted the normals still sum balls.
+	const int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, m_nGridSize);
+	const int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, m_nGridSize);
+	const int z0 = std::max(z - 1, 0), z1 = std::min(z + 1, m_nGridSize);
+
+	return SVector3f(
+		(ComputeGridPointEnergy(x1, y, z, Output) - ComputeGridPointEnergy(x0, y, z, Output)) / (x1 - x0),
+		(ComputeGridPointEnergy(x, y1, z, Output) - ComputeGridPointEnergy(x, y0, z, Output)) / (y1 - y0),
+		(ComputeGridPointEnergy(x, y, z1, Output) - ComputeGridPointEnergy(x, y, z0, Output)) / (z1 - z0));
+}
+
+//=============================================================================
+void CMetaballPolygonizer::AddNeighborsToList(const int nCase, const int x, const int y, const int z)
+{
+	
+	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 0))
+		AddNeighbor(x + 1, y, z);
+
+	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 1))
+		AddNeighbor(x - 1, y, z);
+
+	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 2))
+		AddNeighbor(x, y + 1, z);
+
+	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 3))
+		AddNeighbor(x, y - 1, z);
+
+	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 4))
+		AddNeighbor(x, y, z + 1);
+
+	if (CMarchingCubes::m_CubeNeighbors[nCase] & (1 << 5))
+		AddNeighbor(x, y, z - 1);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::AddNeighbor(const int x, const int y, const int z)
+{
+
+	// Clean bricks keep their fragments
+	if (m_bIncrementalFill && !IsVoxelBrickDirty(x, y, z))
+		return;
+
+	if (IsGridVoxelVisited(x, y, z))
+		return;
+
+	m_OpenVoxels.Push(x, y, z);
+
+	SetGridVoxelInList(x, y, z);
+
+	m_Output.PeakOpenVoxels = std::max<int32_t>(m_Output.PeakOpenVoxels, m_OpenVoxels.Num());
+}
+
+//=============================================================================
+void CMetaballPolygonizer::SplatGridEnergy()
+{
+	METABALLS_CORE_SCOPE(CMetaballPolygonizer::SplatGridEnergy);
+
+	const SMetaBallSoA& Balls = *m_pBuildBalls;
+	const float SqRadius = Square<float>(m_BuildSettings.InfluenceRadius);
+	const float InvSqRadius = 1.0f / SqRadius;
+
+	int64_t NumSplattedSamples = 0;
+
+	// Bricks start out at zero the first time a build touches them, so every ball only adds to the
+	// interior points of its box, the edges always stay zero. The box is walked brick by brick.
+	for (int i = 0; i < Balls.Num(); i++)
+	{
+		const float Position[3] = { Balls.X[i], Balls.Y[i], Balls.Z[i] };
+		const float Mass = Balls.M[i];
+
+		int Min[3];
+		int Max[3];
+
+		for (int Axis = 0; Axis < 3; Axis++)
+		{
+			Min[Axis] = std::max<int>(FloorToInt((Position[Axis] - m_BuildSettings.InfluenceRadius + 1.0f) / m_fVoxelSize), 1);
+			Max[Axis] = std::min<int>(CeilToInt((Position[Axis] + m_BuildSettings.InfluenceRadius + 1.0f) / m_fVoxelSize), m_nGridSize - 1);
+		}
+
+		if (Min[0] > Max[0] || Min[1] > Max[1] || Min[2] > Max[2])
+			continue;
+
+		for (int bz = Min[2] & ~CBrickGrid::BRICK_MASK; bz <= Max[2]; bz += CBrickGrid::BRICK_SIZE)
+		for (int by = Min[1] & ~CBrickGrid::BRICK_MASK; by <= Max[1]; by += CBrickGrid::BRICK_SIZE)
+		for (int bx = Min[0] & ~CBrickGrid::BRICK_MASK; bx <= Max[0]; bx += CBrickGrid::BRICK_SIZE)
+		{
+			SGridBrick* Brick = m_Grid.GetBrick(bx, by, bz);
+
+			const int MinX = std::max<int>(Min[0], bx);
+			const int MaxX = std::min<int>(Max[0], bx + CBrickGrid::BRICK_MASK);
+
+			for (int z = std::max<int>(Min[2], bz); z <= std::min<int>(Max[2], bz + CBrickGrid::BRICK_MASK); z++)
+			{
+				const float SqDistZ = Square<float>(ConvertGridPointToWorldCoordinate(z) - Position[2]);
+
+				for (int y = std::max<int>(Min[1], by); y <= std::min<int>(Max[1], by + CBrickGrid::BRICK_MASK); y++)
+				{
+					const float SqDistYZ = Square<float>(ConvertGridPointToWorldCoordinate(y) - Position[1]) + SqDistZ;
+
+					if (SqDistYZ >= SqRadius)
+						continue;
+
+					// Row of the brick, indexed with grid x. Morton bricks have no contiguous rows, the
+					// row is summed up on the stack and added to its cells afterwards.
+#if METABALLS_MORTON_BRICKS
+					float RowEnergy[CBrickGrid::BRICK_SIZE] = {};
+					float* Row = RowEnergy - bx;
+#else
+					float* Row = Brick->Energy + CBrickGrid::GetCell(0, y, z) - bx;
+#endif
+
+					int x = MinX;
+
+#if METABALLS_VECTOR_INTRINSICS
+					const SimdFloat4 BallX = SimdSet1(Position[0]);
+					const SimdFloat4 VoxelSize = SimdSet1(m_fVoxelSize);
+					const SimdFloat4 VSqDistYZ = SimdSet1(SqDistYZ);
+					const SimdFloat4 VInvSqRadius = SimdSet1(InvSqRadius);
+					const SimdFloat4 VMass = SimdSet1(Mass);
+
+					for (; x + 4 <= MaxX + 1; x += 4)
+					{
+						const SimdFloat4 GridX = SimdSet4(static_cast<float>(x), static_cast<float>(x + 1), static_cast<float>(x + 2), static_cast<float>(x + 3));
+						const SimdFloat4 DX = SimdSubtract(SimdSubtract(SimdMultiply(GridX, VoxelSize), SimdOne()), BallX);
+						const SimdFloat4 SqDist = SimdMax(SimdMultiplyAdd(DX, DX, VSqDistYZ), SimdSet1(0.0001f));
+						const SimdFloat4 Falloff = SimdMax(SimdNegateMultiplyAdd(SqDist, VInvSqRadius, SimdOne()), SimdZero());
+						const SimdFloat4 Energy = SimdDivide(SimdMultiply(VMass, SimdMultiply(Falloff, Falloff)), SqDist);
+
+						SimdStore(SimdAdd(SimdLoad(Row + x), Energy), Row + x);
+					}
+#endif
+
+					for (; x <= MaxX; x++)
+					{
+						const float fSqDist = std::max<float>(Square<float>(ConvertGridPointToWorldCoordinate(x) - Position[0]) + SqDistYZ, 0.0001f);
+
+						Row[x] += MetaBallEnergy(Mass, fSqDist, InvSqRadius);
+					}
+
+#if METABALLS_MORTON_BRICKS
+					for (x = MinX; x <= MaxX; x++)
+						Brick->Energy[CBrickGrid::GetCell(x, y, z)] += Row[x];
+#endif
+
+					NumSplattedSamples += MaxX - MinX + 1;
+				}
+			}
+		}
+	}
+
+	m_bGridEnergySplatted = true;
+	m_nNumSplattedSamples = NumSplattedSamples;
+}
+
+//=============================================================================
+float CMetaballPolygonizer::ComputeGridPointEnergy(const int x, const int y, const int z, SPolygonizerOutput& Output) const
+{
+	
+	SGridBrick* Brick = m_Grid.GetBrick(x, y, z);
+	const int Cell = CBrickGrid::GetCell(x, y, z);
+	float& Energy = Brick->Energy[Cell];
+
+	// A splatted field is complete before the flood fill starts
+	if (m_bGridEnergySplatted)
+		return Energy;
+
+	if (m_bConcurrentFill)
+	{
+		// Slab workers share the grid points on slab borders, the first one to claim a point computes it
+		volatile uint64_t* Word = Brick->PointStatus + CBrickGrid::GetStatusWord(Cell);
+		const int Shift = CBrickGrid::GetStatusShift(Cell);
+		uint64_t Bits = AtomicLoad64(Word) >> Shift;
+
+		if (Bits & CBrickGrid::STATUS_COMPUTED)
+			return Energy;
+
+		if (!(Bits & CBrickGrid::STATUS_CLAIMED))
+			Bits = AtomicOr64(Word, static_cast<uint64_t>(CBrickGrid::STATUS_CLAIMED) << Shift) >> Shift;
+
+		if (Bits & CBrickGrid::STATUS_CLAIMED)
+		{
+			while (!((AtomicLoad64(Word) >> Shift) & CBrickGrid::STATUS_COMPUTED))
+				std::this_thread::yield();
+
+			return Energy;
+		}
+
+		Energy = EvaluateGridPointEnergy(x, y, z, Output);
+		AtomicOr64(Word, static_cast<uint64_t>(CBrickGrid::STATUS_COMPUTED) << Shift);
+
+		return Energy;
+	}
+
+	if (GetGridStatus(Brick->PointStatus, Cell) & CBrickGrid::STATUS_COMPUTED)
+		return Energy;
+
+	Energy = EvaluateGridPointEnergy(x, y, z, Output);
+
+	SetGridStatus(Brick->PointStatus, Cell, CBrickGrid::STATUS_COMPUTED);
+
+	return Energy;
+}
+
+//=============================================================================
+float CMetaballPolygonizer::EvaluateGridPointEnergy(const int x, const int y, const int z, SPolygonizerOutput& Output) const
+{
+	// The energy on the edges are always zero to make sure the isosurface is
+	// always closed.
+	if (x == 0 || y == 0 || z == 0 ||
+		x == m_nGridSize || y == m_nGridSize || z == m_nGridSize)
+	{
+		return 0;
+	}
+
+	if (!Output.bTimingVoxel)
+	{
+		return m_Field.ComputeEnergy(
+			ConvertGridPointToWorldCoordinate(x),
+			ConvertGridPointToWorldCoordinate(y),
+			ConvertGridPointToWorldCoordinate(z),
+			Output);
+	}
+
+	const uint64_t StartCycles = MetaballsCoreCycles();
+
+	const float Energy = m_Field.ComputeEnergy(
+		ConvertGridPointToWorldCoordinate(x),
+		ConvertGridPointToWorldCoordinate(y),
+		ConvertGridPointToWorldCoordinate(z),
+		Output);
+
+	Output.FieldCycles += MetaballsCoreCycles() - StartCycles;
+
+	return Energy;
+}
+
+//=============================================================================
+int CMetaballPolygonizer::ComputeGridVoxelCase(const int x, const int y, const int z, float* b, SPolygonizerOutput& Output) const
+{
+	SVoxelPhaseTimer Timer(Output, Output.ClassifyCycles);
+
+	b[0] = ComputeGridPointEnergy(x, y, z, Output);
+	b[1] = ComputeGridPointEnergy(x + 1, y, z, Output);
+	b[2] = ComputeGridPointEnergy(x + 1, y, z + 1, Output);
+	b[3] = ComputeGridPointEnergy(x, y, z + 1, Output);
+	b[4] = ComputeGridPointEnergy(x, y + 1, z, Output);
+	b[5] = ComputeGridPointEnergy(x + 1, y + 1, z, Output);
+	b[6] = ComputeGridPointEnergy(x + 1, y + 1, z + 1, Output);
+	b[7] = ComputeGridPointEnergy(x, y + 1, z + 1, Output);
+
+	int c = 0;
+	c |= b[0] > m_fLevel ? (1 << 0) : 0;
+	c |= b[1] > m_fLevel ? (1 << 1) : 0;
+	c |= b[2] > m_fLevel ? (1 << 2) : 0;
+	c |= b[3] > m_fLevel ? (1 << 3) : 0;
+	c |= b[4] > m_fLevel ? (1 << 4) : 0;
+	c |= b[5] > m_fLevel ? (1 << 5) : 0;
+	c |= b[6] > m_fLevel ? (1 << 6) : 0;
+	c |= b[7] > m_fLevel ? (1 << 7) : 0;
+
+	return c;
+}
+
+//=============================================================================
+int CMetaballPolygonizer::ComputeGridVoxel(const int x, const int y, const int z, SPolygonizerOutput& Output)
+{
+	const bool bSurfaceNets = m_BuildSettings.Polygonizer == EPolygonizerMode::SurfaceNets;
+
+	Output.NumVoxels++;
+
+	// Instrumented builds time one voxel in VOXEL_TIMING_SAMPLE, reading the clock in every
+	// voxel would cost a good part of what the voxels cost
+	if (!m_BuildSettings.bInstrument || Output.NumVoxels % VOXEL_TIMING_SAMPLE != 0)
+		return bSurfaceNets ? ComputeSurfaceNetVoxel(x, y, z, Output) : ComputeMarchingCubesVoxel(x, y, z, Output);
+
+	const uint64_t StartCycles = MetaballsCoreCycles();
+
+	Output.bTimingVoxel = true;
+
+	const int c = bSurfaceNets ? ComputeSurfaceNetVoxel(x, y, z, Output) : ComputeMarchingCubesVoxel(x, y, z, Output);
+
+	Output.bTimingVoxel = false;
+	Output.VoxelCycles += MetaballsCoreCycles() - StartCycles;
+	Output.NumTimedVoxels++;
+
+	return c;
+}
+
+//=============================================================================
+int CMetaballPolygonizer::ComputeMarchingCubesVoxel(int x, int y, int z, SPolygonizerOutput& Output)
+{
+	float b[8];
+
+	const int c = ComputeGridVoxelCase(x, y, z, b, Output);
+
+	int i = 0;
+	int32_t EdgeIndices[12];
+	memset(EdgeIndices, 0xFF, 12 * sizeof(int32_t));
+
+	while (true)
+	{
+		const int nEdge = CMarchingCubes::m_CubeTriangles[c][i];
+		if (nEdge == -1)
+			break;
+
+		if (EdgeIndices[nEdge] == NO_INDEX)
+		{
+			const int nIndex0 = CMarchingCubes::m_CubeEdges[nEdge][0];
+			const int nIndex1 = CMarchingCubes::m_CubeEdges[nEdge][1];
+
+			// A neighbor that shares the edge may have emitted its vertex already
+			int32_t* EdgeVertex = GetGridEdgeVertex(x, y, z, nIndex0, nIndex1);
+
+			Output.NumEdgeLookups++;
+
+			// The slab above emits the vertex, the merge looks it up
+			if (!EdgeVertex && m_bConcurrentFill)
+			{
+				Output.NumEdgeCacheHits++;
+				EdgeIndices[nEdge] = SLAB_BORDER_VERTEX;
+			}
+			else if (EdgeVertex && *EdgeVertex != NO_INDEX)
+			{
+				Output.NumEdgeCacheHits++;
+				EdgeIndices[nEdge] = *EdgeVertex;
+			}
+			else
+			{
+				EdgeIndices[nEdge] = ComputeMarchingCubesVertex(x, y, z, nIndex0, nIndex1, b, Output);
+
+				if (EdgeVertex)
+					*EdgeVertex = EdgeIndices[nEdge];
+			}
+		}
+
+		if (EdgeIndices[nEdge] == SLAB_BORDER_VERTEX)
+		{
+			Output.BorderEdges.push_back(static_cast<int32_t>(Output.Triangles.size()));
+			Output.BorderEdges.push_back(x);
+			Output.BorderEdges.push_back(y);
+			Output.BorderEdges.push_back(nEdge);
+		}
+
+		Output.Triangles.push_back(EdgeIndices[nEdge]);
+
+		i++;
+	}
+
+	SetGridVoxelComputed(x, y, z);
+
+	return c;
+
+}
+
+//=============================================================================
+int32_t CMetaballPolygonizer::ComputeMarchingCubesVertex(const int x, const int y, const int z, const int nIndex0, const int nIndex1, const float* b, SPolygonizerOutput& Output)
+{
+	// Compute the vertex by interpolating between the two points. The edges run from their lower
+	// to their upper point, and the vertex is placed from the grid point it starts at, so every
+	// voxel around the edge finds the same vertex, whichever of them gets there first.
+	const float* Corner0 = CMarchingCubes::m_CubeVertices[nIndex0];
+	const float* Corner1 = CMarchingCubes::m_CubeVertices[nIndex1];
+
+	const float t = (m_fLevel - b[nIndex0]) / (b[nIndex1] - b[nIndex0]);
+
+	SVector3f EdgeVector(
+		ConvertGridPointToWorldCoordinate(x + static_cast<int>(Corner0[0])) + (Corner1[0] - Corner0[0]) * t * m_fVoxelSize,
+		ConvertGridPointToWorldCoordinate(y + static_cast<int>(Corner0[1])) + (Corner1[1] - Corner0[1]) * t * m_fVoxelSize,
+		ConvertGridPointToWorldCoordinate(z + static_cast<int>(Corner0[2])) + (Corner1[2] - Corner0[2]) * t * m_fVoxelSize);
+	EdgeVector = SVector3f(EdgeVector.Z, EdgeVector.Y, EdgeVector.X);
+
+	{
+		SVoxelPhaseTimer Timer(Output, Output.NormalCycles);
+
+		if (m_BuildSettings.NormalMode == EPolygonizerNormals::GridGradient)
+			ComputeGridNormal(EdgeVector, x, y, z, nIndex0, nIndex1, t, Output);
+		else
+			ComputeNormal(EdgeVector, Output);
+	}
+
+	Output.Vertices.push_back(EdgeVector * m_BuildSettings.Scale);
+
+	return static_cast<int32_t>(Output.Vertices.size()) - 1;
+}
+
+//=============================================================================
+int CMetaballPolygonizer::ComputeSurfaceNetVoxel(const int x, const int y, const int z, SPolygonizerOutput& Output)
+{
+	float b[8];
+
+	const int c = ComputeGridVoxelCase(x, y, z, b, Output);
+
+	SetGridVoxelComputed(x, y, z);
+
+	if (c == 0 || c == 255)
+		return c;
+
+	// The vertex is the mass point of the crossings on the voxel edges
+	SVector3f Offset(0.0f, 0.0f, 0.0f);
+	int NumCrossings = 0;
+
+	for (int nEdge = 0; nEdge < 12; nEdge++)
+	{
+		const int nIndex0 = CMarchingCubes::m_CubeEdges[nEdge][0];
+		const int nIndex1 = CMarchingCubes::m_CubeEdges[nEdge][1];
+
+		if (!(c & (1 << nIndex0)) == !(c & (1 << nIndex1)))
+			continue;
+
+		const float t = (m_fLevel - b[nIndex0]) / (b[nIndex1] - b[nIndex0]);
+
+		Offset += SVector3f(
+			CMarchingCubes::m_CubeVertices[nIndex0][0] * (1 - t) + CMarchingCubes::m_CubeVertices[nIndex1][0] * t,
+			CMarchingCubes::m_CubeVertices[nIndex0][1] * (1 - t) + CMarchingCubes::m_CubeVertices[nIndex1][1] * t,
+			CMarchingCubes::m_CubeVertices[nIndex0][2] * (1 - t) + CMarchingCubes::m_CubeVertices[nIndex1][2] * t);
+		NumCrossings++;
+	}
+
+	Offset /= static_cast<float>(NumCrossings);
+
+	SVector3f Vertex(SVector3f(ConvertGridPointToWorldCoordinate(x), ConvertGridPointToWorldCoordinate(y), ConvertGridPointToWorldCoordinate(z)) + Offset * m_fVoxelSize);
+	Vertex = SVector3f(Vertex.Z, Vertex.Y, Vertex.X);
+
+	{
+		SVoxelPhaseTimer Timer(Output, Output.NormalCycles);
+
+		if (m_BuildSettings.NormalMode == EPolygonizerNormals::GridGradient)
+		{
+			// Gradient of the trilinear blend of the corners at the vertex, it needs no other grid points
+			const float u = Offset.X, v = Offset.Y, w = Offset.Z;
+
+			const float dx = ((b[1] - b[0]) * (1 - w) + (b[2] - b[3]) * w) * (1 - v) + ((b[5] - b[4]) * (1 - w) + (b[6] - b[7]) * w) * v;
+			const float dy = ((b[4] - b[0]) * (1 - w) + (b[7] - b[3]) * w) * (1 - u) + ((b[5] - b[1]) * (1 - w) + (b[6] - b[2]) * w) * u;
+			const float dz = ((b[3] - b[0]) * (1 - u) + (b[2] - b[1]) * u) * (1 - v) + ((b[7] - b[4]) * (1 - u) + (b[6] - b[5]) * u) * v;
+
+			// The energy grows towards the balls, the normal points the other way
+			SVector3f NVector(-dz, -dy, -dx);
+
+			if (NVector.Normalize())
+			{
+				Output.NumNormalSamples++;
+				Output.Normals.push_back(NVector);
+			}
+			else
+			{
+				ComputeNormal(Vertex, Output);
+			}
+		}
+		else
+		{
+			ComputeNormal(Vertex, Output);
+		}
+	}
+
+	*GetGridVoxelVertex(x, y, z) = static_cast<int32_t>(Output.Vertices.size());
+
+	Output.Vertices.push_back(Vertex * m_BuildSettings.Scale);
+
+	Output.DualVoxels.push_back(x);
+	Output.DualVoxels.push_back(y);
+	Output.DualVoxels.push_back(z);
+	Output.DualVoxels.push_back(c);
+
+	return c;
+}
+
+//=============================================================================
+void CMetaballPolygonizer::AddSurfaceNetQuads(const SPolygonizerOutput& Source, const int32_t* SlabVertexOffsets)
+{
+	// Every voxel adds the quads of the three grid edges that start at its lower corner. The other
+	// three voxels around such an edge lie below it, the edges on the grid border are never crossed.
+	static const int QuadVoxels[3][4][3] =
+	{
+		{ { 0, 0, 0 }, { 0, -1, 0 }, { 0, -1, -1 }, { 0, 0, -1 } },
+		{ { 0, 0, 0 }, { 0, 0, -1 }, { -1, 0, -1 }, { -1, 0, 0 } },
+		{ { 0, 0, 0 }, { -1, 0, 0 }, { -1, -1, 0 }, { 0, -1, 0 } }
+	};
+
+	// Corners at the far ends of the x, y and z edge from corner 0
+	static const int EdgeCorners[3] = { 1, 4, 3 };
+
+	for (size_t i = 0; i < Source.DualVoxels.size(); i += 4)
+	{
+		const int x = Source.DualVoxels[i];
+		const int y = Source.DualVoxels[i + 1];
+		const int z = Source.DualVoxels[i + 2];
+		const int c = Source.DualVoxels[i + 3];
+
+		const bool bInside = (c & 1) != 0;
+
+		for (int Axis = 0; Axis < 3; Axis++)
+		{
+			if (((c >> EdgeCorners[Axis]) & 1) == (c & 1))
+				continue;
+
+			int32_t Quad[4];
+
+			for (int j = 0; j < 4; j++)
+			{
+				const int vz = z + QuadVoxels[Axis][j][2];
+
+				Quad[j] = *GetGridVoxelVertex(x + QuadVoxels[Axis][j][0], y + QuadVoxels[Axis][j][1], vz);
+
+				// Slab outputs were merged, their vertices moved by the offset of the slab that made them
+				if (SlabVertexOffsets)
+					Quad[j] += SlabVertexOffsets[GetSlabOfLayer(vz)];
+			}
+
+			// Split along the same diagonal either way, only the winding follows the side the inside is on
+			const int32_t Order[2][4] = { { 0, 1, 2, 3 }, { 0, 3, 2, 1 } };
+			const int32_t* o = Order[bInside ? 0 : 1];
+
+			m_Output.Triangles.push_back(Quad[o[0]]);
+			m_Output.Triangles.push_back(Quad[o[1]]);
+			m_Output.Triangles.push_back(Quad[o[2]]);
+
+			m_Output.Triangles.push_back(Quad[o[0]]);
+			m_Output.Triangles.push_back(Quad[o[2]]);
+			m_Output.Triangles.push_back(Quad[o[3]]);
+		}
+	}
+}
+
+//=============================================================================
+int32_t* CMetaballPolygonizer::GetGridEdgeVertex(const int x, const int y, const int z, const int nIndex0, const int nIndex1) const
+{
+	// Lower grid point of the edge between two corners of voxel (x, y, z), and the axis it runs along
+	const float* Corner0 = CMarchingCubes::m_CubeVertices[nIndex0];
+	const float* Corner1 = CMarchingCubes::m_CubeVertices[nIndex1];
+
+	const int ex = x + static_cast<int>(std::min(Corner0[0], Corner1[0]));
+	const int ey = y + static_cast<int>(std::min(Corner0[1], Corner1[1]));
+	const int ez = z + static_cast<int>(std::min(Corner0[2], Corner1[2]));
+	const int Axis = Corner0[0] != Corner1[0] ? 0 : (Corner0[1] != Corner1[1] ? 1 : 2);
+
+	// Fragments index their own vertices, edges on the far side of the voxel's brick belong to another one
+	if (m_bIncrementalFill && ((ex ^ x) | (ey ^ y) | (ez ^ z)) >> CBrickGrid::BRICK_SHIFT)
+		return nullptr;
+
+	// Edges in the plane between two slabs belong to the slab above, so only one worker writes
+	// their vertices. Voxels of the slab below get none, the merge looks the vertex up.
+	if (m_bConcurrentFill && ez != z && ez < m_nGridSize && GetSlabOfLayer(ez) != GetSlabOfLayer(z))
+		return nullptr;
+
+	return &m_Grid.GetBrick(ex, ey, ez)->EdgeVertices[CBrickGrid::GetCell(ex, ey, ez)][Axis];
+}
+
+//=============================================================================
+int32_t* CMetaballPolygonizer::GetGridVoxelVertex(const int x, const int y, const int z) const
+{
+	// Surface nets have no vertices on the edges, the slot of the x edge holds the vertex inside the voxel
+	return &m_Grid.GetBrick(x, y, z)->EdgeVertices[CBrickGrid::GetCell(x, y, z)][0];
+}
+
+//=============================================================================
+int CMetaballPolygonizer::GetSlabOfLayer(const int z) const
+{
+	// Slab k owns the voxel layers [k*N/S, (k+1)*N/S)
+	return ((z + 1) * m_nNumSlabs + m_nGridSize - 1) / m_nGridSize - 1;
+}
+
+//=============================================================================
+float CMetaballPolygonizer::ConvertGridPointToWorldCoordinate(const int x) const
+{
+	return static_cast<float>(x) * m_fVoxelSize - 1.0f;
+}
+
+//=============================================================================
+int CMetaballPolygonizer::ConvertWorldCoordinateToGridPoint(const float x) const
+{
+	return static_cast<int>((x + 1.0f) / m_fVoxelSize + 0.5f);
+}
+
+//=============================================================================
+int CMetaballPolygonizer::GetBallGridVoxel(const float x) const
+{
+	// Balls placed from Blueprint may be anywhere, seeds have to stay inside the grid
+	return Clamp<int>(ConvertWorldCoordinateToGridPoint(x), 0, m_nGridSize - 1);
+}
+
+//=============================================================================
+void CMetaballPolygonizer::SetGridSize(const int nSize)
+{
+	m_nGridSize = Clamp<int>(nSize, 1, CVoxelWorkList::MAX_GRID_SIZE);
+	m_fVoxelSize = 2 / static_cast<float>(m_nGridSize);
+
+	m_Grid.SetSize(m_nGridSize);
+}
+
+//=============================================================================
+inline int CMetaballPolygonizer::GetGridStatus(uint64_t* Words, const int Cell) const
+{
+	const uint64_t Word = m_bConcurrentFill ? AtomicLoad64(Words + CBrickGrid::GetStatusWord(Cell)) : Words[CBrickGrid::GetStatusWord(Cell)];
+
+	return static_cast<int>(Word >> CBrickGrid::GetStatusShift(Cell)) & CBrickGrid::STATUS_MASK;
+}
+
+//=============================================================================
+// Status bits are only ever added during a build. Slab workers can share a word at a slab border,
+// so they or it atomically.
+inline void CMetaballPolygonizer::SetGridStatus(uint64_t* Words, const int Cell, const int Status) const
+{
+	const uint64_t Bits = static_cast<uint64_t>(Status) << CBrickGrid::GetStatusShift(Cell);
+
+	if (m_bConcurrentFill)
+		AtomicOr64(Words + CBrickGrid::GetStatusWord(Cell), Bits);
+	else
+		Words[CBrickGrid::GetStatusWord(Cell)] |= Bits;
+}
+
+//=============================================================================
+inline bool CMetaballPolygonizer::IsGridPointComputed(const int x, const int y, const int z) const
+{
+	return (GetGridStatus(m_Grid.GetBrick(x, y, z)->PointStatus, CBrickGrid::GetCell(x, y, z)) & CBrickGrid::STATUS_COMPUTED) != 0;
+}
+
+//=============================================================================
+inline bool CMetaballPolygonizer::IsGridVoxelComputed(const int x, const int y, const int z) const
+{
+	return (GetGridStatus(m_Grid.GetBrick(x, y, z)->VoxelStatus, CBrickGrid::GetCell(x, y, z)) & CBrickGrid::STATUS_COMPUTED) != 0;
+}
+
+//=============================================================================
+inline bool CMetaballPolygonizer::IsGridVoxelInList(const int x, const int y, const int z) const
+{
+	return GetGridStatus(m_Grid.GetBrick(x, y, z)->VoxelStatus, CBrickGrid::GetCell(x, y, z)) == CBrickGrid::STATUS_IN_LIST;
+}
+
+//=============================================================================
+inline bool CMetaballPolygonizer::IsGridVoxelVisited(const int x, const int y, const int z) const
+{
+	return GetGridStatus(m_Grid.GetBrick(x, y, z)->VoxelStatus, CBrickGrid::GetCell(x, y, z)) != 0;
+}
+
+//=============================================================================
+inline void CMetaballPolygonizer::SetGridPointComputed(const int x, const int y, const int z) const
+{
+	SetGridStatus(m_Grid.GetBrick(x, y, z)->PointStatus, CBrickGrid::GetCell(x, y, z), CBrickGrid::STATUS_COMPUTED);
+}
+
+//=============================================================================
+inline void CMetaballPolygonizer::SetGridVoxelComputed(const int x, const int y, const int z) const
+{
+	SetGridStatus(m_Grid.GetBrick(x, y, z)->VoxelStatus, CBrickGrid::GetCell(x, y, z), CBrickGrid::STATUS_COMPUTED);
+}
+
+//=============================================================================
+inline void CMetaballPolygonizer::SetGridVoxelInList(const int x, const int y, const int z) const
+{
+	SetGridStatus(m_Grid.GetBrick(x, y, z)->VoxelStatus, CBrickGrid::GetCell(x, y, z), CBrickGrid::STATUS_IN_LIST);
+}
@@ -0,0 +1,250 @@
+#include "CMetaballScenario.h"
+#include <algorithm>
+#include <cstring>
+
+// "MBSC", the first bytes of every scenario
+static const uint32_t ScenarioMagic = 0x4353424D;
+
+// Frame flag of the frames that store their masses
+static const uint8_t FrameHasMasses = 1;
+
+// The byte stream is in host order, little endian on every platform the plugin runs on
+template <typename T>
+static void Write(std::vector<uint8_t>& Data, const T& Value)
+{
+	const size_t Offset = Data.size();
+
+	Data.resize(Offset + sizeof(T));
+	memcpy(Data.data() + Offset, &Value, sizeof(T));
+}
+
+static void WriteFloats(std::vector<uint8_t>& Data, const float* Values, const size_t Num)
+{
+	const size_t Offset = Data.size();
+
+	Data.resize(Offset + Num * sizeof(float));
+	memcpy(Data.data() + Offset, Values, Num * sizeof(float));
+}
+
+// Reads from a byte range, every read after one that ran past the end fails too
+struct SScenarioReader
+{
+	const uint8_t* Data;
+	size_t Size;
+	size_t Offset;
+
+	template <typename T>
+	bool Read(T& Value)
+	{
+		if (Size - Offset < sizeof(T))
+		{
+			Offset = Size;
+			return false;
+		}
+
+		memcpy(&Value, Data + Offset, sizeof(T));
+		Offset += sizeof(T);
+		return true;
+	}
+
+	bool ReadFloats(std::vector<float>& Values, const size_t Num)
+	{
+		if ((Size - Offset) / sizeof(float) < Num)
+		{
+			Offset = Size;
+			return false;
+		}
+
+		const size_t Start = Values.size();
+
+		Values.resize(Start + Num);
+		memcpy(Values.data() + Start, Data + Offset, Num * sizeof(float));
+		Offset += Num * sizeof(float);
+		return true;
+	}
+};
+
+
+CMetaballScenario::CMetaballScenario()
+{
+}
+
+CMetaballScenario::~CMetaballScenario()
+{
+}
+
+//=============================================================================
+void CMetaballScenario::Reset()
+{
+	m_Settings = SMetaBallBuildSettings();
+	m_Frames.clear();
+	m_Values.clear();
+}
+
+//=============================================================================
+void CMetaballScenario::AddFrame(const int nGridSize, const SMetaBallBuildSettings& Settings, const SMetaBallSoA& Balls)
+{
+	if (m_Frames.empty())
+		m_Settings = Settings;
+
+	const int32_t NumBalls = Balls.Num();
+
+	SFrame Frame;
+	Frame.GridSize = nGridSize;
+	Frame.Scale = Settings.Scale;
+	Frame.NumBalls = NumBalls;
+	Frame.Positions = m_Values.size();
+
+	m_Values.insert(m_Values.end(), Balls.X.begin(), Balls.X.end());
+	m_Values.insert(m_Values.end(), Balls.Y.begin(), Balls.Y.end());
+	m_Values.insert(m_Values.end(), Balls.Z.begin(), Balls.Z.end());
+
+	// Masses rarely change, a frame keeps using the ones of the frame before while they are the same
+	const SFrame* Previous = m_Frames.empty() ? nullptr : &m_Frames.back();
+
+	if (Previous && Previous->NumBalls == NumBalls && std::equal(Balls.M.begin(), Balls.M.end(), m_Values.begin() + Previous->Masses))
+	{
+		Frame.Masses = Previous->Masses;
+	}
+	else
+	{
+		Frame.Masses = m_Values.size();
+		m_Values.insert(m_Values.end(), Balls.M.begin(), Balls.M.end());
+	}
+
+	m_Frames.push_back(Frame);
+}
+
+//=============================================================================
+void CMetaballScenario::GetFrameBalls(const int32_t nFrame, SMetaBallSoA& Balls) const
+{
+	const SFrame& Frame = m_Frames[nFrame];
+	const float* Positions = m_Values.data() + Frame.Positions;
+	const float* Masses = m_Values.data() + Frame.Masses;
+
+	Balls.SetNum(Frame.NumBalls);
+
+	memcpy(Balls.X.data(), Positions, Frame.NumBalls * sizeof(float));
+	memcpy(Balls.Y.data(), Positions + Frame.NumBalls, Frame.NumBalls * sizeof(float));
+	memcpy(Balls.Z.data(), Positions + 2 * Frame.NumBalls, Frame.NumBalls * sizeof(float));
+	memcpy(Balls.M.data(), Masses, Frame.NumBalls * sizeof(float));
+}
+
+//=============================================================================
+void CMetaballScenario::Save(std::vector<uint8_t>& Data) const
+{
+	Data.clear();
+	Data.reserve(64 + m_Frames.size() * 16 + m_Values.size() * sizeof(float));
+
+	Write(Data, ScenarioMagic);
+	Write(Data, static_cast<uint32_t>(FILE_VERSION));
+	Write(Data, static_cast<uint32_t>(m_Frames.size()));
+
+	Write(Data, static_cast<uint8_t>(m_Settings.bFiniteSupport));
+	Write(Data, m_Settings.InfluenceRadius);
+	Write(Data, static_cast<uint8_t>(m_Settings.bSplatEnergy));
+	Write(Data, static_cast<uint8_t>(m_Settings.NormalMode));
+	Write(Data, static_cast<uint8_t>(m_Settings.bIncrementalBuild));
+	Write(Data, static_cast<uint8_t>(m_Settings.Polygonizer));
+	Write(Data, m_Settings.OctreeTolerance);
+	Write(Data, static_cast<uint8_t>(m_Settings.bDecimate));
+	Write(Data, m_Settings.DecimationTolerance);
+	Write(Data, m_Settings.DecimationBudget);
+	Write(Data, static_cast<int32_t>(m_Settings.PolygonizerThreads));
+
+	for (size_t i = 0; i < m_Frames.size(); i++)
+	{
+		const SFrame& Frame = m_Frames[i];
+		const bool bHasMasses = i == 0 || Frame.Masses != m_Frames[i - 1].Masses;
+
+		Write(Data, Frame.GridSize);
+		Write(Data, Frame.Scale);
+		Write(Data, Frame.NumBalls);
+		Write(Data, bHasMasses ? FrameHasMasses : static_cast<uint8_t>(0));
+
+		WriteFloats(Data, m_Values.data() + Frame.Positions, 3 * static_cast<size_t>(Frame.NumBalls));
+
+		if (bHasMasses)
+			WriteFloats(Data, m_Values.data() + Frame.Masses, Frame.NumBalls);
+	}
+}
+
+//=============================================================================
+bool CMetaballScenario::Load(const uint8_t* Data, const size_t Size)
+{
+	Reset();
+
+	SScenarioReader Reader = { Data, Size, 0 };
+
+	uint32_t Magic = 0;
+	uint32_t Version = 0;
+	uint32_t NumFrames = 0;
+	uint8_t Flags[6] = {};
+	int32_t Threads = 1;
+
+	bool bValid =
+		Reader.Read(Magic) && Magic == ScenarioMagic &&
+		Reader.Read(Version) && Version == FILE_VERSION &&
+		Reader.Read(NumFrames) &&
+		Reader.Read(Flags[0]) && Reader.Read(m_Settings.InfluenceRadius) &&
+		Reader.Read(Flags[1]) && Reader.Read(Flags[2]) && Reader.Read(Flags[3]) && Reader.Read(Flags[4]) &&
+		Reader.Read(m_Settings.OctreeTolerance) &&
+		Reader.Read(Flags[5]) && Reader.Read(m_Settings.DecimationTolerance) && Reader.Read(m_Settings.DecimationBudget) &&
+		Reader.Read(Threads) &&
+		Flags[2] <= static_cast<uint8_t>(EPolygonizerNormals::GridGradient) &&
+		Flags[4] <= static_cast<uint8_t>(EPolygonizerMode::SurfaceNets);
+
+	if (bValid)
+	{
+		m_Settings.bFiniteSupport = Flags[0] != 0;
+		m_Settings.bSplatEnergy = Flags[1] != 0;
+		m_Settings.NormalMode = static_cast<EPolygonizerNormals>(Flags[2]);
+		m_Settings.bIncrementalBuild = Flags[3] != 0;
+		m_Settings.Polygonizer = static_cast<EPolygonizerMode>(Flags[4]);
+		m_Settings.bDecimate = Flags[5] != 0;
+		m_Settings.PolygonizerThreads = Threads;
+	}
+
+	for (uint32_t i = 0; bValid && i < NumFrames; i++)
+	{
+		SFrame Frame;
+		uint8_t FrameFlags = 0;
+
+		bValid = Reader.Read(Frame.GridSize) && Reader.Read(Frame.Scale) && Reader.Read(Frame.NumBalls) && Reader.Read(FrameFlags) &&
+			Frame.GridSize > 0 && Frame.NumBalls >= 0;
+
+		// The first frame always has masses, and a frame without them keeps the ball count
+		bValid = bValid && ((FrameFlags & FrameHasMasses) || (i > 0 && m_Frames.back().NumBalls == Frame.NumBalls));
+
+		if (!bValid)
+			break;
+
+		Frame.Positions = m_Values.size();
+		bValid = Reader.ReadFloats(m_Values, 3 * static_cast<size_t>(Frame.NumBalls));
+
+		if (FrameFlags & FrameHasMasses)
+		{
+			Frame.Masses = m_Values.size();
+			bValid = bValid && Reader.ReadFloats(m_Values, Frame.NumBalls);
+		}
+		else
+		{
+			Frame.Masses = m_Frames.back().Masses;
+		}
+
+		m_Frames.push_back(Frame);
+	}
+
+	if (!bValid)
+		Reset();
+	else if (!m_Frames.empty())
+		m_Settings.Scale = m_Frames[0].Scale;
+
+	return bValid;
+}
+
+//=============================================================================
+size_t CMetaballScenario::GetAllocatedSize() const
+{
+	return GetVectorAllocatedSize(m_Frames) + GetVectorAllocatedSize(m_Values);
+}
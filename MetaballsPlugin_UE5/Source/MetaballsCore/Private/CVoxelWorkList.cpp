@@ -0,0 +1,20 @@
+#include "CVoxelWorkList.h"
+
+CVoxelWorkList::CVoxelWorkList()
+	: m_nBrick(0)
+{
+	m_Brick.reserve(INITIAL_CAPACITY);
+	m_Other.reserve(INITIAL_CAPACITY);
+}
+
+CVoxelWorkList::~CVoxelWorkList()
+{
+}
+
+//=============================================================================
+void CVoxelWorkList::Clear()
+{
+	m_Brick.clear();
+	m_Other.clear();
+	m_nBrick = 0;
+}
@@ -0,0 +1,67 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+ 
+#pragma once
+
+#include "MetaballsCoreTypes.h"
+
+/**
+ * Cube of the adaptive octree, in grid points. Child and corner i sit at the offset
+ * ((i >> 2) & 1, (i >> 1) & 1, i & 1) times half the size and the size respectively.
+ */
+struct SOctreeNode
+{
+	int32_t	X;
+	int32_t	Y;
+	int32_t	Z;
+	int32_t	Size;
+
+	// First of the eight children, NO_INDEX for leaves
+	int32_t	Children;
+
+	// Vertex of a leaf in the mesh, NO_INDEX until the contour needs it
+	int32_t	Vertex;
+
+	// Bit i is set when corner i is inside the surface
+	uint8_t	Corners;
+};
+
+/**
+ * Octree over the polygonizer grid that the dual contouring mode refines where the field needs it.
+ * Contour walks the tree with the cell, face and edge procedures of Ju et al., "Dual Contouring of
+ * Hermite Data" (2002): every minimal edge the surface crosses gives a quad between the leaves around
+ * it. Leaves of different sizes meet in those quads, so the mesh has no cracks between them.
+ * Nodes are kept in one array that is reused from build to build.
+ */
+class METABALLSCORE_API CAdaptiveOctree
+{
+public:
+	CAdaptiveOctree();
+	~CAdaptiveOctree();
+
+	// Drops all nodes and starts over with a root of nRootSize grid points
+	void  Reset(int nRootSize);
+
+	// Turns a leaf into an inner node and returns the index of its first child
+	int32_t Subdivide(int32_t nNode);
+
+	SOctreeNode& GetNode(const int32_t nNode) { return m_Nodes[nNode]; }
+	const SOctreeNode& GetNode(const int32_t nNode) const { return m_Nodes[nNode]; }
+
+	int32_t GetNumNodes() const { return static_cast<int32_t>(m_Nodes.size()); }
+
+	// Adds four leaf indices per quad to Quads, wound so that the inside of the surface is behind it
+	void  Contour(std::vector<int32_t>& Quads) const;
+
+	size_t GetAllocatedSize() const { return GetVectorAllocatedSize(m_Nodes); }
+
+private:
+	void  CellProc(int32_t nNode, std::vector<int32_t>& Quads) const;
+	void  FaceProc(const int32_t Nodes[2], int nDir, std::vector<int32_t>& Quads) const;
+	void  EdgeProc(const int32_t Nodes[4], int nDir, std::vector<int32_t>& Quads) const;
+	void  ProcessEdge(const int32_t Nodes[4], int nDir, std::vector<int32_t>& Quads) const;
+
+	bool  IsLeaf(const int32_t nNode) const { return m_Nodes[nNode].Children == NO_INDEX; }
+
+	std::vector<SOctreeNode> m_Nodes;
+};
@@ -3,10 +3,12 @@
  
 #pragma once
 
+#include "MetaballsCoreTypes.h"
+
 /**
  * 
  */
-class CMarchingCubes
+class METABALLSCORE_API CMarchingCubes
 {
 public:
 	CMarchingCubes();
@@ -0,0 +1,30 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MetaballsReplayCommandlet.generated.h"
+
+/**
+ * Replays a scenario recorded with AMetaballs::StartRecording through the polygonizer, without a world or
+ * rendering, and logs the time and output of every build. Running it on two builds of the plugin with the
+ * same scenario compares them on exactly the same ball motion.
+ *
+ *   UnrealEditor-Cmd Project.uproject -run=MetaballsReplay -Scenario=<file> [-Csv=<file>] [-Repeat=N]
+ *                    [-Threads=N] [-Polygonizer=mc|octree|sn] -nullrhi
+ *
+ * The recorded settings are used unless overridden. With -Repeat the scenario runs N times and every
+ * frame reports its fastest run.
+ */
+UCLASS()
+class METABALLSPLUGIN_API UMetaballsReplayCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMetaballsReplayCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
@@ -0,0 +1,69 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+ 
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "MetaballsSubsystem.generated.h"
+
+class AMetaballs;
+
+/**
+ * Rebuilds the meshes of the metaballs actors of a playing world. Every frame the actors are ranked by
+ * their screen size, whether they were rendered lately and how many frames their mesh has waited, then
+ * rebuilt in that order while their last rebuild cost still fits the Metaballs.FrameBudgetMs budget.
+ * Actors that do not fit keep the mesh they have and rank higher the next frame.
+ */
+UCLASS()
+class METABALLSPLUGIN_API UMetaballsSubsystem : public UTickableWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+	UMetaballsSubsystem();
+
+	virtual void Deinitialize() override;
+	virtual void Tick(float DeltaTime) override;
+	virtual TStatId GetStatId() const override;
+
+	void RegisterActor(AMetaballs* Actor);
+	void UnregisterActor(AMetaballs* Actor);
+
+	// Frames whose rebuilds took longer than the budget, since the world started
+	UFUNCTION(BlueprintPure, Category = "Metaballs")
+	int32 GetNumBudgetOverruns() const { return m_nNumBudgetOverruns; }
+
+	// Actors that kept their mesh in the last frame
+	UFUNCTION(BlueprintPure, Category = "Metaballs")
+	int32 GetNumDeferredActors() const { return m_nNumDeferred; }
+
+	// Most frames any actor's mesh has been waiting for a rebuild
+	UFUNCTION(BlueprintPure, Category = "Metaballs")
+	int32 GetMaxStaleFrames() const { return m_nMaxStaleFrames; }
+
+	// Game thread time the rebuilds took in the last frame
+	UFUNCTION(BlueprintPure, Category = "Metaballs")
+	float GetLastFrameMs() const { return m_fLastFrameMs; }
+
+private:
+
+	struct SScheduledActor
+	{
+		AMetaballs* Actor;
+		float Priority;
+	};
+
+	float GetPriority(const AMetaballs* Actor) const;
+
+	UPROPERTY()
+	TArray<AMetaballs*> m_Actors;
+
+	// Actors that want a rebuild this frame, highest priority first
+	TArray<SScheduledActor> m_Queue;
+
+	int32	m_nNumBudgetOverruns;
+	int32	m_nNumDeferred;
+	int32	m_nMaxStaleFrames;
+	float	m_fLastFrameMs;
+};
@@ -0,0 +1,449 @@
+// Benchmark suite of the polygonizer core, without the engine. Every case is a seeded animated scene
+// built for a number of frames, for each grid size, ball count, polygonizer mode and support in the sweep.
+//
+//   MetaballsCoreBench [--grids 16,32,64,128] [--balls 1,2,4,8,16,32,64] [--modes mc,octree,sn]
+//                      [--support infinite,finite] [--frames N] [--threads N] [--seed N]
+//                      [--json FILE] [--csv FILE]
+//
+// Reported per case:
+//   build ms       best and mean time of Build over the frames
+//   ns/voxel       polygonize time over the voxels the flood fill visited, 0 for the octree, which visits leaves
+//   ns/sample      time of one field sample at a grid point, measured apart from the build
+//   Mvert/s        vertices produced per second of build
+//   phases         field, classify, normals and emit share of the fill, from one instrumented frame
+//   build MB       peak of the memory the polygonizer holds
+//   open           peak number of open voxels in the flood fill work list
+//   L1D/LLC miss   thousands of L1 data and last level cache misses per build, from the hardware counters
+//                  on Linux, -1 where the counters are not available
+//
+// The JSON and CSV files hold the same rows, for tracking the numbers across commits.
+
+#include "MetaballsStandalone.h"
+#include "CMetaballField.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct SBenchCase
+{
+	int GridSize;
+	int NumBalls;
+	const char* ModeName;
+	EPolygonizerMode Mode;
+	bool bFiniteSupport;
+};
+
+struct SBenchResult
+{
+	SBenchCase Case;
+	double BestMs;
+	double MeanMs;
+	double NsPerVoxel;
+	double NsPerSample;
+	double VerticesPerSecond;
+	double FieldShare;
+	double ClassifyShare;
+	double NormalsShare;
+	double EmitShare;
+	double Voxels;
+	double Triangles;
+	size_t PeakBytes;
+	int32_t PeakOpenVoxels;
+	double L1Misses;
+	double LlcMisses;
+};
+
+// Hardware cache miss counter of the calling thread and the threads it starts afterwards
+class CCacheMissCounter
+{
+public:
+	// L1 data read misses, or last level cache misses
+	explicit CCacheMissCounter(const bool bLastLevel) : m_nFile(-1)
+	{
+#if defined(__linux__)
+		perf_event_attr Attributes;
+		memset(&Attributes, 0, sizeof(Attributes));
+		Attributes.size = sizeof(Attributes);
+		Attributes.type = bLastLevel ? PERF_TYPE_HARDWARE : PERF_TYPE_HW_CACHE;
+		Attributes.config = bLastLevel ? PERF_COUNT_HW_CACHE_MISSES :
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		Attributes.disabled = 1;
+		Attributes.inherit = 1;
+		Attributes.exclude_kernel = 1;
+		Attributes.exclude_hv = 1;
+
+		m_nFile = static_cast<int>(syscall(SYS_perf_event_open, &Attributes, 0, -1, -1, 0));
+#endif
+	}
+
+	~CCacheMissCounter()
+	{
+#if defined(__linux__)
+		if (m_nFile >= 0)
+			close(m_nFile);
+#endif
+	}
+
+	bool IsAvailable() const { return m_nFile >= 0; }
+
+	void Start()
+	{
+#if defined(__linux__)
+		if (m_nFile >= 0)
+		{
+			ioctl(m_nFile, PERF_EVENT_IOC_RESET, 0);
+			ioctl(m_nFile, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	// Misses since Start, -1 without a counter
+	double Stop()
+	{
+#if defined(__linux__)
+		uint64_t Count = 0;
+
+		if (m_nFile >= 0 && ioctl(m_nFile, PERF_EVENT_IOC_DISABLE, 0) == 0 && read(m_nFile, &Count, sizeof(Count)) == sizeof(Count))
+			return static_cast<double>(Count);
+#endif
+		return -1;
+	}
+
+private:
+	int m_nFile;
+};
+
+static const struct
+{
+	const char* Name;
+	EPolygonizerMode Mode;
+} GModes[] =
+{
+	{ "mc", EPolygonizerMode::MarchingCubes },
+	{ "octree", EPolygonizerMode::AdaptiveOctree },
+	{ "sn", EPolygonizerMode::SurfaceNets },
+};
+
+static std::vector<std::string> SplitList(const char* List)
+{
+	std::vector<std::string> Items;
+	std::string Item;
+
+	for (const char* c = List; ; c++)
+	{
+		if (*c == ',' || *c == 0)
+		{
+			if (!Item.empty())
+				Items.push_back(Item);
+
+			Item.clear();
+
+			if (*c == 0)
+				break;
+		}
+		else
+			Item += *c;
+	}
+
+	return Items;
+}
+
+// Peak resident size of the process, 0 where it is not known
+static size_t GetPeakResidentBytes()
+{
+#if defined(__APPLE__)
+	struct rusage Usage;
+	return getrusage(RUSAGE_SELF, &Usage) == 0 ? static_cast<size_t>(Usage.ru_maxrss) : 0;
+#elif defined(__unix__)
+	struct rusage Usage;
+	return getrusage(RUSAGE_SELF, &Usage) == 0 ? static_cast<size_t>(Usage.ru_maxrss) * 1024 : 0;
+#else
+	return 0;
+#endif
+}
+
+// Time of one field sample, over the grid points of a scene frame. The samples walk the grid in
+// rows the way the fill mostly does, but cover all of it, so the ball bins are hit evenly.
+static double MeasureFieldSample(const SMetaBallSoA& Balls, const int nGridSize, const bool bFiniteSupport, const float InfluenceRadius)
+{
+	CMetaballField Field;
+	SPolygonizerOutput Counters;
+
+	Field.Build(Balls, bFiniteSupport, InfluenceRadius);
+
+	// Every grid point up to about a million samples, a regular subset of them beyond
+	const int Stride = std::max(1, static_cast<int>(std::cbrt((nGridSize + 1.0) * (nGridSize + 1.0) * (nGridSize + 1.0) / 1048576.0)));
+	const float VoxelSize = 2.0f / nGridSize;
+	volatile float Sink = 0;
+
+	const double StartTime = MetaballsCoreSeconds();
+
+	for (int z = 0; z <= nGridSize; z += Stride)
+	{
+		for (int y = 0; y <= nGridSize; y += Stride)
+		{
+			float Sum = 0;
+
+			for (int x = 0; x <= nGridSize; x += Stride)
+				Sum += Field.ComputeEnergy(x * VoxelSize - 1, y * VoxelSize - 1, z * VoxelSize - 1, Counters);
+
+			Sink = Sink + Sum;
+		}
+	}
+
+	const double Seconds = MetaballsCoreSeconds() - StartTime;
+
+	return Counters.NumEnergySamples ? Seconds * 1e9 / Counters.NumEnergySamples : 0;
+}
+
+static SBenchResult RunCase(const SBenchCase& Case, const int nNumFrames, const int nNumThreads, const uint32_t nSeed)
+{
+	const CBallScene Scene(nSeed, Case.NumBalls);
+
+	SMetaBallSoA Balls;
+	SMetaBallBuildSettings Settings;
+	CMetaballPolygonizer Polygonizer;
+
+	Settings.Polygonizer = Case.Mode;
+	Settings.bFiniteSupport = Case.bFiniteSupport;
+	Settings.PolygonizerThreads = nNumThreads;
+
+	Polygonizer.SetGridSize(Case.GridSize);
+	Polygonizer.SetParallelFor(StandaloneParallelFor);
+
+	SBenchResult Result = {};
+	Result.Case = Case;
+	Result.BestMs = 1e30;
+
+	double TotalSeconds = 0;
+	double PolygonizeSeconds = 0;
+	double Vertices = 0;
+
+	CCacheMissCounter L1Counter(false);
+	CCacheMissCounter LlcCounter(true);
+
+	// Frame -1 warms the buffers up and is not counted
+	for (int Frame = -1; Frame < nNumFrames; Frame++)
+	{
+		Scene.Pose(Frame, Balls);
+
+		L1Counter.Start();
+		LlcCounter.Start();
+
+		const double StartTime = MetaballsCoreSeconds();
+
+		Polygonizer.Build(Balls, Settings);
+
+		const double Seconds = MetaballsCoreSeconds() - StartTime;
+		const double L1Misses = L1Counter.Stop();
+		const double LlcMisses = LlcCounter.Stop();
+		const SPolygonizerOutput& Output = Polygonizer.GetOutput();
+
+		Result.PeakBytes = std::max(Result.PeakBytes, Polygonizer.GetAllocatedSize());
+		Result.PeakOpenVoxels = std::max(Result.PeakOpenVoxels, Output.PeakOpenVoxels);
+
+		if (Frame < 0)
+			continue;
+
+		Result.BestMs = std::min(Result.BestMs, Seconds * 1000);
+		TotalSeconds += Seconds;
+		PolygonizeSeconds += Polygonizer.GetPolygonizeSeconds();
+		Vertices += static_cast<double>(Output.Vertices.size());
+		Result.Voxels += static_cast<double>(Output.NumVoxels);
+		Result.Triangles += static_cast<double>(Output.Triangles.size() / 3);
+		Result.L1Misses += L1Misses;
+		Result.LlcMisses += LlcMisses;
+	}
+
+	Result.MeanMs = TotalSeconds * 1000 / nNumFrames;
+	Result.NsPerVoxel = Result.Voxels > 0 ? PolygonizeSeconds * 1e9 / Result.Voxels : 0;
+	Result.VerticesPerSecond = TotalSeconds > 0 ? Vertices / TotalSeconds : 0;
+	Result.Voxels /= nNumFrames;
+	Result.Triangles /= nNumFrames;
+	Result.L1Misses = L1Counter.IsAvailable() ? Result.L1Misses / nNumFrames : -1;
+	Result.LlcMisses = LlcCounter.IsAvailable() ? Result.LlcMisses / nNumFrames : -1;
+
+	// One more frame with the voxel timing on, for the split of the fill
+	Settings.bInstrument = true;
+	Scene.Pose(0, Balls);
+	Polygonizer.Build(Balls, Settings);
+
+	const SPolygonizerOutput& Output = Polygonizer.GetOutput();
+
+	if (Output.VoxelCycles)
+	{
+		const double VoxelCycles = static_cast<double>(Output.VoxelCycles);
+
+		Result.FieldShare = Output.FieldCycles / VoxelCycles;
+		Result.ClassifyShare = Output.ClassifyCycles / VoxelCycles;
+		Result.NormalsShare = Output.NormalCycles / VoxelCycles;
+		Result.EmitShare = std::max(1.0 - Result.FieldShare - Result.ClassifyShare - Result.NormalsShare, 0.0);
+	}
+
+	Result.NsPerSample = MeasureFieldSample(Balls, Case.GridSize, Case.bFiniteSupport, Settings.InfluenceRadius);
+
+	return Result;
+}
+
+static void WriteCsv(FILE* File, const std::vector<SBenchResult>& Results)
+{
+	fprintf(File, "grid,balls,mode,support,best_ms,mean_ms,ns_per_voxel,ns_per_sample,vertices_per_second,field_share,classify_share,normals_share,emit_share,voxels,triangles,peak_build_bytes,peak_open_voxels,l1d_misses,llc_misses\n");
+
+	for (const SBenchResult& Result : Results)
+	{
+		fprintf(File, "%d,%d,%s,%s,%.4f,%.4f,%.2f,%.2f,%.0f,%.4f,%.4f,%.4f,%.4f,%.0f,%.0f,%zu,%d,%.0f,%.0f\n",
+			Result.Case.GridSize, Result.Case.NumBalls, Result.Case.ModeName, Result.Case.bFiniteSupport ? "finite" : "infinite",
+			Result.BestMs, Result.MeanMs, Result.NsPerVoxel, Result.NsPerSample, Result.VerticesPerSecond,
+			Result.FieldShare, Result.ClassifyShare, Result.NormalsShare, Result.EmitShare, Result.Voxels, Result.Triangles, Result.PeakBytes,
+			Result.PeakOpenVoxels, Result.L1Misses, Result.LlcMisses);
+	}
+}
+
+static void WriteJson(FILE* File, const std::vector<SBenchResult>& Results, const int nNumFrames, const int nNumThreads, const uint32_t nSeed)
+{
+	fprintf(File, "{\n  \"frames\": %d,\n  \"threads\": %d,\n  \"seed\": %u,\n  \"peak_resident_bytes\": %zu,\n  \"cases\": [\n",
+		nNumFrames, nNumThreads, nSeed, GetPeakResidentBytes());
+
+	for (size_t i = 0; i < Results.size(); i++)
+	{
+		const SBenchResult& Result = Results[i];
+
+		fprintf(File, "    { \"grid\": %d, \"balls\": %d, \"mode\": \"%s\", \"support\": \"%s\", \"best_ms\": %.4f, \"mean_ms\": %.4f, "
+			"\"ns_per_voxel\": %.2f, \"ns_per_sample\": %.2f, \"vertices_per_second\": %.0f, "
+			"\"field_share\": %.4f, \"classify_share\": %.4f, \"normals_share\": %.4f, \"emit_share\": %.4f, "
+			"\"voxels\": %.0f, \"triangles\": %.0f, \"peak_build_bytes\": %zu, \"peak_open_voxels\": %d, \"l1d_misses\": %.0f, \"llc_misses\": %.0f }%s\n",
+			Result.Case.GridSize, Result.Case.NumBalls, Result.Case.ModeName, Result.Case.bFiniteSupport ? "finite" : "infinite",
+			Result.BestMs, Result.MeanMs, Result.NsPerVoxel, Result.NsPerSample, Result.VerticesPerSecond,
+			Result.FieldShare, Result.ClassifyShare, Result.NormalsShare, Result.EmitShare, Result.Voxels, Result.Triangles, Result.PeakBytes,
+			Result.PeakOpenVoxels, Result.L1Misses, Result.LlcMisses, i + 1 < Results.size() ? "," : "");
+	}
+
+	fprintf(File, "  ]\n}\n");
+}
+
+static bool WriteFile(const char* Path, const std::vector<SBenchResult>& Results, const bool bJson, const int nNumFrames, const int nNumThreads, const uint32_t nSeed)
+{
+	FILE* File = fopen(Path, "w");
+
+	if (!File)
+	{
+		fprintf(stderr, "cannot write %s\n", Path);
+		return false;
+	}
+
+	if (bJson)
+		WriteJson(File, Results, nNumFrames, nNumThreads, nSeed);
+	else
+		WriteCsv(File, Results);
+
+	fclose(File);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::string> Grids = SplitList("16,32,64,128");
+	std::vector<std::string> BallCounts = SplitList("1,2,4,8,16,32,64");
+	std::vector<std::string> ModeNames = SplitList("mc,octree,sn");
+	std::vector<std::string> Supports = SplitList("infinite,finite");
+	int nNumFrames = 10;
+	int nNumThreads = 1;
+	uint32_t nSeed = 1;
+	const char* JsonPath = nullptr;
+	const char* CsvPath = nullptr;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const bool bHasValue = i + 1 < argc;
+
+		if (!strcmp(argv[i], "--grids") && bHasValue)
+			Grids = SplitList(argv[++i]);
+		else if (!strcmp(argv[i], "--balls") && bHasValue)
+			BallCounts = SplitList(argv[++i]);
+		else if (!strcmp(argv[i], "--modes") && bHasValue)
+			ModeNames = SplitList(argv[++i]);
+		else if (!strcmp(argv[i], "--support") && bHasValue)
+			Supports = SplitList(argv[++i]);
+		else if (!strcmp(argv[i], "--frames") && bHasValue)
+			nNumFrames = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--threads") && bHasValue)
+			nNumThreads = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--seed") && bHasValue)
+			nSeed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+		else if (!strcmp(argv[i], "--json") && bHasValue)
+			JsonPath = argv[++i];
+		else if (!strcmp(argv[i], "--csv") && bHasValue)
+			CsvPath = argv[++i];
+		else
+		{
+			fprintf(stderr, "usage: %s [--grids 16,32,64,128] [--balls 1,2,4,8,16,32,64] [--modes mc,octree,sn] [--support infinite,finite] "
+				"[--frames N] [--threads N] [--seed N] [--json FILE] [--csv FILE]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<SBenchCase> Cases;
+
+	for (const std::string& Support : Supports)
+	{
+		for (const std::string& ModeName : ModeNames)
+		{
+			const auto* Mode = std::find_if(std::begin(GModes), std::end(GModes), [&ModeName](const auto& Entry) { return ModeName == Entry.Name; });
+
+			if (Mode == std::end(GModes) || (Support != "infinite" && Support != "finite"))
+			{
+				fprintf(stderr, "unknown mode %s or support %s\n", ModeName.c_str(), Support.c_str());
+				return 1;
+			}
+
+			for (const std::string& Grid : Grids)
+			{
+				for (const std::string& Balls : BallCounts)
+					Cases.push_back({ std::max(atoi(Grid.c_str()), 2), std::max(atoi(Balls.c_str()), 1), Mode->Name, Mode->Mode, Support == "finite" });
+			}
+		}
+	}
+
+	printf("%d frames, %d threads, seed %u\n", nNumFrames, nNumThreads, nSeed);
+	printf("%-6s %-8s %-5s %6s %9s %9s %9s %9s %8s %23s %9s %8s %17s\n",
+		"mode", "support", "grid", "balls", "best ms", "mean ms", "ns/voxel", "ns/sample", "Mvert/s", "field/class/norm/emit %", "build MB", "open", "L1D/LLC miss k");
+
+	std::vector<SBenchResult> Results;
+
+	for (const SBenchCase& Case : Cases)
+	{
+		const SBenchResult Result = RunCase(Case, nNumFrames, nNumThreads, nSeed);
+
+		printf("%-6s %-8s %-5d %6d %9.3f %9.3f %9.1f %9.1f %8.2f %5.0f %5.0f %5.0f %5.0f %9.2f %8d %8.0f %8.0f\n",
+			Case.ModeName, Case.bFiniteSupport ? "finite" : "infinite", Case.GridSize, Case.NumBalls,
+			Result.BestMs, Result.MeanMs, Result.NsPerVoxel, Result.NsPerSample, Result.VerticesPerSecond / 1e6,
+			Result.FieldShare * 100, Result.ClassifyShare * 100, Result.NormalsShare * 100, Result.EmitShare * 100, Result.PeakBytes / 1048576.0, Result.PeakOpenVoxels,
+			Result.L1Misses >= 0 ? Result.L1Misses / 1000 : -1, Result.LlcMisses >= 0 ? Result.LlcMisses / 1000 : -1);
+		fflush(stdout);
+
+		Results.push_back(Result);
+	}
+
+	printf("peak resident %.1f MB\n", GetPeakResidentBytes() / 1048576.0);
+
+	if (JsonPath && !WriteFile(JsonPath, Results, true, nNumFrames, nNumThreads, nSeed))
+		return 1;
+
+	if (CsvPath && !WriteFile(CsvPath, Results, false, nNumFrames, nNumThreads, nSeed))
+		return 1;
+
+	return 0;
+}
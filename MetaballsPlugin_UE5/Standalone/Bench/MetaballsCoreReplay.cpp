@@ -0,0 +1,263 @@
+// Replays a scenario recorded by the actor (Metaballs.Record) through the polygonizer core, without the engine,
+// the way the MetaballsReplay commandlet does in the editor. Every frame is built with the recorded grid size,
+// scale and balls, and its time and output are printed.
+//
+//   MetaballsCoreReplay FILE [--csv FILE] [--repeat N] [--threads N] [--mode mc|octree|sn]
+//
+// With --repeat the scenario runs N times and every frame reports its fastest run. A scenario without the
+// engine comes from the seeded bench scene:
+//
+//   MetaballsCoreReplay --record FILE [--grid N] [--balls N] [--frames N] [--seed N]
+
+#include "MetaballsStandalone.h"
+#include "CMetaballScenario.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+struct SReplayFrame
+{
+	int GridSize;
+	int NumBalls;
+	double BuildMs;
+	double FieldMs;
+	double PolygonizeMs;
+	double DecimateMs;
+	size_t Vertices;
+	size_t Triangles;
+	int64_t Voxels;
+	int64_t EnergySamples;
+};
+
+static bool ReadFile(const char* Path, std::vector<uint8_t>& Data)
+{
+	FILE* File = fopen(Path, "rb");
+
+	if (!File)
+		return false;
+
+	fseek(File, 0, SEEK_END);
+	const long Size = ftell(File);
+	fseek(File, 0, SEEK_SET);
+
+	Data.resize(Size > 0 ? static_cast<size_t>(Size) : 0);
+
+	const bool bRead = fread(Data.data(), 1, Data.size(), File) == Data.size();
+
+	fclose(File);
+	return bRead;
+}
+
+static bool WriteFile(const char* Path, const std::vector<uint8_t>& Data)
+{
+	FILE* File = fopen(Path, "wb");
+
+	if (!File)
+		return false;
+
+	const bool bWritten = fwrite(Data.data(), 1, Data.size(), File) == Data.size();
+
+	fclose(File);
+	return bWritten;
+}
+
+static int Record(const char* Path, const int nGridSize, const int nNumBalls, const int nNumFrames, const uint32_t nSeed)
+{
+	const CBallScene Scene(nSeed, nNumBalls);
+
+	CMetaballScenario Scenario;
+	SMetaBallBuildSettings Settings;
+	SMetaBallSoA Balls;
+	std::vector<uint8_t> Data;
+
+	for (int Frame = 0; Frame < nNumFrames; Frame++)
+	{
+		Scene.Pose(Frame, Balls);
+		Scenario.AddFrame(nGridSize, Settings, Balls);
+	}
+
+	Scenario.Save(Data);
+
+	if (!WriteFile(Path, Data))
+	{
+		fprintf(stderr, "cannot write %s\n", Path);
+		return 1;
+	}
+
+	printf("%s: %d frames of %d balls, grid %d, %zu bytes\n", Path, nNumFrames, nNumBalls, nGridSize, Data.size());
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* ScenarioPath = nullptr;
+	const char* RecordPath = nullptr;
+	const char* CsvPath = nullptr;
+	const char* ModeName = nullptr;
+	int nNumRepeats = 1;
+	int nNumThreads = 0;
+	int nGridSize = 32;
+	int nNumBalls = 8;
+	int nNumFrames = 60;
+	uint32_t nSeed = 1;
+	bool bUsage = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const bool bHasValue = i + 1 < argc;
+
+		if (!strcmp(argv[i], "--record") && bHasValue)
+			RecordPath = argv[++i];
+		else if (!strcmp(argv[i], "--csv") && bHasValue)
+			CsvPath = argv[++i];
+		else if (!strcmp(argv[i], "--repeat") && bHasValue)
+			nNumRepeats = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--threads") && bHasValue)
+			nNumThreads = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--mode") && bHasValue)
+			ModeName = argv[++i];
+		else if (!strcmp(argv[i], "--grid") && bHasValue)
+			nGridSize = std::max(atoi(argv[++i]), 2);
+		else if (!strcmp(argv[i], "--balls") && bHasValue)
+			nNumBalls = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--frames") && bHasValue)
+			nNumFrames = std::max(atoi(argv[++i]), 1);
+		else if (!strcmp(argv[i], "--seed") && bHasValue)
+			nSeed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+		else if (argv[i][0] != '-' && !ScenarioPath)
+			ScenarioPath = argv[i];
+		else
+			bUsage = true;
+	}
+
+	if (RecordPath && !bUsage)
+		return Record(RecordPath, nGridSize, nNumBalls, nNumFrames, nSeed);
+
+	if (!ScenarioPath || bUsage)
+	{
+		fprintf(stderr, "usage: %s FILE [--csv FILE] [--repeat N] [--threads N] [--mode mc|octree|sn]\n"
+			"       %s --record FILE [--grid N] [--balls N] [--frames N] [--seed N]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	std::vector<uint8_t> Data;
+	CMetaballScenario Scenario;
+
+	if (!ReadFile(ScenarioPath, Data) || !Scenario.Load(Data.data(), Data.size()))
+	{
+		fprintf(stderr, "%s is no metaballs scenario\n", ScenarioPath);
+		return 1;
+	}
+
+	SMetaBallBuildSettings Settings = Scenario.GetSettings();
+
+	if (nNumThreads)
+		Settings.PolygonizerThreads = nNumThreads;
+
+	if (ModeName)
+	{
+		if (!strcmp(ModeName, "mc"))
+			Settings.Polygonizer = EPolygonizerMode::MarchingCubes;
+		else if (!strcmp(ModeName, "octree"))
+			Settings.Polygonizer = EPolygonizerMode::AdaptiveOctree;
+		else if (!strcmp(ModeName, "sn"))
+			Settings.Polygonizer = EPolygonizerMode::SurfaceNets;
+		else
+		{
+			fprintf(stderr, "unknown mode %s\n", ModeName);
+			return 1;
+		}
+	}
+
+	const int NumFrames = Scenario.GetNumFrames();
+
+	std::vector<SReplayFrame> Frames(NumFrames);
+	CMetaballPolygonizer Polygonizer;
+	SMetaBallSoA Balls;
+
+	Polygonizer.SetParallelFor(StandaloneParallelFor);
+
+	for (int Repeat = 0; Repeat < nNumRepeats; Repeat++)
+	{
+		for (int i = 0; i < NumFrames; i++)
+		{
+			Scenario.GetFrameBalls(i, Balls);
+			Settings.Scale = Scenario.GetFrameScale(i);
+
+			if (Scenario.GetFrameGridSize(i) != Polygonizer.GetGridSize())
+				Polygonizer.SetGridSize(Scenario.GetFrameGridSize(i));
+
+			const double StartTime = MetaballsCoreSeconds();
+
+			Polygonizer.Build(Balls, Settings);
+
+			const double BuildMs = (MetaballsCoreSeconds() - StartTime) * 1000;
+
+			SReplayFrame& Frame = Frames[i];
+
+			if (Repeat > 0 && BuildMs >= Frame.BuildMs)
+				continue;
+
+			const SPolygonizerOutput& Output = Polygonizer.GetOutput();
+
+			Frame.GridSize = Polygonizer.GetGridSize();
+			Frame.NumBalls = Balls.Num();
+			Frame.BuildMs = BuildMs;
+			Frame.FieldMs = Polygonizer.GetFieldSeconds() * 1000;
+			Frame.PolygonizeMs = Polygonizer.GetPolygonizeSeconds() * 1000;
+			Frame.DecimateMs = Settings.bDecimate ? Polygonizer.GetDecimateSeconds() * 1000 : 0;
+			Frame.Vertices = Output.Vertices.size();
+			Frame.Triangles = Output.Triangles.size() / 3;
+			Frame.Voxels = Output.NumVoxels;
+			Frame.EnergySamples = Output.NumEnergySamples;
+		}
+	}
+
+	FILE* Csv = CsvPath ? fopen(CsvPath, "w") : nullptr;
+
+	if (CsvPath && !Csv)
+	{
+		fprintf(stderr, "cannot write %s\n", CsvPath);
+		return 1;
+	}
+
+	if (Csv)
+		fprintf(Csv, "frame,grid,balls,build_ms,field_ms,polygonize_ms,decimate_ms,vertices,triangles,voxels,energy_samples\n");
+
+	printf("%-6s %-5s %6s %9s %9s %9s %9s %9s %9s %9s\n", "frame", "grid", "balls", "build ms", "field", "polygon", "decimate", "vertices", "triangles", "voxels");
+
+	std::vector<double> BuildMs;
+	double TotalMs = 0;
+
+	for (int i = 0; i < NumFrames; i++)
+	{
+		const SReplayFrame& Frame = Frames[i];
+
+		printf("%-6d %-5d %6d %9.3f %9.3f %9.3f %9.3f %9zu %9zu %9lld\n", i, Frame.GridSize, Frame.NumBalls,
+			Frame.BuildMs, Frame.FieldMs, Frame.PolygonizeMs, Frame.DecimateMs, Frame.Vertices, Frame.Triangles, static_cast<long long>(Frame.Voxels));
+
+		if (Csv)
+		{
+			fprintf(Csv, "%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%zu,%zu,%lld,%lld\n", i, Frame.GridSize, Frame.NumBalls,
+				Frame.BuildMs, Frame.FieldMs, Frame.PolygonizeMs, Frame.DecimateMs, Frame.Vertices, Frame.Triangles,
+				static_cast<long long>(Frame.Voxels), static_cast<long long>(Frame.EnergySamples));
+		}
+
+		BuildMs.push_back(Frame.BuildMs);
+		TotalMs += Frame.BuildMs;
+	}
+
+	if (Csv)
+		fclose(Csv);
+
+	if (NumFrames > 0)
+	{
+		std::sort(BuildMs.begin(), BuildMs.end());
+
+		printf("%d frames, best of %d, build mean %.3f ms, median %.3f ms, 95th percentile %.3f ms, max %.3f ms\n",
+			NumFrames, nNumRepeats, TotalMs / NumFrames, BuildMs[NumFrames / 2], BuildMs[std::min(NumFrames * 95 / 100, NumFrames - 1)], BuildMs.back());
+	}
+
+	return 0;
+}
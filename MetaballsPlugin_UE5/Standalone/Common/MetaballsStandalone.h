@@ -0,0 +1,118 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#pragma once
+
+#include "CMetaballPolygonizer.h"
+#include <cmath>
+#include <thread>
+
+// ParallelFor of the standalone builds, a thread per body. The engine build hands the polygonizer its task graph instead.
+inline void StandaloneParallelFor(const int32_t Num, const std::function<void(int32_t)>& Body)
+{
+	std::vector<std::thread> Threads;
+
+	Threads.reserve(Num > 0 ? Num - 1 : 0);
+
+	for (int32_t i = 1; i < Num; i++)
+		Threads.emplace_back(Body, i);
+
+	if (Num > 0)
+		Body(0);
+
+	for (std::thread& Thread : Threads)
+		Thread.join();
+}
+
+// Small linear congruential generator, so a seed gives the same scene on every platform
+class CSceneRandom
+{
+public:
+	explicit CSceneRandom(const uint32_t nSeed) : m_nState(nSeed) {}
+
+	// Uniform in [0, 1)
+	float Next()
+	{
+		m_nState = m_nState * 1664525u + 1013904223u;
+		return static_cast<float>(m_nState >> 8) / 16777216.0f;
+	}
+
+	float Range(const float Min, const float Max) { return Min + (Max - Min) * Next(); }
+
+private:
+	uint32_t m_nState;
+};
+
+// Balls of unit mass spread over the inner part of the ball domain, the way the actor places them
+inline void MakeRandomScene(const uint32_t nSeed, const int nNumBalls, SMetaBallSoA& Balls)
+{
+	CSceneRandom Random(nSeed);
+
+	Balls.SetNum(0);
+
+	for (int i = 0; i < nNumBalls; i++)
+	{
+		const float X = Random.Range(-0.6f, 0.6f);
+		const float Y = Random.Range(-0.6f, 0.6f);
+		const float Z = Random.Range(-0.6f, 0.6f);
+
+		Balls.Add(X, Y, Z, 1.0f);
+	}
+}
+
+// Seeded animated scene. Every ball circles its own center at its own speed, so the balls merge and
+// split over the frames the way the auto fly mode moves them, but the same seed always gives the same frames.
+class CBallScene
+{
+public:
+	CBallScene(const uint32_t nSeed, const int nNumBalls)
+	{
+		CSceneRandom Random(nSeed);
+
+		m_Paths.resize(nNumBalls);
+
+		for (SPath& Path : m_Paths)
+		{
+			for (int Axis = 0; Axis < 3; Axis++)
+			{
+				Path.Center[Axis] = Random.Range(-0.4f, 0.4f);
+				Path.Radius[Axis] = Random.Range(0.05f, 0.25f);
+				Path.Speed[Axis] = Random.Range(0.02f, 0.08f);
+				Path.Phase[Axis] = Random.Range(0.0f, 6.2831853f);
+			}
+		}
+	}
+
+	int  GetNumBalls() const { return static_cast<int>(m_Paths.size()); }
+
+	// Ball positions of a frame, unit masses
+	void Pose(const int nFrame, SMetaBallSoA& Balls) const
+	{
+		Balls.SetNum(GetNumBalls());
+
+		for (int i = 0; i < GetNumBalls(); i++)
+		{
+			const SPath& Path = m_Paths[i];
+			float Position[3];
+
+			for (int Axis = 0; Axis < 3; Axis++)
+				Position[Axis] = Path.Center[Axis] + Path.Radius[Axis] * std::sin(Path.Phase[Axis] + nFrame * Path.Speed[Axis]);
+
+			Balls.X[i] = Position[0];
+			Balls.Y[i] = Position[1];
+			Balls.Z[i] = Position[2];
+			Balls.M[i] = 1.0f;
+		}
+	}
+
+private:
+	struct SPath
+	{
+		float Center[3];
+		float Radius[3];
+		float Speed[3];
+		float Phase[3];
+	};
+
+	std::vector<SPath> m_Paths;
+};
@@ -0,0 +1,1028 @@
+// Unit tests of the polygonizer core. Every test is a function registered with METABALLS_TEST, the
+// executable runs all of them, or the ones whose name contains its argument, and fails if any check did.
+
+#include "MetaballsStandalone.h"
+#include "CBrickGrid.h"
+#include "CMetaballField.h"
+#include "CMetaballScenario.h"
+#include "CVoxelWorkList.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <utility>
+
+// Every heap allocation of the executable goes through these, so a test can count the real ones
+static std::atomic<uint64_t> GNumAllocations(0);
+
+void* operator new(size_t Size)
+{
+	GNumAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	if (void* Pointer = malloc(Size ? Size : 1))
+		return Pointer;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void* Pointer) noexcept
+{
+	free(Pointer);
+}
+
+void operator delete(void* Pointer, size_t) noexcept
+{
+	free(Pointer);
+}
+
+struct STestCase
+{
+	const char* Name;
+	void (*Function)();
+};
+
+static std::vector<STestCase>& GetTests()
+{
+	static std::vector<STestCase> Tests;
+	return Tests;
+}
+
+static int GNumFailedChecks = 0;
+
+struct STestRegistrar
+{
+	STestRegistrar(const char* Name, void (*Function)()) { GetTests().push_back({ Name, Function }); }
+};
+
+#define METABALLS_TEST(Name) \
+	static void Name(); \
+	static STestRegistrar Name##Registrar(#Name, &Name); \
+	static void Name()
+
+#define CHECK(Condition) \
+	do { if (!(Condition)) { GNumFailedChecks++; printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #Condition); } } while (0)
+
+#define CHECK_NEAR(A, B, Tolerance) \
+	do { const double _A = (A), _B = (B); if (!(std::fabs(_A - _B) <= (Tolerance))) { GNumFailedChecks++; printf("  %s:%d: check failed: %s = %g, %s = %g\n", __FILE__, __LINE__, #A, _A, #B, _B); } } while (0)
+
+// Mesh vertices are scaled and have x and z swapped, this is the ball space point of one
+static SVector3f MeshToBallSpace(const SVector3f& Vertex, const float Scale)
+{
+	return SVector3f(Vertex.Z, Vertex.Y, Vertex.X) / Scale;
+}
+
+// Number of triangles on every undirected edge
+static std::map<std::pair<int32_t, int32_t>, int> GetEdgeUses(const SPolygonizerOutput& Output)
+{
+	std::map<std::pair<int32_t, int32_t>, int> Edges;
+
+	for (size_t i = 0; i + 2 < Output.Triangles.size(); i += 3)
+	{
+		for (int Corner = 0; Corner < 3; Corner++)
+		{
+			const int32_t A = Output.Triangles[i + Corner];
+			const int32_t B = Output.Triangles[i + (Corner + 1) % 3];
+
+			Edges[std::make_pair(std::min(A, B), std::max(A, B))]++;
+		}
+	}
+
+	return Edges;
+}
+
+// Every undirected edge of a closed manifold mesh belongs to exactly two triangles
+static int CountOpenEdges(const SPolygonizerOutput& Output)
+{
+	int NumOpen = 0;
+
+	for (const auto& Edge : GetEdgeUses(Output))
+		NumOpen += Edge.second != 2;
+
+	return NumOpen;
+}
+
+// A closed mesh whose sheets may touch along an edge has an even number of triangles on every edge
+static int CountBorderEdges(const SPolygonizerOutput& Output)
+{
+	int NumBorder = 0;
+
+	for (const auto& Edge : GetEdgeUses(Output))
+		NumBorder += Edge.second % 2;
+
+	return NumBorder;
+}
+
+static bool HasValidIndices(const SPolygonizerOutput& Output)
+{
+	for (const int32_t Index : Output.Triangles)
+	{
+		if (Index < 0 || Index >= static_cast<int32_t>(Output.Vertices.size()))
+			return false;
+	}
+
+	return Output.Triangles.size() % 3 == 0 && Output.Normals.size() == Output.Vertices.size();
+}
+
+// Triangles as the positions of their corners, each started at its smallest corner so the winding is
+// kept, and sorted. Meshes of the same surface give the same list, whatever the order of their vertices.
+static std::vector<std::array<float, 9>> GetTrianglePositions(const SPolygonizerOutput& Output)
+{
+	std::vector<std::array<float, 9>> Triangles;
+
+	for (size_t i = 0; i + 2 < Output.Triangles.size(); i += 3)
+	{
+		std::array<std::array<float, 3>, 3> Corners;
+
+		for (int Corner = 0; Corner < 3; Corner++)
+		{
+			const SVector3f& Vertex = Output.Vertices[Output.Triangles[i + Corner]];
+			Corners[Corner] = { Vertex.X, Vertex.Y, Vertex.Z };
+		}
+
+		const int First = static_cast<int>(std::min_element(Corners.begin(), Corners.end()) - Corners.begin());
+		std::array<float, 9> Triangle;
+
+		for (int Corner = 0; Corner < 3; Corner++)
+			std::copy(Corners[(First + Corner) % 3].begin(), Corners[(First + Corner) % 3].end(), Triangle.begin() + 3 * Corner);
+
+		Triangles.push_back(Triangle);
+	}
+
+	std::sort(Triangles.begin(), Triangles.end());
+	return Triangles;
+}
+
+// Vertices with their normals, sorted and without repeats
+static std::vector<std::array<float, 6>> GetVertexNormals(const SPolygonizerOutput& Output)
+{
+	std::vector<std::array<float, 6>> VertexNormals;
+
+	for (size_t i = 0; i < Output.Vertices.size() && i < Output.Normals.size(); i++)
+	{
+		const SVector3f& Vertex = Output.Vertices[i];
+		const SVector3f& Normal = Output.Normals[i];
+
+		VertexNormals.push_back({ Vertex.X, Vertex.Y, Vertex.Z, Normal.X, Normal.Y, Normal.Z });
+	}
+
+	std::sort(VertexNormals.begin(), VertexNormals.end());
+	VertexNormals.erase(std::unique(VertexNormals.begin(), VertexNormals.end()), VertexNormals.end());
+	return VertexNormals;
+}
+
+static bool IsSameMesh(const SPolygonizerOutput& A, const SPolygonizerOutput& B)
+{
+	return A.Vertices.size() == B.Vertices.size() && A.Triangles == B.Triangles &&
+		memcmp(A.Vertices.data(), B.Vertices.data(), A.Vertices.size() * sizeof(SVector3f)) == 0 &&
+		memcmp(A.Normals.data(), B.Normals.data(), A.Normals.size() * sizeof(SVector3f)) == 0;
+}
+
+//=============================================================================
+METABALLS_TEST(FieldEnergyMatchesDirectSum)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(7, 13, Balls);
+
+	for (int Finite = 0; Finite < 2; Finite++)
+	{
+		const float Radius = 0.3f;
+		CMetaballField Field;
+		SPolygonizerOutput Counters;
+
+		Field.Build(Balls, Finite != 0, Radius);
+
+		CSceneRandom Random(11);
+
+		for (int Sample = 0; Sample < 200; Sample++)
+		{
+			const float x = Random.Range(-1, 1);
+			const float y = Random.Range(-1, 1);
+			const float z = Random.Range(-1, 1);
+
+			double Expected = 0;
+
+			for (int i = 0; i < Balls.Num(); i++)
+			{
+				const double dx = x - Balls.X[i], dy = y - Balls.Y[i], dz = z - Balls.Z[i];
+				const double SqDist = std::max<double>(static_cast<float>(dx * dx + dy * dy + dz * dz), 0.0001);
+				const double Falloff = Finite ? std::max(1.0 - SqDist / (Radius * Radius), 0.0) : 1.0;
+
+				Expected += Balls.M[i] * Falloff * Falloff / SqDist;
+			}
+
+			CHECK_NEAR(Field.ComputeEnergy(x, y, z, Counters), Expected, 1e-4 * Expected + 1e-5);
+		}
+
+		CHECK(Counters.NumEnergySamples == 200);
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(FieldNormalIsNegativeGradient)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(3, 8, Balls);
+
+	for (int Finite = 0; Finite < 2; Finite++)
+	{
+		CMetaballField Field;
+		SPolygonizerOutput Counters;
+
+		Field.Build(Balls, Finite != 0, 0.5f);
+
+		CSceneRandom Random(5);
+		int NumChecked = 0;
+
+		for (int Sample = 0; Sample < 200; Sample++)
+		{
+			const float x = Random.Range(-0.8f, 0.8f);
+			const float y = Random.Range(-0.8f, 0.8f);
+			const float z = Random.Range(-0.8f, 0.8f);
+
+			// Central differences break down next to a ball, where the energy is steep
+			if (Field.ComputeEnergy(x, y, z, Counters) > 200)
+				continue;
+
+			const float h = 1e-3f;
+			const SVector3f Gradient(
+				(Field.ComputeEnergy(x + h, y, z, Counters) - Field.ComputeEnergy(x - h, y, z, Counters)) / (2 * h),
+				(Field.ComputeEnergy(x, y + h, z, Counters) - Field.ComputeEnergy(x, y - h, z, Counters)) / (2 * h),
+				(Field.ComputeEnergy(x, y, z + h, Counters) - Field.ComputeEnergy(x, y, z - h, Counters)) / (2 * h));
+			const SVector3f Normal = Field.ComputeNormal(x, y, z, Counters);
+			const float Tolerance = 0.02f * Gradient.Size() + 0.05f;
+
+			CHECK_NEAR(Normal.X, -Gradient.X, Tolerance);
+			CHECK_NEAR(Normal.Y, -Gradient.Y, Tolerance);
+			CHECK_NEAR(Normal.Z, -Gradient.Z, Tolerance);
+			NumChecked++;
+		}
+
+		CHECK(NumChecked > 100);
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(BrickCellsCoverTheBrick)
+{
+	std::vector<int> Hits(CBrickGrid::BRICK_CELLS, 0);
+
+	for (int z = 0; z < CBrickGrid::BRICK_SIZE; z++)
+	for (int y = 0; y < CBrickGrid::BRICK_SIZE; y++)
+	for (int x = 0; x < CBrickGrid::BRICK_SIZE; x++)
+	{
+		// Only the low bits of a grid coordinate select the cell
+		const int Cell = CBrickGrid::GetCell(x + 3 * CBrickGrid::BRICK_SIZE, y + CBrickGrid::BRICK_SIZE, z);
+
+		CHECK(Cell >= 0 && Cell < CBrickGrid::BRICK_CELLS);
+
+		if (Cell < 0 || Cell >= CBrickGrid::BRICK_CELLS)
+			continue;
+
+		Hits[Cell]++;
+
+		CHECK(CBrickGrid::GetCellCoordinate(Cell, 0) == x);
+		CHECK(CBrickGrid::GetCellCoordinate(Cell, 1) == y);
+		CHECK(CBrickGrid::GetCellCoordinate(Cell, 2) == z);
+	}
+
+	CHECK(std::count(Hits.begin(), Hits.end(), 1) == CBrickGrid::BRICK_CELLS);
+}
+
+METABALLS_TEST(StatusBitsCoverTheBrick)
+{
+	std::vector<uint64_t> Words(CBrickGrid::STATUS_WORDS, 0);
+
+	CHECK(sizeof(SGridBrick::VoxelStatus) == CBrickGrid::STATUS_WORDS * sizeof(uint64_t));
+
+	// Every cell has bits of its own, and together they fill the status words
+	for (int Cell = 0; Cell < CBrickGrid::BRICK_CELLS; Cell++)
+	{
+		const uint64_t Bits = static_cast<uint64_t>(CBrickGrid::STATUS_MASK) << CBrickGrid::GetStatusShift(Cell);
+		uint64_t& Word = Words[CBrickGrid::GetStatusWord(Cell)];
+
+		CHECK((Word & Bits) == 0);
+		Word |= Bits;
+	}
+
+	CHECK(std::count(Words.begin(), Words.end(), ~0ull) == CBrickGrid::STATUS_WORDS);
+}
+
+//=============================================================================
+METABALLS_TEST(BrickEpochWrapClearsBricks)
+{
+	CBrickGrid Grid;
+	Grid.SetSize(16);
+
+	// Brick 0 is touched by every build and stays mapped, brick 1 by every other one and goes back to
+	// the pool in between. Both have to come up cleared in every build, also once the epoch ran out.
+	for (int Build = 0; Build < CBrickGrid::MAX_EPOCH + 8; Build++)
+	{
+		Grid.BeginBuild(true);
+
+		CHECK(Grid.GetEpoch() != 0);
+
+		for (int i = 0; i < 1 + (Build & 1); i++)
+		{
+			SGridBrick* Brick = Grid.GetBrick(i * CBrickGrid::BRICK_SIZE, 0, 0);
+
+			if (Brick->Energy[0] != 0 || Brick->PointStatus[0] != 0 || Brick->VoxelStatus[0] != 0 || Brick->EdgeVertices[0][0] != NO_INDEX)
+			{
+				CHECK(!"brick of an earlier build was not cleared");
+				return;
+			}
+
+			Brick->Energy[0] = 1.0f;
+			Brick->PointStatus[0] = ~0ull;
+			Brick->VoxelStatus[0] = ~0ull;
+			Brick->EdgeVertices[0][0] = Build;
+
+			CHECK(Grid.GetBrick(i * CBrickGrid::BRICK_SIZE, 0, 0) == Brick);
+		}
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(BrickPoolIsReusedAcrossSizes)
+{
+	const int Sizes[] = { 32, 64, 16 };
+
+	CBrickGrid Grid;
+	size_t AllocatedSize = 0;
+
+	// The first round allocates the bricks and pages of the largest size, the second only reuses them
+	for (int Round = 0; Round < 2; Round++)
+	{
+		for (const int Size : Sizes)
+		{
+			Grid.SetSize(Size);
+			CHECK(Grid.GetNumBricks() == 0);
+
+			Grid.BeginBuild(false);
+
+			for (int z = 0; z <= Size; z += CBrickGrid::BRICK_SIZE)
+			for (int y = 0; y <= Size; y += CBrickGrid::BRICK_SIZE)
+			for (int x = 0; x <= Size; x += CBrickGrid::BRICK_SIZE)
+				Grid.GetBrick(x, y, z);
+
+			const int BricksPerAxis = Size / CBrickGrid::BRICK_SIZE + 1;
+
+			CHECK(Grid.GetNumBricks() == BricksPerAxis * BricksPerAxis * BricksPerAxis);
+		}
+
+		if (Round == 0)
+			AllocatedSize = Grid.GetAllocatedSize();
+	}
+
+	CHECK(AllocatedSize > 0);
+	CHECK(Grid.GetAllocatedSize() == AllocatedSize);
+}
+
+//=============================================================================
+METABALLS_TEST(LODTierHasHysteresis)
+{
+	struct STier
+	{
+		float ScreenSize;
+	};
+
+	const STier Tiers[] = { { 0.5f }, { 0.2f }, { 0.0f } };
+	const float Hysteresis = 0.15f;
+
+	CHECK(SelectLODTier(Tiers, 0, 0.3f, 0, Hysteresis) == NO_INDEX);
+
+	// Far from the boundaries the screen size alone decides
+	CHECK(SelectLODTier(Tiers, 3, 0.9f, 2, Hysteresis) == 0);
+	CHECK(SelectLODTier(Tiers, 3, 0.3f, 0, Hysteresis) == 1);
+	CHECK(SelectLODTier(Tiers, 3, 0.01f, 0, Hysteresis) == 2);
+
+	// A finer tier has to be passed by the hysteresis share, a coarser one fallen short of by it
+	CHECK(SelectLODTier(Tiers, 3, 0.52f, 1, Hysteresis) == 1);
+	CHECK(SelectLODTier(Tiers, 3, 0.58f, 1, Hysteresis) == 0);
+	CHECK(SelectLODTier(Tiers, 3, 0.52f, 2, Hysteresis) == 1);
+	CHECK(SelectLODTier(Tiers, 3, 0.45f, 0, Hysteresis) == 0);
+	CHECK(SelectLODTier(Tiers, 3, 0.42f, 0, Hysteresis) == 1);
+
+	// A current tier out of range is taken as the nearest one
+	CHECK(SelectLODTier(Tiers, 3, 0.45f, 7, Hysteresis) == 1);
+
+	// A screen size that wavers around a boundary by less than the hysteresis keeps either tier
+	for (int Start = 0; Start < 2; Start++)
+	{
+		int Tier = Start;
+		int NumSwitches = 0;
+
+		for (int Frame = 0; Frame < 100; Frame++)
+		{
+			const int Next = SelectLODTier(Tiers, 3, 0.5f + 0.06f * std::sin(Frame * 0.7f), Tier, Hysteresis);
+
+			NumSwitches += Next != Tier;
+			Tier = Next;
+		}
+
+		CHECK(NumSwitches == 0);
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(WorkListFinishesABrickFirst)
+{
+	const int Max = CVoxelWorkList::MAX_GRID_SIZE - 1;
+	int x, y, z;
+
+	CVoxelWorkList::Unpack(CVoxelWorkList::Pack(Max, 5, Max - 1), x, y, z);
+	CHECK(x == Max && y == 5 && z == Max - 1);
+
+	CVoxelWorkList List;
+
+	// The first voxel taken sets the brick, voxels of that brick then go before older ones of others
+	List.Push(40, 0, 0);
+	List.Push(9, 9, 9);
+	List.Pop(x, y, z);
+	CHECK(x == 9 && y == 9 && z == 9);
+
+	List.Push(20, 0, 0);
+	List.Push(10, 10, 10);
+	List.Push(30, 0, 0);
+	List.Push(15, 14, 8);
+	CHECK(List.Num() == 5);
+
+	List.Pop(x, y, z);
+	CHECK(x == 15 && y == 14 && z == 8);
+	List.Pop(x, y, z);
+	CHECK(x == 10 && y == 10 && z == 10);
+	List.Pop(x, y, z);
+	CHECK(x == 30);
+	List.Pop(x, y, z);
+	CHECK(x == 20);
+	List.Pop(x, y, z);
+	CHECK(x == 40);
+	CHECK(List.IsEmpty());
+}
+
+//=============================================================================
+METABALLS_TEST(SplattedFieldMatchesSampledField)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(5, 10, Balls);
+
+	SMetaBallBuildSettings Settings;
+	Settings.bFiniteSupport = true;
+
+	CMetaballPolygonizer Polygonizer;
+	Polygonizer.SetGridSize(40);
+	Polygonizer.Build(Balls, Settings);
+
+	const SPolygonizerOutput Sampled = Polygonizer.GetOutput();
+
+	Settings.bSplatEnergy = true;
+	Polygonizer.Build(Balls, Settings);
+
+	const SPolygonizerOutput& Splatted = Polygonizer.GetOutput();
+
+	// The energies are summed in another order, the surface is the same up to rounding
+	CHECK(Splatted.Vertices.size() == Sampled.Vertices.size());
+	CHECK(Splatted.Triangles == Sampled.Triangles);
+
+	for (size_t i = 0; i < std::min(Splatted.Vertices.size(), Sampled.Vertices.size()); i++)
+	{
+		CHECK_NEAR(Splatted.Vertices[i].X, Sampled.Vertices[i].X, 1e-3);
+		CHECK_NEAR(Splatted.Vertices[i].Y, Sampled.Vertices[i].Y, 1e-3);
+		CHECK_NEAR(Splatted.Vertices[i].Z, Sampled.Vertices[i].Z, 1e-3);
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(SingleBallIsClosedSphere)
+{
+	SMetaBallSoA Balls;
+	Balls.Add(0.05f, -0.1f, 0.02f, 4.0f);
+
+	SMetaBallBuildSettings Settings;
+	CMetaballPolygonizer Polygonizer;
+
+	Polygonizer.SetGridSize(64);
+	Polygonizer.Build(Balls, Settings);
+
+	const SPolygonizerOutput& Output = Polygonizer.GetOutput();
+
+	// Mass over squared distance reaches the level at sqrt(4 / 100)
+	const float Radius = 0.2f;
+
+	CHECK(Output.Triangles.size() > 300);
+	CHECK(HasValidIndices(Output));
+	CHECK(CountOpenEdges(Output) == 0);
+
+	for (size_t i = 0; i < Output.Vertices.size(); i++)
+	{
+		const SVector3f Offset = MeshToBallSpace(Output.Vertices[i], Settings.Scale) - SVector3f(Balls.X[0], Balls.Y[0], Balls.Z[0]);
+
+		CHECK_NEAR(Offset.Size(), Radius, 0.01);
+		CHECK(SVector3f::DotProduct(Offset, MeshToBallSpace(Output.Normals[i], 1.0f)) > 0);
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(EveryModeFindsTheSurface)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(1, 12, Balls);
+
+	const EPolygonizerMode Modes[] = { EPolygonizerMode::MarchingCubes, EPolygonizerMode::AdaptiveOctree, EPolygonizerMode::SurfaceNets };
+
+	for (int Finite = 0; Finite < 2; Finite++)
+	{
+		for (const EPolygonizerMode Mode : Modes)
+		{
+			SMetaBallBuildSettings Settings;
+			Settings.Polygonizer = Mode;
+			Settings.bFiniteSupport = Finite != 0;
+
+			CMetaballPolygonizer Polygonizer;
+			Polygonizer.SetGridSize(48);
+			Polygonizer.Build(Balls, Settings);
+
+			const SPolygonizerOutput& Output = Polygonizer.GetOutput();
+			SPolygonizerOutput Counters;
+			double MaxError = 0;
+
+			CHECK(Output.Triangles.size() > 300);
+			CHECK(HasValidIndices(Output));
+
+			// A leaf of the octree has one vertex, where two sheets of the surface pass through it
+			// they share it, and an edge between two such leaves gets four triangles
+			if (Mode == EPolygonizerMode::AdaptiveOctree)
+				CHECK(CountBorderEdges(Output) == 0);
+			else
+				CHECK(CountOpenEdges(Output) == 0);
+
+			// Marching cubes interpolates along the voxel edges, the dual modes only place
+			// their vertex inside the voxel, so the level is met more loosely
+			for (const SVector3f& Vertex : Output.Vertices)
+			{
+				const SVector3f Point = MeshToBallSpace(Vertex, Settings.Scale);
+				const float Energy = Polygonizer.GetField().ComputeEnergy(Point.X, Point.Y, Point.Z, Counters);
+
+				MaxError = std::max<double>(MaxError, std::fabs(Energy / Polygonizer.GetLevel() - 1));
+			}
+
+			CHECK(MaxError < (Mode == EPolygonizerMode::MarchingCubes ? 0.2 : 0.5));
+		}
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(GridGradientNormalsFollowTheField)
+{
+	// Bounds of the mean and largest angle in degrees to the analytic normals, they shrink with the voxels
+	struct SBound { int GridSize; double MeanAngle; double MaxAngle; };
+	const SBound Bounds[] = { { 48, 8.0, 20.0 }, { 64, 5.0, 12.0 } };
+
+	for (int Seed = 1; Seed <= 4; Seed++)
+	for (int Finite = 0; Finite < 2; Finite++)
+	{
+		SMetaBallSoA Balls;
+		MakeRandomScene(Seed, 12, Balls);
+
+		double LastMeanAngle = 180.0;
+
+		for (const SBound& Bound : Bounds)
+		{
+			SMetaBallBuildSettings Settings;
+			Settings.bFiniteSupport = Finite != 0;
+
+			CMetaballPolygonizer Analytic;
+			CMetaballPolygonizer Gradient;
+
+			Analytic.SetGridSize(Bound.GridSize);
+			Gradient.SetGridSize(Bound.GridSize);
+
+			Analytic.Build(Balls, Settings);
+
+			Settings.NormalMode = EPolygonizerNormals::GridGradient;
+			Gradient.Build(Balls, Settings);
+
+			// The normal mode does not move the vertices, so the normals pair up by index
+			const std::vector<SVector3f>& Expected = Analytic.GetOutput().Normals;
+			const std::vector<SVector3f>& Normals = Gradient.GetOutput().Normals;
+
+			CHECK(!Normals.empty());
+			CHECK(Normals.size() == Expected.size());
+
+			if (Normals.empty() || Normals.size() != Expected.size())
+				continue;
+
+			double SumAngle = 0;
+			double MaxAngle = 0;
+
+			for (size_t i = 0; i < Normals.size(); i++)
+			{
+				const double Angle = std::acos(std::min(std::max<double>(SVector3f::DotProduct(Normals[i], Expected[i]), -1), 1.0)) * 180.0 / 3.14159265358979;
+
+				SumAngle += Angle;
+				MaxAngle = std::max(MaxAngle, Angle);
+			}
+
+			const double MeanAngle = SumAngle / Normals.size();
+
+			CHECK(MeanAngle < Bound.MeanAngle);
+			CHECK(MaxAngle < Bound.MaxAngle);
+			CHECK(MeanAngle < LastMeanAngle);
+
+			LastMeanAngle = MeanAngle;
+		}
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(ParallelBuildIsDeterministic)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(2, 16, Balls);
+
+	const EPolygonizerMode Modes[] = { EPolygonizerMode::MarchingCubes, EPolygonizerMode::SurfaceNets };
+
+	for (int Finite = 0; Finite < 2; Finite++)
+	for (const EPolygonizerMode Mode : Modes)
+	{
+		SMetaBallBuildSettings Settings;
+		Settings.bFiniteSupport = Finite != 0;
+		Settings.Polygonizer = Mode;
+
+		CMetaballPolygonizer Serial;
+		CMetaballPolygonizer Parallel;
+
+		// A voxel size that is no power of two, so grid points found from different voxels could round apart
+		Serial.SetGridSize(60);
+		Parallel.SetGridSize(60);
+		Parallel.SetParallelFor(StandaloneParallelFor);
+
+		// The slabs are fixed by the grid, not by the thread count
+		Settings.PolygonizerThreads = 4;
+		Parallel.Build(Balls, Settings);
+
+		SPolygonizerOutput FourThreads = Parallel.GetOutput();
+
+		Settings.PolygonizerThreads = 3;
+		Parallel.Build(Balls, Settings);
+
+		CHECK(IsSameMesh(FourThreads, Parallel.GetOutput()));
+
+		// Rebuilding the same balls reproduces the mesh
+		Settings.PolygonizerThreads = 1;
+		Serial.Build(Balls, Settings);
+
+		SPolygonizerOutput First = Serial.GetOutput();
+
+		Serial.Build(Balls, Settings);
+
+		CHECK(IsSameMesh(First, Serial.GetOutput()));
+
+		// Slabs find the vertices in another order, the surface and its normals are the same.
+		// Edges on the planes between slabs get one vertex, like every other edge.
+		CHECK(FourThreads.Vertices.size() == First.Vertices.size());
+		CHECK(GetTrianglePositions(FourThreads) == GetTrianglePositions(First));
+		CHECK(GetVertexNormals(FourThreads) == GetVertexNormals(First));
+		CHECK(CountOpenEdges(FourThreads) == CountOpenEdges(First));
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(SlicedBuildMatchesFullBuild)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(4, 10, Balls);
+
+	SMetaBallBuildSettings Settings;
+	CMetaballPolygonizer Full;
+	CMetaballPolygonizer Sliced;
+
+	Full.SetGridSize(48);
+	Sliced.SetGridSize(48);
+	Full.Build(Balls, Settings);
+
+	Sliced.BeginSlicedBuild(Balls, Settings);
+
+	int NumSlices = 1;
+
+	while (!Sliced.ContinueSlicedBuild(500, 1.0))
+		NumSlices++;
+
+	CHECK(NumSlices > 1);
+	CHECK(!Sliced.IsSlicedBuildActive());
+	CHECK(IsSameMesh(Full.GetOutput(), Sliced.GetOutput()));
+}
+
+//=============================================================================
+METABALLS_TEST(IncrementalBuildMatchesFullBuild)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(6, 10, Balls);
+
+	// Only with finite support does a ball leave the bricks outside its reach unchanged
+	SMetaBallBuildSettings Settings;
+	Settings.bFiniteSupport = true;
+
+	CMetaballPolygonizer Full;
+	CMetaballPolygonizer Incremental;
+
+	Full.SetGridSize(64);
+	Incremental.SetGridSize(64);
+
+	for (int Frame = 0; Frame < 5; Frame++)
+	{
+		// One ball moves, the bricks away from it keep their fragments
+		Balls.X[0] += 0.01f;
+
+		Settings.bIncrementalBuild = false;
+		Full.Build(Balls, Settings);
+
+		Settings.bIncrementalBuild = true;
+		Incremental.Build(Balls, Settings);
+
+		CHECK(Incremental.GetOutput().Triangles.size() == Full.GetOutput().Triangles.size());
+		CHECK(GetTrianglePositions(Incremental.GetOutput()) == GetTrianglePositions(Full.GetOutput()));
+		CHECK(HasValidIndices(Incremental.GetOutput()));
+
+		// The moved ball dirties some bricks, but far from all of them
+		if (Frame > 0)
+		{
+			CHECK(Incremental.GetDirtyFraction() > 0.0f);
+			CHECK(Incremental.GetDirtyFraction() < 0.5f);
+		}
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(MovingSceneStopsReallocating)
+{
+	enum EBuild { Serial, Parallel, ParallelSurfaceNets, Incremental, Sliced, NumBuilds };
+
+	const CBallScene Scene(3, 16);
+	const int NumFrames = 60;
+
+	// The frames are played again one brick, and one slab, higher and lower, so every slab and
+	// fragment gets loads its neighbor had before. Buffers kept per slab or per brick regrow then.
+	const float Shifts[] = { 0.0f, 0.25f, -0.25f };
+
+	for (int Build = 0; Build < NumBuilds; Build++)
+	{
+		SMetaBallBuildSettings Settings;
+		Settings.Polygonizer = Build == ParallelSurfaceNets ? EPolygonizerMode::SurfaceNets : EPolygonizerMode::MarchingCubes;
+		Settings.PolygonizerThreads = Build == Parallel || Build == ParallelSurfaceNets ? 4 : 1;
+		Settings.bFiniteSupport = Build == Incremental;
+		Settings.bIncrementalBuild = Build == Incremental;
+
+		CMetaballPolygonizer Polygonizer;
+		Polygonizer.SetGridSize(64);
+		Polygonizer.SetParallelFor(StandaloneParallelFor);
+
+		SMetaBallSoA Balls;
+		uint32_t NumWarmUpReallocations = 0;
+		uint32_t NumFirstPlayReallocations = 0;
+		size_t WarmUpSize = 0;
+
+		// The shifted surface can map a few more grid bricks at once, only the second play of
+		// all of them has to leave the grid alone as well
+		for (int Play = 0; Play < 2; Play++)
+		{
+			for (const float Shift : Shifts)
+			{
+				for (int Frame = 0; Frame < NumFrames; Frame++)
+				{
+					Scene.Pose(Frame, Balls);
+
+					// Grid 64 has 8 slabs of 8 layers, a brick and a slab are 0.25 high
+					for (int i = 0; i < Balls.Num(); i++)
+					{
+						Balls.X[i] *= 0.5f;
+						Balls.Y[i] *= 0.5f;
+						Balls.Z[i] = Balls.Z[i] * 0.5f + Shift;
+					}
+
+					if (Build == Sliced)
+					{
+						Polygonizer.BeginSlicedBuild(Balls, Settings);
+
+						while (Polygonizer.IsSlicedBuildActive())
+							Polygonizer.ContinueSlicedBuild(500, 1.0);
+					}
+					else
+					{
+						Polygonizer.Build(Balls, Settings);
+					}
+				}
+
+				if (Play == 0 && Shift == 0.0f)
+				{
+					NumWarmUpReallocations = Polygonizer.GetNumReallocatingBuilds();
+					WarmUpSize = Polygonizer.GetAllocatedSize();
+				}
+			}
+
+			if (Play == 0)
+			{
+				CHECK(Polygonizer.GetAllocatedSize() == WarmUpSize);
+				NumFirstPlayReallocations = Polygonizer.GetNumReallocatingBuilds();
+			}
+		}
+
+		CHECK(NumWarmUpReallocations > 0);
+		CHECK(Polygonizer.GetNumReallocatingBuilds() == NumFirstPlayReallocations);
+	}
+}
+
+//=============================================================================
+// Runs the bodies on the calling thread, unlike a thread pool it allocates nothing
+static void SerialParallelFor(const int32_t Num, const std::function<void(int32_t)>& Body)
+{
+	for (int32_t i = 0; i < Num; i++)
+		Body(i);
+}
+
+METABALLS_TEST(WarmSceneDoesNotAllocate)
+{
+	enum EBuild { Serial, Parallel, ParallelSurfaceNets, Incremental, Sliced, Octree, Decimated, SplatGridGradient, NumBuilds };
+
+	const CBallScene Scene(3, 16);
+	const int NumFrames = 30;
+	const float Shifts[] = { 0.0f, 0.25f, -0.25f };
+
+	for (int Build = 0; Build < NumBuilds; Build++)
+	{
+		SMetaBallBuildSettings Settings;
+		Settings.Polygonizer = Build == ParallelSurfaceNets ? EPolygonizerMode::SurfaceNets :
+			(Build == Octree ? EPolygonizerMode::AdaptiveOctree : EPolygonizerMode::MarchingCubes);
+		Settings.PolygonizerThreads = Build == Parallel || Build == ParallelSurfaceNets || Build == Decimated ? 4 : 1;
+		Settings.bFiniteSupport = Build == Incremental || Build == SplatGridGradient;
+		Settings.bIncrementalBuild = Build == Incremental;
+		Settings.bSplatEnergy = Build == SplatGridGradient;
+		Settings.bDecimate = Build == Decimated;
+
+		if (Build == SplatGridGradient)
+			Settings.NormalMode = EPolygonizerNormals::GridGradient;
+
+		CMetaballPolygonizer Polygonizer;
+		Polygonizer.SetGridSize(64);
+		Polygonizer.SetParallelFor(SerialParallelFor);
+
+		SMetaBallSoA Balls;
+
+		// Half of the frames of MovingSceneStopsReallocating. The first play grows the buffers, the second
+		// sees every jump from the last frame back to the first, the third has to reuse all of it.
+		uint64_t NumAllocations = 0;
+
+		for (int Play = 0; Play < 3; Play++)
+		{
+			const uint64_t PlayStart = GNumAllocations.load();
+
+			for (const float Shift : Shifts)
+			{
+				for (int Frame = 0; Frame < NumFrames; Frame++)
+				{
+					Scene.Pose(Frame, Balls);
+
+					for (int i = 0; i < Balls.Num(); i++)
+					{
+						Balls.X[i] *= 0.5f;
+						Balls.Y[i] *= 0.5f;
+						Balls.Z[i] = Balls.Z[i] * 0.5f + Shift;
+					}
+
+					if (Build == Sliced)
+					{
+						Polygonizer.BeginSlicedBuild(Balls, Settings);
+
+						while (Polygonizer.IsSlicedBuildActive())
+							Polygonizer.ContinueSlicedBuild(500, 1.0);
+					}
+					else
+					{
+						Polygonizer.Build(Balls, Settings);
+					}
+				}
+			}
+
+			NumAllocations = GNumAllocations.load() - PlayStart;
+		}
+
+		if (NumAllocations != 0)
+			printf("  build %d allocated %llu times\n", Build, static_cast<unsigned long long>(NumAllocations));
+
+		CHECK(NumAllocations == 0);
+	}
+}
+
+//=============================================================================
+METABALLS_TEST(DecimationKeepsAValidMesh)
+{
+	SMetaBallSoA Balls;
+	MakeRandomScene(8, 12, Balls);
+
+	SMetaBallBuildSettings Settings;
+	CMetaballPolygonizer Polygonizer;
+
+	Polygonizer.SetGridSize(64);
+	Polygonizer.Build(Balls, Settings);
+
+	const size_t NumTriangles = Polygonizer.GetOutput().Triangles.size() / 3;
+
+	Settings.bDecimate = true;
+	Settings.DecimationBudget = static_cast<int32_t>(NumTriangles / 8);
+	Polygonizer.Build(Balls, Settings);
+
+	const SPolygonizerOutput& Output = Polygonizer.GetOutput();
+
+	CHECK(Polygonizer.GetNumUndecimatedTriangles() == static_cast<int32_t>(NumTriangles));
+	CHECK(Output.Triangles.size() / 3 <= static_cast<size_t>(Settings.DecimationBudget));
+	CHECK(Output.Triangles.size() > 0);
+	CHECK(HasValidIndices(Output));
+}
+
+//=============================================================================
+METABALLS_TEST(ScenarioRoundTrips)
+{
+	const CBallScene Scene(9, 5);
+
+	SMetaBallBuildSettings Settings;
+	Settings.Polygonizer = EPolygonizerMode::SurfaceNets;
+	Settings.bDecimate = true;
+	Settings.DecimationBudget = 300;
+
+	CMetaballScenario Recording;
+	SMetaBallSoA Balls;
+
+	for (int Frame = 0; Frame < 6; Frame++)
+	{
+		Scene.Pose(Frame, Balls);
+
+		// The masses change once, after the third frame
+		if (Frame >= 3)
+			Balls.M[2] = 1.5f;
+
+		Recording.AddFrame(Frame < 4 ? 24 : 32, Settings, Balls);
+	}
+
+	std::vector<uint8_t> Data;
+	Recording.Save(Data);
+
+	// Positions of every frame, the masses of only two of them
+	CHECK(Data.size() < 64 + 6 * (16 + 5 * 12) + 2 * 5 * 4);
+
+	CMetaballScenario Scenario;
+	CHECK(Scenario.Load(Data.data(), Data.size()));
+	CHECK(Scenario.GetNumFrames() == 6);
+	CHECK(Scenario.GetSettings().Polygonizer == EPolygonizerMode::SurfaceNets);
+	CHECK(Scenario.GetSettings().bDecimate && Scenario.GetSettings().DecimationBudget == 300);
+	CHECK(Scenario.GetFrameGridSize(3) == 24 && Scenario.GetFrameGridSize(4) == 32);
+
+	SMetaBallSoA Loaded;
+
+	for (int Frame = 0; Frame < 6; Frame++)
+	{
+		Scene.Pose(Frame, Balls);
+
+		if (Frame >= 3)
+			Balls.M[2] = 1.5f;
+
+		Scenario.GetFrameBalls(Frame, Loaded);
+
+		CHECK(Loaded.X == Balls.X && Loaded.Y == Balls.Y && Loaded.Z == Balls.Z && Loaded.M == Balls.M);
+	}
+
+	// A cut off file is rejected as a whole
+	CHECK(!Scenario.Load(Data.data(), Data.size() - 1));
+	CHECK(Scenario.GetNumFrames() == 0);
+
+	Data[0] ^= 1;
+	CHECK(!Scenario.Load(Data.data(), Data.size()));
+}
+
+//=============================================================================
+int main(int argc, char** argv)
+{
+	const char* Filter = argc > 1 ? argv[1] : "";
+	int NumRun = 0;
+	int NumFailed = 0;
+
+	for (const STestCase& Test : GetTests())
+	{
+		if (!strstr(Test.Name, Filter))
+			continue;
+
+		const int FailedChecks = GNumFailedChecks;
+
+		printf("%s\n", Test.Name);
+		Test.Function();
+
+		NumRun++;
+		NumFailed += GNumFailedChecks != FailedChecks;
+	}
+
+	printf("%d tests, %d failed\n", NumRun, NumFailed);
+
+	return NumRun > 0 && NumFailed == 0 ? 0 : 1;
+}